@@ -0,0 +1,160 @@
+#ifndef __CACHESIM_H
+#define __CACHESIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "rscs.h"
+#include "icache.h"
+
+struct Machine;
+
+/* Cache hierarchy simulator.
+ * Models split L1 instruction and data caches in front of a unified L2
+ * (write back, write allocate, no prefetching) and counts hits and misses
+ * per level and per PC, to see the memory locality of guest code. Only
+ * system memory is cached, device registers are not.
+ *
+ * The reference interpreter appends every instruction fetch and every load
+ * and store to a batch of CacheSimAccess records, full batches are run
+ * through the cache model by a background thread while the guest goes on
+ * with the next one. machine_run() switches to the reference interpreter
+ * while the simulator is on, so the fast interpreter and translated code
+ * carry no hooks for it. DMA transfers bypass the caches and don't
+ * invalidate them.
+ */
+#define CACHESIM_BATCH 65536 // records
+#define CACHESIM_BUFFERS 4   // batches in flight to the simulator thread
+#define CACHESIM_REPORT_TOP_PCS 20
+
+enum { CACHESIM_L1I, CACHESIM_L1D, CACHESIM_L2, CACHESIM_LEVELS };
+enum { CACHESIM_POLICY_LRU, CACHESIM_POLICY_PLRU };
+
+/* Kind of access, kept in the low bits of CacheSimAccess.pc */
+enum { CACHESIM_FETCH, CACHESIM_READ, CACHESIM_WRITE };
+
+struct CacheSimLevelConfig {
+  uint32_t size;      // bytes, 0 leaves the level out (L2 only)
+  uint32_t ways;
+  uint32_t line_size; // bytes, power of two
+  uint8_t policy;     // CACHESIM_POLICY_*, PLRU needs a power of two ways up to 64
+};
+
+struct CacheSimConfig {
+  struct CacheSimLevelConfig levels[CACHESIM_LEVELS];
+};
+
+struct CacheSimLevel {
+  struct CacheSimLevelConfig config;
+  uint32_t sets;
+  uint8_t line_shift;
+  uint32_t *tags;   // line address + 1 per way, 0 if invalid
+  uint8_t *dirty;
+  uint64_t *stamps; // last use per way, LRU
+  uint64_t *trees;  // tree bits per set, PLRU
+  uint64_t clock;
+
+  uint64_t accesses;
+  uint64_t misses;
+  uint64_t writebacks;
+};
+
+struct CacheSimPcStats {
+  uint64_t fetches;
+  uint64_t fetch_misses;  // L1I
+  uint64_t accesses;      // loads and stores
+  uint64_t access_misses; // L1D
+  uint64_t l2_misses;
+};
+
+struct CacheSimAccess {
+  uint32_t pc; // | CACHESIM_*
+  uint32_t address;
+};
+
+struct CacheSimBuffer {
+  struct CacheSimAccess records[CACHESIM_BATCH];
+  uint32_t count;
+};
+
+struct CacheSim {
+  /* written by the machine's thread only */
+  struct CacheSimAccess *cursor;
+  struct CacheSimAccess *end; // of the current batch, less room for a split access
+  uint32_t line_mask; // of the shortest line, accesses crossing it are split
+
+  /* the simulator thread's, read once it went idle */
+  struct CacheSimLevel levels[CACHESIM_LEVELS];
+  struct CacheSimPcStats *pc_stats; // one per system memory word, committed on use
+  uint32_t pc_stats_size; // bytes of system memory covered
+
+  /* shared with the simulator thread */
+  pthread_t simulator;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct CacheSimBuffer buffers[CACHESIM_BUFFERS];
+  uint64_t submitted; // batches handed to the simulator
+  uint64_t simulated; // batches the simulator is done with
+  bool stopping;
+};
+
+/* Defaults: 32K 8 way L1I and L1D, 1M 16 way L2, 64 byte lines, LRU */
+void cachesim_default_config(struct CacheSimConfig *config);
+
+/* Changes `config` as given by a comma separated list of
+ *   l1i|l1d|l2=size[:ways[:line_size[:lru|plru]]]
+ * e.g. "l1d=16k:4,l2=256k:8:128:plru". "default" changes nothing.
+ */
+bool cachesim_parse_config(const char *spec, struct CacheSimConfig *config);
+
+bool cachesim_start(struct Machine *m, const struct CacheSimConfig *config);
+void cachesim_stop(struct Machine *m);
+void cachesim_submit(struct CacheSim *sim);
+
+/* Waits for the simulator to catch up and prints the results */
+void cachesim_report(struct Machine *m, FILE *out);
+
+/* Recording, called by the reference interpreter */
+static inline void cachesim_record(struct CacheSim *sim, uint32_t pc, uint8_t kind,
+                                   uint32_t address, uint8_t size)
+{
+  struct CacheSimAccess *cursor = sim->cursor;
+
+  cursor->pc = pc | kind;
+  cursor->address = address;
+  cursor++;
+
+  /* rare, only misaligned accesses cross a line */
+  if ((address & sim->line_mask) + size > sim->line_mask + 1) {
+    cursor->pc = pc | kind;
+    cursor->address = address + size - 1;
+    cursor++;
+  }
+
+  sim->cursor = cursor;
+  if (cursor >= sim->end)
+    cachesim_submit(sim);
+}
+
+#define CACHESIM_FETCH(m, d)                                                  \
+  do {                                                                        \
+    if ((m)->cachesim)                                                        \
+      cachesim_record((m)->cachesim, (d)->pc, CACHESIM_FETCH, (d)->pc,        \
+                      SIZE_WORD);                                             \
+  } while (0)
+
+#define CACHESIM_READ(m, pc, address, size)                                   \
+  do {                                                                        \
+    if ((m)->cachesim)                                                        \
+      cachesim_record((m)->cachesim, pc, CACHESIM_READ, address, size);       \
+  } while (0)
+
+#define CACHESIM_WRITE(m, pc, address, size)                                  \
+  do {                                                                        \
+    if ((m)->cachesim)                                                        \
+      cachesim_record((m)->cachesim, pc, CACHESIM_WRITE, address, size);      \
+  } while (0)
+
+#endif
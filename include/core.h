@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+struct Machine;
+struct DecodedInstruction;
+
 /* FSM states */
 enum {
   STATE_INIT,
@@ -16,17 +19,20 @@ enum {
   STATE_HALT
 };
 
-struct FSM_stuff {
-  uint8_t current_state;
-  uint8_t next_state;
-  uint32_t current_instruction;
+/* Reference implementation state */
+struct Core {
+  uint8_t fsm_current_state;
+  uint8_t fsm_next_state;
+  const struct DecodedInstruction *decoded;
+  uint32_t execute_op1;
+  uint32_t execute_op2;
 };
 
-void core_init();
-void fsm_init();
-bool fsm_cycle_state();
+void core_init(struct Machine *m);
+void fsm_init(struct Machine *m);
+bool fsm_cycle_state(struct Machine *m);
 
-void decode();
+void decode(struct Machine *m);
 union Decoder {
   uint32_t instruction;
   struct {
@@ -66,19 +72,14 @@ enum {
   BLOCK_MEMORY,
   BLOCK_BRANCH,
   BLOCK_REGISTER,
-  BLOCK_PLH_4,
+  BLOCK_ATOMIC,
   BLOCK_PLH_5,
   BLOCK_PLH_6,
   BLOCK_CONTROL
 };
 
-static inline void inc_pc();
-void execute_instruction();
-
-static void execute_arith(uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2);
-static void execute_memory(uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2);
-static void execute_branch(uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2);
-static void execute_ctrl(uint8_t opcode);
+void execute_instruction(struct Machine *m);
+void execute_decoded(struct Machine *m, const struct DecodedInstruction *entry);
 
 enum {
   OPCODE_ADD,
@@ -103,10 +104,26 @@ enum {
   OPCODE_CMP,
 };
 
+/* Atomic memory access, see smp.h. The address is op1 + op2 like for
+ * loads, dst is the operand and receives the old word:
+ *   SWAP    exchange dst with the word
+ *   CAS     store dst if the word equals CR, the flags compare the old
+ *           word with CR (ZF set on success)
+ *   FADD    add dst to the word
+ *   FENCE   order all accesses before against all after, see new code
+ *   HARTID  dst = id of the hart
+ */
+enum { OPCODE_SWAP, OPCODE_CAS, OPCODE_FADD, OPCODE_FENCE, OPCODE_HARTID };
+
 /* TODO add these opcodes to enum */
 #define OPCODE_BRK 0
+#define OPCODE_WFI 1  // wait for interrupt, see intc.h
+#define OPCODE_EI 2   // enable interrupts
+#define OPCODE_DI 3   // disable interrupts
+#define OPCODE_IRET 4 // return from interrupt
 #define OPCODE_HALT 7
 
-uint8_t check_ctrl_regs();
+uint8_t check_ctrl_regs(struct Machine *m);
+void core_dump_error(struct Machine *m, uint32_t instruction);
 
 #endif
@@ -0,0 +1,64 @@
+#ifndef __DMA_H
+#define __DMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Machine;
+
+/* DMA engine for bulk copies, fills and compares in system memory.
+ * The guest sets up the registers and writes a command, the transfer runs
+ * on the host (memmove(), memset(), memcmp()) and is complete before the
+ * store of the command retires. Completion is reported in STATUS and
+ * raises INTC_LINE_DMA. Code the transfer overwrites is invalidated like
+ * for stores of the guest. Registers are word sized, relative to
+ * MMIO_DMA_START:
+ *   DMA_REG_SOURCE       source address (copy, compare)
+ *   DMA_REG_DESTINATION  destination address
+ *   DMA_REG_LENGTH       bytes to transfer
+ *   DMA_REG_VALUE        fill byte, in the low 8 bits
+ *   DMA_REG_COMMAND      writing DMA_COMMAND_* starts a transfer
+ *   DMA_REG_STATUS       DMA_STATUS_* of the last transfer (read only)
+ *   DMA_REG_RESULT       compare: offset of the first differing byte, or
+ *                        the length if there is none (read only)
+ * Both ranges have to be in system memory, otherwise nothing is
+ * transferred and DMA_STATUS_ERROR is set. Overlapping copies behave like
+ * memmove().
+ */
+#define DMA_REG_SOURCE      0x00
+#define DMA_REG_DESTINATION 0x04
+#define DMA_REG_LENGTH      0x08
+#define DMA_REG_VALUE       0x0c
+#define DMA_REG_COMMAND     0x10
+#define DMA_REG_STATUS      0x14
+#define DMA_REG_RESULT      0x18
+
+enum { DMA_COMMAND_COPY = 1, DMA_COMMAND_FILL, DMA_COMMAND_COMPARE };
+
+#define DMA_STATUS_DONE     0x1
+#define DMA_STATUS_ERROR    0x2
+#define DMA_STATUS_MISMATCH 0x4 // compare found a difference
+
+struct DmaStats {
+  uint64_t transfers;
+  uint64_t bytes;
+  uint64_t errors;
+};
+
+struct Dma {
+  uint32_t source;
+  uint32_t destination;
+  uint32_t length;
+  uint32_t value;
+  uint32_t status;
+  uint32_t result;
+  struct DmaStats stats;
+};
+
+void dma_init(struct Machine *m);
+void dma_dump_stats(struct Machine *m);
+
+void dma_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size);
+uint32_t dma_read(struct Machine *m, uint32_t address, uint8_t size);
+
+#endif
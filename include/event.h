@@ -0,0 +1,46 @@
+#ifndef __EVENT_H
+#define __EVENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Machine;
+
+/* Virtual time and timed device events.
+ * The virtual clock advances by one with every retired instruction and
+ * jumps ahead to the next event while the guest waits for an interrupt
+ * (OPCODE_WFI), so it is the same for every engine and every way a run is
+ * split up. Devices schedule callbacks at clock values in a small queue
+ * ordered by time, machine_run() ends each engine run at the earliest one
+ * and runs what is due in between, the engines never look at the queue.
+ * A device has at most one event queued, scheduling its handler again
+ * moves the event.
+ */
+#define EVENT_QUEUE_SIZE 16
+#define EVENT_NEVER UINT64_MAX
+
+typedef void (*EVENT_HANDLER)(struct Machine *m, uint64_t when);
+
+struct Event {
+  uint64_t when;
+  EVENT_HANDLER handler;
+};
+
+struct EventQueue {
+  struct Event heap[EVENT_QUEUE_SIZE]; // binary min heap on when
+  uint32_t count;
+  uint64_t idle; // clock ticks skipped while waiting for interrupts
+};
+
+void event_init(struct Machine *m);
+uint64_t event_clock(const struct Machine *m);
+bool event_schedule(struct Machine *m, EVENT_HANDLER handler, uint64_t when);
+void event_cancel(struct Machine *m, EVENT_HANDLER handler);
+void event_run_due(struct Machine *m, uint64_t now);
+
+static inline uint64_t event_next(const struct EventQueue *queue)
+{
+  return queue->count ? queue->heap[0].when : EVENT_NEVER;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __GDB_H
+#define __GDB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Machine;
+
+/* GDB remote serial protocol stub.
+ * gdb_serve() waits for one debugger connection and runs the machine on
+ * its behalf: registers (the general purpose registers followed by a flags
+ * register with ZF in bit 0 and NF in bit 1), system memory, breakpoints
+ * (Z0/Z1, see icache_insert_breakpoint()), continue, single step and
+ * interrupting a running guest with Ctrl-C.
+ * The address is host:port or :port for TCP, anything with a '/' in it is
+ * taken as the path of a unix socket.
+ */
+#define GDB_PACKET_SIZE 4096
+#define GDB_RUN_SLICE (1 << 20) // instructions run between checks for Ctrl-C
+
+enum {
+  GDB_DETACHED, // the debugger detached, the machine can keep running
+  GDB_EXITED,   // the guest halted or the debugger killed it
+  GDB_FAILED,
+};
+
+uint8_t gdb_serve(struct Machine *m, const char *address);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __ICACHE_H
+#define __ICACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Machine;
+
+/* Decoded instruction cache.
+ * Instructions fetched from system memory are decoded once and kept here,
+ * keyed by the guest PC. Direct mapped, ICACHE_ENTRIES must be a power of two.
+ */
+#define ICACHE_ENTRIES 4096
+#define ICACHE_MAX_BREAKPOINTS 64
+
+struct DecodedInstruction {
+  uint32_t pc;          // tag
+  uint32_t instruction; // raw instruction word
+  uint32_t imm;         // immediate, already sign extended for CODING_SCHEME_SI
+  uint8_t block;
+  uint8_t scheme;
+  uint8_t opcode;
+  uint8_t dstreg;
+  uint8_t srcreg;
+  uint8_t src2reg;
+  uint16_t handler;     // index into the fast interpreter dispatch table
+  bool valid;
+  uint32_t branch_target; // of the branch a CMP is fused with, see HANDLER_FUSED_CMP()
+};
+
+struct IcacheStats {
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct Icache {
+  struct DecodedInstruction entries[ICACHE_ENTRIES];
+  struct DecodedInstruction uncached; // instructions fetched from devices
+  struct IcacheStats stats;
+  uint32_t breakpoints[ICACHE_MAX_BREAKPOINTS];
+  uint32_t breakpoint_count;
+};
+
+void icache_init(struct Machine *m);
+void icache_decode(struct DecodedInstruction *entry, uint32_t pc, uint32_t instruction);
+const struct DecodedInstruction *icache_fetch(struct Machine *m, uint32_t pc);
+void icache_invalidate(struct Machine *m, uint32_t address, uint8_t size);
+void icache_flush(struct Machine *m);
+void icache_dump_stats(struct Machine *m);
+
+/* Breakpoints.
+ * An instruction with a breakpoint is decoded to HANDLER_BREAKPOINT, every
+ * engine stops before running it with the break flag set, so a machine run
+ * again stops there again until the breakpoint is removed. Code without
+ * breakpoints runs as if there were none. Only instructions in system
+ * memory can have breakpoints.
+ */
+bool icache_insert_breakpoint(struct Machine *m, uint32_t pc);
+bool icache_remove_breakpoint(struct Machine *m, uint32_t pc);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __INTC_H
+#define __INTC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Machine;
+
+/* Interrupt controller.
+ * Devices raise one of INTC_LINES lines, which stays pending until the
+ * guest clears it. An interrupt is taken before the next instruction when
+ * IF is set and an enabled line is pending: EPC gets the PC, CAUSE the
+ * lowest such line, IF is cleared and execution continues at VECTOR.
+ * IRET jumps back to EPC and sets IF again, EI and DI set and clear it.
+ * WFI waits until an enabled line is pending (whether IF is set or not),
+ * the virtual clock skips ahead to the next event meanwhile. Waiting with
+ * no event queued is an error, the guest would never wake up.
+ * Registers are word sized, relative to MMIO_INTC_START:
+ *   INTC_REG_PENDING  pending lines, writing ones clears them
+ *   INTC_REG_ENABLE   lines which interrupt
+ *   INTC_REG_RAISE    writing ones raises the lines (software interrupts)
+ *   INTC_REG_VECTOR   address of the interrupt handler
+ *   INTC_REG_EPC      PC the last interrupt was taken at
+ *   INTC_REG_CAUSE    line of the last interrupt taken (read only)
+ */
+#define INTC_LINES 32
+
+#define INTC_REG_PENDING 0x00
+#define INTC_REG_ENABLE  0x04
+#define INTC_REG_RAISE   0x08
+#define INTC_REG_VECTOR  0x0c
+#define INTC_REG_EPC     0x10
+#define INTC_REG_CAUSE   0x14
+
+enum {
+  INTC_LINE_TIMER,
+  INTC_LINE_DMA,
+};
+
+struct Intc {
+  uint32_t pending;
+  uint32_t enable;
+  uint32_t vector;
+  uint32_t epc;
+  uint32_t cause;
+  bool waiting; // executed WFI, machine_run() wakes it up
+  uint64_t taken;
+};
+
+void intc_init(struct Machine *m);
+void intc_raise(struct Machine *m, uint8_t line);
+void intc_update(struct Machine *m);
+bool intc_deliver(struct Machine *m);
+void intc_return(struct Machine *m);
+void intc_dump_stats(struct Machine *m);
+
+void intc_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size);
+uint32_t intc_read(struct Machine *m, uint32_t address, uint8_t size);
+
+static inline uint32_t intc_active(const struct Intc *intc)
+{
+  return intc->pending & intc->enable;
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __INTERP_H
+#define __INTERP_H
+
+#include <stdint.h>
+
+struct Machine;
+
+/* Fast interpreter.
+ * Runs decoded instructions in a single dispatch loop instead of cycling the
+ * FSM through fetch/decode/execute/check for every instruction. Handlers are
+ * specialized per (block, coding scheme, opcode).
+ */
+#define HANDLER_INDEX(block, scheme, opcode) ((block) | (scheme) << 3 | (opcode) << 5)
+#define HANDLER_FALLBACK 256 // always runs the reference implementation
+
+/* CMP with a register (immediate = false) or immediate operand, fused with
+ * the conditional branch `opcode` following it. See icache_fetch().
+ */
+#define HANDLER_FUSED_CMP(immediate, opcode) (257 + (immediate) * 8 + (opcode))
+#define HANDLER_IS_FUSED(handler) ((handler) > HANDLER_FALLBACK && (handler) < HANDLER_BREAKPOINT)
+
+/* Stops before the instruction, see icache_insert_breakpoint() */
+#define HANDLER_BREAKPOINT 273
+#define INTERP_HANDLERS 274
+
+#if defined(__GNUC__)
+#define HAVE_COMPUTED_GOTO 1
+#endif
+
+/* Run until halt, break or error, or until `limit` instructions were
+ * executed. Returns STATE_HALT, STATE_BREAK, STATE_ERROR or STATE_FETCH
+ * if the limit was reached first.
+ */
+uint8_t interp_run(struct Machine *m, uint64_t limit);
+
+#endif
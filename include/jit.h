@@ -0,0 +1,41 @@
+#ifndef __JIT_H
+#define __JIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Machine;
+
+/* Basic block translator to x86-64.
+ * Guest code in system memory is translated one basic block at a time. A
+ * block ends at a branch or control instruction, at an instruction writing
+ * the PC, or before an instruction the translator doesn't handle (those are
+ * run through the reference implementation). Blocks with constant successors
+ * are chained directly.
+ * Every translated block is charged its length against the run's
+ * instruction budget on entry, exits from the middle of a block give the
+ * rest back.
+ * On other hosts jit_run() falls back to the fast interpreter.
+ */
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+#define JIT_MAX_BLOCKS 65536
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+#define JIT_TABLE_SIZE 16384 // must be power of two
+
+struct JitStats {
+  uint64_t translations;
+  uint64_t invalidations;
+  uint64_t flushes;
+  uint64_t chained;
+};
+
+struct Jit;
+
+void jit_init(struct Machine *m);
+void jit_destroy(struct Machine *m);
+uint8_t jit_run(struct Machine *m, uint64_t limit); // same contract as interp_run()
+void jit_invalidate(struct Machine *m, uint32_t address, uint8_t size);
+void jit_flush(struct Machine *m);
+void jit_dump_stats(struct Machine *m);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __LOADER_H
+#define __LOADER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Machine;
+
+/* Guest image loader.
+ * Images are mapped MAP_PRIVATE straight into system memory, so loading
+ * costs the same regardless of the image size, pages are read from the file
+ * on first touch and stay shared with other runs of the same image until the
+ * guest writes to them. Parts of the image which aren't host page aligned
+ * relative to system memory are copied.
+ * Must be called on a freshly reset machine.
+ */
+#define LOADER_DEFAULT_ADDRESS MMIO_SYSTEM_MEMORY_START
+
+/* Raw binary at `address`, or 32 bit little endian ELF at its own addresses.
+ * PC is set to the ELF entry point, or to `address` for raw images.
+ */
+bool loader_load(struct Machine *m, const char *path, uint32_t address);
+bool loader_load_raw(struct Machine *m, int fd, uint32_t address);
+bool loader_load_elf(struct Machine *m, int fd);
+
+#endif
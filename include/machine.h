@@ -0,0 +1,125 @@
+#ifndef __MACHINE_H
+#define __MACHINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "rscs.h"
+#include "core.h"
+#include "dma.h"
+#include "event.h"
+#include "icache.h"
+#include "intc.h"
+#include "spi.h"
+#include "timer.h"
+#include "uart.h"
+
+/* Machine context.
+ * Everything belonging to one guest lives here and every part of the
+ * emulator takes the machine it works on, so one host process can create
+ * any number of guests and run them from different threads (one thread per
+ * machine at a time).
+ */
+enum { MACHINE_ENGINE_FSM, MACHINE_ENGINE_FAST, MACHINE_ENGINE_JIT };
+
+/* Why machine_run() returned */
+enum {
+  MACHINE_EXIT_HALT,
+  MACHINE_EXIT_BREAK,
+  MACHINE_EXIT_ERROR,
+  MACHINE_EXIT_LIMIT, // instruction limit reached, the machine can be run again
+};
+
+#define MACHINE_RUN_UNLIMITED 0
+
+struct CacheSim;
+struct Jit;
+struct Perf;
+struct Profile;
+struct Trace;
+struct Replay;
+struct Smp;
+struct Timing;
+
+struct Machine {
+  struct Regfile regfile;
+  uint64_t budget; // instructions left in the current run, translated code updates it
+  uint64_t run_limit; // of the current fast or translated run, 0 otherwise
+  struct SystemMemory memory;
+  struct MmioMapEntry mmio_map[VIRT_UNKNOWN + 1];
+  struct Core core;
+  struct Icache icache;
+  struct Jit *jit; // created on the first translated run
+  struct Uart uart[UART_COUNT];
+  struct Spi spi;
+  struct Intc intc;
+  struct Timer timer;
+  struct Dma dma;
+  struct EventQueue events;
+  struct Perf *perf; // see perf_enable()
+  struct Trace *trace; // see trace_start()
+  struct Profile *profile; // see profile_start()
+  struct CacheSim *cachesim; // see cachesim_start()
+  struct Timing *timing; // see timing_start()
+  struct Replay *replay; // see replay_record() and replay_play()
+
+  uint8_t engine;   // MACHINE_ENGINE_*, MACHINE_ENGINE_FAST by default
+  uint64_t instret; // instructions executed since reset
+
+  struct Smp *smp; // harts sharing memory with this one, see smp_start()
+  uint32_t hart_id;
+  uint32_t code_generation; // of the code cached, see smp_sync_code()
+};
+
+/* Returns NULL if memory_size isn't a valid system memory size */
+struct Machine *machine_create(uint64_t memory_size);
+void machine_destroy(struct Machine *m);
+void machine_reset(struct Machine *m);
+
+/* See loader_load() */
+bool machine_load(struct Machine *m, const char *path, uint32_t address);
+
+/* Snapshots.
+ * A snapshot holds the guest memory in a memory file, together with a copy
+ * of the registers and the core state. Taking one costs time proportional
+ * to the memory the guest populated, afterwards the machine runs on a
+ * private copy of it.
+ * Forked machines map the snapshot copy-on-write, pages are shared until
+ * written. Restoring a machine which runs on a copy of the snapshot maps
+ * only the pages written since then again.
+ * Snapshots are immutable, they can be forked from several threads at once.
+ */
+struct MachineSnapshot {
+  uint64_t id;
+  int fd;
+  uint64_t memory_size;
+  struct Regfile regfile;
+  uint8_t fsm_state;
+  uint64_t instret;
+  uint8_t engine;
+  struct Intc intc;
+  struct Timer timer;
+  struct Dma dma;
+  struct SpiRegisters spi;
+  struct EventQueue events;
+};
+
+struct MachineSnapshot *machine_snapshot(struct Machine *m);
+void machine_snapshot_free(struct MachineSnapshot *s);
+struct Machine *machine_fork(const struct MachineSnapshot *s);
+bool machine_restore(struct Machine *m, const struct MachineSnapshot *s);
+
+/* Run until halt, break or error, or until max_instructions more were
+ * executed (MACHINE_RUN_UNLIMITED for no limit). Returns MACHINE_EXIT_*.
+ * Running a machine which stopped at a break continues after it.
+ * Timed events and interrupts are handled between engine runs, each run
+ * ends at the next event (see event.h).
+ */
+uint8_t machine_run(struct Machine *m, uint64_t max_instructions);
+
+/* Instructions retired so far. Called by a device handler during a run it
+ * doesn't count the instruction accessing the device.
+ */
+uint64_t machine_instret(const struct Machine *m);
+
+#endif
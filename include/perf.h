@@ -0,0 +1,93 @@
+#ifndef __PERF_H
+#define __PERF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "rscs.h"
+#include "icache.h"
+
+struct Machine;
+
+/* Guest performance counters.
+ * Built with --enable-perf-counters, the interpreters count retired
+ * instructions per block and opcode, taken and not taken branches, MMIO
+ * accesses per device and executions per PC once perf_enable() was called
+ * on a machine. Without it the PERF_* hooks expand to nothing.
+ * Translated code isn't instrumented, the JIT engine runs the fast
+ * interpreter while counters are enabled.
+ */
+#define PERF_BLOCKS 8
+#define PERF_OPCODES 8
+#define PERF_REPORT_TOP_PCS 20
+
+enum { PERF_REPORT_TEXT, PERF_REPORT_JSON };
+
+struct Perf {
+  uint64_t instructions[PERF_BLOCKS][PERF_OPCODES];
+  uint64_t branches_taken;
+  uint64_t branches_not_taken;
+  uint64_t reads[VIRT_UNKNOWN + 1];
+  uint64_t writes[VIRT_UNKNOWN + 1];
+  uint64_t *pc_histogram; // one counter per system memory word, committed on use
+  uint32_t pc_histogram_size; // bytes of system memory covered
+};
+
+/* Names of blocks, opcodes and devices in reports, NULL for opcodes
+ * without one */
+extern const char *perf_block_names[PERF_BLOCKS];
+extern const char *perf_opcode_names[PERF_BLOCKS][PERF_OPCODES];
+extern const char *perf_device_names[VIRT_UNKNOWN + 1];
+
+bool perf_enable(struct Machine *m);
+void perf_disable(struct Machine *m);
+void perf_report(struct Machine *m, FILE *out, uint8_t format);
+
+static inline void perf_count_instruction(struct Perf *perf, const struct DecodedInstruction *d)
+{
+  uint32_t offset = d->pc - MMIO_SYSTEM_MEMORY_START;
+
+  perf->instructions[d->block][d->opcode]++;
+  if (offset < perf->pc_histogram_size)
+    perf->pc_histogram[offset / SIZE_WORD]++;
+}
+
+#ifdef ENABLE_PERF_COUNTERS
+
+#define PERF_COUNT_INSTRUCTION(m, d)          \
+  do {                                        \
+    if ((m)->perf)                            \
+      perf_count_instruction((m)->perf, d);   \
+  } while (0)
+
+#define PERF_COUNT_BRANCH(m, taken)           \
+  do {                                        \
+    if ((m)->perf && (taken))                 \
+      (m)->perf->branches_taken++;            \
+    else if ((m)->perf)                       \
+      (m)->perf->branches_not_taken++;        \
+  } while (0)
+
+#define PERF_COUNT_READ(m, address, size)                                 \
+  do {                                                                    \
+    if ((m)->perf)                                                        \
+      (m)->perf->reads[mmu_translate_address(m, address, size)]++;        \
+  } while (0)
+
+#define PERF_COUNT_WRITE(m, address, size)                                \
+  do {                                                                    \
+    if ((m)->perf)                                                        \
+      (m)->perf->writes[mmu_translate_address(m, address, size)]++;       \
+  } while (0)
+
+#else
+
+#define PERF_COUNT_INSTRUCTION(m, d) do { } while (0)
+#define PERF_COUNT_BRANCH(m, taken) do { } while (0)
+#define PERF_COUNT_READ(m, address, size) do { } while (0)
+#define PERF_COUNT_WRITE(m, address, size) do { } while (0)
+
+#endif
+
+#endif
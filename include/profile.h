@@ -0,0 +1,91 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "rscs.h"
+
+struct Machine;
+
+/* Sampling profiler.
+ * Every `interval` retired instructions (PROFILE_INSTRUCTIONS), or every
+ * `interval` microseconds of host time (PROFILE_HOST_TIME), the guest call
+ * stack is recorded. machine_run() ends the engine run at the next sample
+ * point like it does for events, so every engine, the translator too, runs
+ * uninstrumented in between. Host time is looked at every
+ * PROFILE_POLL_INSTRUCTIONS instructions.
+ *
+ * Stacks are walked with the frame record convention: a function calling
+ * others saves the caller's FP and its return address (LR on entry) in two
+ * words and points FP at them,
+ *   [FP + 0]  caller's FP, 0 in the outermost frame
+ *   [FP + 4]  return address
+ * A leaf doesn't need a record, LR holds its return address. The sample is
+ * the PC, LR unless it returns into the function already sampled, and the
+ * return addresses of the frame records up to PROFILE_MAX_DEPTH frames.
+ * The walk stops at the first word outside system memory.
+ *
+ * Frames are attributed to the function symbols of ELF images (see
+ * profile_load_symbols()), other addresses are shown in hex. profile_stop()
+ * writes one line per distinct stack, outermost frame first, in the folded
+ * format flamegraph.pl and similar tools read:
+ *   main;parse;next_token 1234
+ */
+#define PROFILE_MAX_DEPTH 64
+#define PROFILE_POLL_INSTRUCTIONS 16384
+#define PROFILE_DEFAULT_INTERVAL 10007 // instructions, prime against loop aliasing
+
+enum { PROFILE_INSTRUCTIONS, PROFILE_HOST_TIME };
+
+struct ProfileSymbol {
+  uint32_t address;
+  uint32_t size; // 0 extends to the next symbol
+  char *name;
+};
+
+/* One distinct stack, the frames are function start addresses (or raw
+ * addresses outside any function) kept in Profile.frames */
+struct ProfileStack {
+  uint64_t hash;
+  uint64_t count;
+  uint32_t frame; // index of the leaf in Profile.frames
+  uint32_t depth; // 0 marks a free slot
+};
+
+struct Profile {
+  FILE *out;
+  char *path;
+  uint8_t mode; // PROFILE_*
+  uint64_t interval;
+  uint64_t next; // instret of the next sample or host time check
+  struct timespec last; // host time of the last sample
+
+  struct ProfileSymbol *symbols; // sorted by address
+  uint32_t symbol_count;
+
+  struct ProfileStack *stacks; // open addressing, power of two slots
+  uint32_t stack_slots;
+  uint32_t stack_count;
+  uint32_t *frames;
+  uint32_t frame_count;
+  uint32_t frame_capacity;
+
+  uint64_t samples;
+  uint64_t dropped; // out of memory
+};
+
+/* Opens `path` for the report, nothing is written before profile_stop() */
+bool profile_start(struct Machine *m, const char *path, uint8_t mode, uint64_t interval);
+void profile_stop(struct Machine *m);
+
+/* Function symbols (STT_FUNC) of an ELF image, other files have none */
+bool profile_load_symbols(struct Machine *m, const char *path);
+
+/* Instructions machine_run() may run before profile_tick() is due */
+uint64_t profile_limit(struct Machine *m, uint64_t run);
+void profile_tick(struct Machine *m);
+
+#endif
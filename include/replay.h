@@ -0,0 +1,71 @@
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "rscs.h"
+
+struct Machine;
+
+/* Deterministic record and replay.
+ * Guest execution only depends on the values devices return to it, so
+ * logging every value read from a nondeterministic device (the UARTs and
+ * the SPI block device) together with the number of instructions retired
+ * before the read is enough to run the guest again exactly the same way.
+ * While recording, the read handlers of those devices in the machine's
+ * MMIO map are replaced with ones that log what the device returned, while
+ * replaying with ones that return the logged values without asking the
+ * device. Nothing else is instrumented, every engine runs at full speed.
+ * A replay diverged when the guest reads a different device or at a
+ * different instruction than it did when recording, the machine stops with
+ * an error then.
+ * Reads of an empty UART aren't logged, they are what a replayed UART read
+ * without an event at its instruction returns.
+ * Data the SPI device copies into guest memory isn't logged, a replay has
+ * to start from the disk image the recording started from.
+ *
+ * File layout:
+ *   struct ReplayFileHeader
+ *   { varint instret delta, 1 byte source, varint value } ...
+ * varints are LEB128, instret deltas are zigzag encoded since resetting or
+ * restoring a machine moves instret back.
+ */
+#define REPLAY_MAGIC "RSCINPUT"
+#define REPLAY_VERSION 1
+#define REPLAY_BUFFER_SIZE (64 * 1024)
+
+enum { REPLAY_RECORD, REPLAY_PLAYBACK };
+
+struct ReplayFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t __unused;
+};
+
+/* One nondeterministic input */
+struct ReplayEvent {
+  uint64_t instret; // instructions retired before the one reading the value
+  uint8_t source;   // VIRT_* device
+  uint32_t value;
+};
+
+struct Replay {
+  uint8_t mode; // REPLAY_*
+  FILE *file;
+  uint64_t last_instret; // of the previous event
+  struct ReplayEvent next; // REPLAY_PLAYBACK: the event the guest reads next
+  bool next_valid;
+  uint64_t events;
+  MMIO_DEVICE_READ read[VIRT_UNKNOWN + 1]; // the device handlers replaced
+};
+
+bool replay_record(struct Machine *m, const char *path);
+bool replay_play(struct Machine *m, const char *path);
+void replay_stop(struct Machine *m);
+
+/* Replace the device read handlers again after the MMIO map was reset */
+void replay_hook_devices(struct Machine *m);
+
+#endif
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+struct Machine;
+
 /* General purpose registers */
 enum {
   REGISTER_RZ,
@@ -60,26 +62,50 @@ enum {
 
 struct Regfile {
   uint32_t gp_registers[GENERAL_PURPOSE_REGISTER_COUNT];
-  
+
+  /* ZF and NF are evaluated lazily, CMP only stores the difference of its
+   * operands to both and branches test what they need. They are separate
+   * so that the flags can be written independently as well.
+   */
+  uint32_t status_zero; // zero flag is set if this is 0
+  int32_t status_sign;  // negative flag is set if this is negative
+
   struct {
-    uint8_t status_zf : 1; // zero flag
-    uint8_t status_nf : 1; // negative flag
     uint8_t status_if : 1; // interrupt flag
-    uint8_t __unused  : 5;
+    uint8_t __unused  : 7;
   } status_regs;
 
   struct {
     uint8_t ctrl_hlt : 1; // halt flag
     uint8_t ctrl_brk : 1; // break flag
     uint8_t ctrl_err : 1; // error flag
-    uint8_t __unused : 5;
+    uint8_t ctrl_evt : 1; // an event or interrupt is due, ends the run, see machine_run()
+    uint8_t __unused : 4;
   } ctrl_regs;
 };
 
-uint32_t regfile_read(uint8_t reg);
-void regfile_write(uint8_t reg, uint32_t data);
-void regfile_init();
-void regfile_dump_registers();
+static inline void regfile_compare(struct Regfile *regfile, uint32_t op1, uint32_t op2)
+{
+  regfile->status_zero = op1 - op2;
+  regfile->status_sign = op1 - op2;
+}
+
+static inline bool regfile_zf(const struct Regfile *regfile)
+{
+  return regfile->status_zero == 0;
+}
+
+static inline bool regfile_nf(const struct Regfile *regfile)
+{
+  return regfile->status_sign < 0;
+}
+
+uint32_t regfile_read(struct Machine *m, uint8_t reg);
+void regfile_write(struct Machine *m, uint8_t reg, uint32_t data);
+void regfile_init(struct Machine *m);
+void regfile_dump_registers(struct Machine *m);
+
+extern const char *regnames[];
 
 #define LOGIC_HIGH 1
 #define LOGIC_LOW  0
@@ -99,16 +125,24 @@ void regfile_dump_registers();
 
 #define MMIO_SPI_START 0x1
 #define MMIO_SPI_BLOCK_SIZE 512
-#define MMIO_SPI_END MMIO_SPI_START + MMIO_SPI_BLOCK_SIZE
+#define MMIO_SPI_END (MMIO_SPI_START + MMIO_SPI_BLOCK_SIZE)
 
 #define MMIO_UART_0 MMIO_SPI_END
-#define MMIO_UART_1 MMIO_UART_0 + 1
-#define MMIO_UART_2 MMIO_UART_1 + 1
+#define MMIO_UART_1 (MMIO_UART_0 + 1)
+#define MMIO_UART_2 (MMIO_UART_1 + 1)
+#define MMIO_UART_3 (MMIO_UART_2 + 1)
+
+#define MMIO_INTC_START 0x220
+#define MMIO_INTC_SIZE 0x18
+#define MMIO_TIMER_START 0x240
+#define MMIO_TIMER_SIZE 0x10
+#define MMIO_DMA_START 0x260
+#define MMIO_DMA_SIZE 0x1c
 
 #define MMIO_SYSTEM_MEMORY_ALIGN 4 // four byte alignement
-#define MMIO_SYSTEM_MEMORY_SIZE  4096 // 4kB
-#define MMIO_SYSTEM_MEMORY_START MMIO_UART_2 + 1
-#define MMIO_SYSTEM_MEMORY_END MMIO_SYSTEM_MEMORY_START + MMIO_SYSTEM_MEMORY_SIZE
+#define MMIO_SYSTEM_MEMORY_SIZE  (16 * 1024 * 1024) // default, see system_memory_configure()
+#define MMIO_SYSTEM_MEMORY_START 0x1000 // page aligned, see MMU_PAGE_SIZE
+#define MMIO_SYSTEM_MEMORY_MAX_SIZE (UINT32_MAX - MMIO_SYSTEM_MEMORY_START + 1)
 
 enum {
   VIRT_RESERVED,
@@ -117,59 +151,111 @@ enum {
   VIRT_UART1,
   VIRT_UART2,
   VIRT_UART3,
+  VIRT_INTC,
+  VIRT_TIMER,
+  VIRT_DMA,
   VIRT_DRAM,
   VIRT_UNKNOWN,
 };
 
+typedef void (*MMIO_DEVICE_WRITE)(struct Machine *m, uint32_t address, uint32_t data, uint8_t size);
+typedef uint32_t (*MMIO_DEVICE_READ)(struct Machine *m, uint32_t address, uint8_t size);
+
+/* Memory map, like in https://github.com/qemu/qemu/blob/master/hw/riscv/virt.c.
+ * Devices get addresses relative to their base. RAM like devices also
+ * provide host_base, loads from them don't go through the read handler.
+ */
 struct MmioMapEntry {
   uint32_t base;
   uint32_t size;
+  MMIO_DEVICE_READ read;
+  MMIO_DEVICE_WRITE write;
+  uint8_t *host_base;
 };
 
-/* TODO: implement memory map like in https://github.com/qemu/qemu/blob/master/hw/riscv/virt.c.
- * To find appropriate device, you should iterate through this map and check if address
- * falls in interval between base address and base address + size.
- * This map should have one more field: pointer to devices read and write functions.
+/* Address to device lookup is one index into a page table. Pages shared by
+ * several devices point to a table with the device of every byte instead.
+ * The layout is the same for every machine, so the tables are built once
+ * and shared. System memory is mapped up to its largest size, accesses past
+ * the end of the actual one are caught by system memory itself.
  */
+#define MMU_PAGE_SHIFT 12
+#define MMU_PAGE_SIZE (1 << MMU_PAGE_SHIFT)
+#define MMU_PAGE_COUNT (1 << (32 - MMU_PAGE_SHIFT))
+#define MMU_SHARED_PAGE 0x80 // page table entry refers to mmu_shared_pages
+#define MMU_MAX_SHARED_PAGES 4
+
 /* System memory */
 
-void system_memory_write(uint32_t address, uint32_t data, uint8_t size);
-uint32_t system_memory_read(uint32_t address, uint8_t size);
-void system_memory_init();
+#define SYSTEM_MEMORY_DEMO_SIZE 16 // the demo program system_memory_init() writes to the start
+
+void system_memory_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size);
+uint32_t system_memory_read(struct Machine *m, uint32_t address, uint8_t size);
+uint32_t *system_memory_atomic(struct Machine *m, uint32_t address);
+bool system_memory_configure(struct Machine *m, uint64_t size);
+void system_memory_init(struct Machine *m);
+void system_memory_destroy(struct Machine *m);
+void system_memory_mark_code(struct Machine *m, uint32_t address, uint32_t size);
+void system_memory_mark_dirty(struct Machine *m, uint32_t address, uint32_t size);
+bool system_memory_store(struct Machine *m, uint32_t address, const void *data, uint32_t size);
+void system_memory_copy(struct Machine *m, uint32_t destination, uint32_t source, uint32_t size);
+void system_memory_fill(struct Machine *m, uint32_t address, uint8_t value, uint32_t size);
+bool system_memory_load(struct Machine *m, uint32_t address, void *data, uint32_t size);
+bool system_memory_save(struct Machine *m, int fd);
+bool system_memory_rebase(struct Machine *m, int fd, uint64_t id);
+bool system_memory_revert(struct Machine *m);
+
+/* Flat little endian guest RAM. The mapping is reserved up front and pages
+ * are only committed by the host once the guest touches them.
+ * code_map has one byte per SYSTEM_MEMORY_CODE_SHIFT sized region, set when
+ * instructions from the region were decoded or translated. Writes to those
+ * regions have to drop the cached copies.
+ * Memory may be a private copy of a snapshot (see machine_snapshot()). Pages
+ * written since the snapshot was taken or restored are tracked in dirty_map
+ * and dirty_pages, restoring maps just those pages from the snapshot again.
+ */
+#define SYSTEM_MEMORY_CODE_SHIFT 6
+#define SYSTEM_MEMORY_DIRTY_SHIFT MMU_PAGE_SHIFT
 
 struct SystemMemory {
-  uint8_t memory_block[MMIO_SYSTEM_MEMORY_SIZE/MMIO_SYSTEM_MEMORY_ALIGN][MMIO_SYSTEM_MEMORY_ALIGN];
+  uint8_t *base;
+  uint32_t size;
+  uint8_t *code_map;
+  uint8_t *dirty_map;
+  uint32_t *dirty_pages;
+  uint32_t dirty_count;
+  uint64_t backing_id; // snapshot memory is a private copy of, 0 if none
+  int backing_fd;
+  uint64_t configured_size; // size of the mapping made by the next system_memory_init()
 };
 
-/* Uart device */
-void uart_write(uint32_t address, uint32_t data, uint8_t size);
-uint32_t uart_read(uint32_t address, uint8_t size);
-
-/* SPI device */
-void spi_write(uint32_t address, uint32_t data, uint8_t size);
-uint32_t spi_read(uint32_t address, uint8_t size);
-
-void invalid_address_write_handler(uint32_t address, uint32_t data,
+static inline bool system_memory_is_code(const struct SystemMemory *mem, uint32_t address,
+                                         uint8_t size)
+{
+  return mem->code_map[address >> SYSTEM_MEMORY_CODE_SHIFT] |
+         mem->code_map[(address + size - 1) >> SYSTEM_MEMORY_CODE_SHIFT];
+}
+
+static inline bool system_memory_is_dirty(const struct SystemMemory *mem, uint32_t address,
+                                          uint8_t size)
+{
+  return mem->dirty_map[address >> SYSTEM_MEMORY_DIRTY_SHIFT] &
+         mem->dirty_map[(address + size - 1) >> SYSTEM_MEMORY_DIRTY_SHIFT];
+}
+
+void invalid_address_write_handler(struct Machine *m, uint32_t address, uint32_t data,
                                    uint8_t size);
-uint32_t invalid_address_read_handler(uint32_t address, uint32_t size);
+uint32_t invalid_address_read_handler(struct Machine *m, uint32_t address, uint8_t size);
 
-/* Memory management unit */
-enum {
-  MMIO_DEVICE_SYS_MEMORY,
-  
-  MMIO_DEVICE_UART,
-
-  MMIO_DEVICE_SPI
-};
+void null_pointer_write_handler(struct Machine *m, uint32_t address, uint32_t data, uint8_t size);
+uint32_t null_pointer_read_handler(struct Machine *m, uint32_t address, uint8_t size);
 
+/* Memory management unit */
 bool check_alignment(uint32_t address, uint8_t size);
-uint8_t mmu_translate_address(uint32_t address, uint8_t size);
-
-void mmu_write(uint32_t address, uint32_t data, uint8_t size);
-uint32_t mmu_read(uint32_t address, uint8_t size);
-void mmu_init();
+uint8_t mmu_translate_address(struct Machine *m, uint32_t address, uint8_t size);
 
-typedef void (*MMIO_DEVICE_WRITE[])(uint32_t address, uint32_t data, uint8_t size);
-typedef uint32_t (*MMIO_DEVICE_READ)(uint32_t address, uint8_t size);
+void mmu_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size);
+uint32_t mmu_read(struct Machine *m, uint32_t address, uint8_t size);
+void mmu_init(struct Machine *m);
 
 #endif
@@ -0,0 +1,55 @@
+#ifndef __SMP_H
+#define __SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "rscs.h"
+
+struct Machine;
+
+/* Multiple harts.
+ * smp_start() turns a machine into hart 0 of a group of harts sharing its
+ * system memory and its UARTs and SPI device. Every other hart is a machine
+ * of its own with its own registers, instruction cache, translated code,
+ * interrupt controller, timer, DMA engine and virtual clock, starting at
+ * the PC hart 0 is at. smp_run() runs each hart on its own host thread.
+ *
+ * Memory model: aligned loads and stores are single-copy atomic and the
+ * stores of one hart become visible to the others in program order (host
+ * TSO, translated code keeps no guest memory in host registers). The
+ * atomic instructions in BLOCK_ATOMIC are sequentially consistent and
+ * order every access around them, FENCE does the same without an access.
+ * Code written by another hart or by a device is seen by a hart after it
+ * executes FENCE or at the start of its next run, its own writes at once.
+ *
+ * Shared devices are serialized with a lock. Snapshots, record and replay
+ * need a single hart, traces and performance counters only cover hart 0.
+ */
+#define SMP_MAX_HARTS 64
+
+struct Smp {
+  uint32_t count;
+  struct Machine *harts[SMP_MAX_HARTS]; // harts[0] is the machine smp_start() was called on
+  pthread_mutex_t io_lock;
+  MMIO_DEVICE_READ read[VIRT_UNKNOWN + 1];   // shared device handlers of hart 0
+  MMIO_DEVICE_WRITE write[VIRT_UNKNOWN + 1];
+  _Atomic uint32_t code_generation; // bumped by every write to code
+};
+
+bool smp_start(struct Machine *m, uint32_t harts);
+void smp_stop(struct Machine *m);
+
+/* Run every hart until it stops or executed max_instructions (see
+ * machine_run()). Returns MACHINE_EXIT_ERROR if any hart failed, otherwise
+ * MACHINE_EXIT_BREAK if any hit a break, otherwise MACHINE_EXIT_LIMIT if
+ * any can be run again, MACHINE_EXIT_HALT once all halted.
+ */
+uint8_t smp_run(struct Machine *m, uint64_t max_instructions);
+
+void smp_code_written(struct Machine *m);
+void smp_sync_code(struct Machine *m);
+
+#endif
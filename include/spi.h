@@ -0,0 +1,84 @@
+#ifndef __SPI_H
+#define __SPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Machine;
+
+/* SPI block device.
+ * A disk image is mapped into the host address space and moved to and from
+ * guest memory a sector at a time with plain copies, the guest only programs
+ * a few registers in the SPI window:
+ *   SPI_REG_SECTOR   first sector on the disk
+ *   SPI_REG_ADDRESS  guest physical address of the buffer
+ *   SPI_REG_COUNT    number of sectors
+ *   SPI_REG_COMMAND  writing SPI_COMMAND_* runs the transfer
+ *   SPI_REG_STATUS   SPI_STATUS_* of the last command (read only)
+ *   SPI_REG_CAPACITY disk size in sectors (read only)
+ * Registers are word sized. Commands complete before the write returns.
+ * In write-back mode written sectors reach the image file when the guest
+ * issues SPI_COMMAND_FLUSH or the disk is detached, in write-through mode
+ * before SPI_COMMAND_WRITE completes.
+ * The registers are part of machine snapshots, the disk is not: restoring
+ * keeps the disk attached to the machine and its SPI_STATUS_READY and
+ * SPI_STATUS_READ_ONLY bits.
+ */
+#define SPI_SECTOR_SIZE 512
+
+#define SPI_REG_COMMAND  0x04
+#define SPI_REG_STATUS   0x08
+#define SPI_REG_SECTOR   0x0c
+#define SPI_REG_ADDRESS  0x10
+#define SPI_REG_COUNT    0x14
+#define SPI_REG_CAPACITY 0x18
+
+enum {
+  SPI_COMMAND_READ = 1, // disk to memory
+  SPI_COMMAND_WRITE,    // memory to disk
+  SPI_COMMAND_FLUSH,
+};
+
+#define SPI_STATUS_READY     0x1 // a disk is attached
+#define SPI_STATUS_ERROR     0x2 // last command failed
+#define SPI_STATUS_READ_ONLY 0x4
+
+enum { SPI_SYNC_WRITE_BACK, SPI_SYNC_WRITE_THROUGH };
+
+struct SpiStats {
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t flushes;
+  uint64_t sectors_read;
+  uint64_t sectors_written;
+  uint64_t errors;
+};
+
+/* Guest visible state, saved in snapshots */
+struct SpiRegisters {
+  uint32_t sector;
+  uint32_t address;
+  uint32_t count;
+  uint32_t status;
+};
+
+struct Spi {
+  int fd; // -1 without a disk
+  uint8_t *image;
+  uint64_t sectors;
+  bool read_only;
+  uint8_t sync; // SPI_SYNC_*
+
+  struct SpiRegisters regs;
+  struct SpiStats stats;
+};
+
+void spi_init(struct Machine *m);
+bool spi_attach(struct Machine *m, const char *path, uint8_t sync);
+void spi_detach(struct Machine *m);
+void spi_dump_stats(struct Machine *m);
+
+void spi_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size);
+uint32_t spi_read(struct Machine *m, uint32_t address, uint8_t size);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Machine;
+
+/* Programmable timer.
+ * Counts virtual clock ticks (see event.h) and raises INTC_LINE_TIMER when
+ * an interval written to it has passed, once or periodically. Registers
+ * are word sized, relative to MMIO_TIMER_START:
+ *   TIMER_REG_TIME_LO   low half of the virtual clock, reading it latches
+ *                       the high half
+ *   TIMER_REG_TIME_HI   high half latched by the last TIMER_REG_TIME_LO read
+ *   TIMER_REG_INTERVAL  ticks until the timer fires, writing it (re)starts
+ *                       the timer, 0 stops it
+ *   TIMER_REG_CONTROL   TIMER_CONTROL_*
+ */
+#define TIMER_REG_TIME_LO  0x00
+#define TIMER_REG_TIME_HI  0x04
+#define TIMER_REG_INTERVAL 0x08
+#define TIMER_REG_CONTROL  0x0c
+
+#define TIMER_CONTROL_PERIODIC 0x1 // restart with the same interval after firing
+
+struct Timer {
+  uint32_t interval;
+  uint32_t control;
+  uint32_t time_hi; // latched
+  uint64_t fired;
+};
+
+void timer_init(struct Machine *m);
+
+void timer_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size);
+uint32_t timer_read(struct Machine *m, uint32_t address, uint8_t size);
+
+#endif
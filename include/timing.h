@@ -0,0 +1,131 @@
+#ifndef __TIMING_H
+#define __TIMING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "rscs.h"
+#include "icache.h"
+
+struct Machine;
+
+/* Cycle approximate timing model.
+ * Estimates the cycles a scalar in-order pipeline would take for the
+ * instructions retired while the model is on: each one issues after the
+ * latency of its block and opcode, plus
+ *   load use   stall cycles when it reads the register the instruction
+ *              before it loaded
+ *   branches   a bubble for every taken branch predicted right, the
+ *              mispredict penalty for every one predicted wrong. The
+ *              direction comes from a static (not taken or backward taken,
+ *              forward not taken), bimodal or gshare predictor, BR is
+ *              always taken and only pays the bubble
+ *   devices    extra cycles per access to each device's registers
+ * Caches aren't modeled, system memory costs the load latency.
+ *
+ * Timing is switched on and off at run time with timing_start() and
+ * timing_stop(). Only the reference interpreter feeds the model,
+ * machine_run() switches to it while the model is on, so the fast
+ * interpreter and translated code carry no hooks and runs without the
+ * model pay nothing for it.
+ */
+#define TIMING_BLOCKS 8
+#define TIMING_OPCODES 8
+#define TIMING_MAX_TABLE_BITS 20
+#define TIMING_NO_LOAD 0xff
+
+enum {
+  TIMING_PREDICTOR_NOT_TAKEN,
+  TIMING_PREDICTOR_BTFN,
+  TIMING_PREDICTOR_BIMODAL,
+  TIMING_PREDICTOR_GSHARE,
+};
+
+struct TimingConfig {
+  uint8_t latency[TIMING_BLOCKS][TIMING_OPCODES];
+  uint8_t device_latency[VIRT_UNKNOWN + 1];
+  uint8_t load_use;   // stall cycles
+  uint8_t taken;      // bubble of a correctly predicted taken branch
+  uint8_t mispredict; // penalty
+  uint8_t predictor;  // TIMING_PREDICTOR_*
+  uint8_t table_bits; // log2 of the counters of bimodal and gshare
+  uint8_t history_bits; // of gshare, up to table_bits
+};
+
+struct Timing {
+  struct TimingConfig config;
+  uint8_t *counters; // two bit saturating, weakly not taken at start
+  uint32_t history;
+  uint8_t load_dst;  // register loaded by the last instruction, TIMING_NO_LOAD if none
+
+  uint64_t instructions;
+  uint64_t cycles;
+  uint64_t load_use_stalls; // cycles
+  uint64_t device_cycles;
+  uint64_t branches;        // conditional ones
+  uint64_t mispredicts;
+  uint64_t taken_bubbles;   // cycles
+};
+
+/* Defaults: one cycle per instruction, atomics 4, FENCE and IRET 3, 1
+ * cycle load use stall, 1 cycle taken bubble, 4 cycles mispredict penalty,
+ * 4096 entry gshare with 8 bits of history, device registers 2 (interrupt
+ * controller and timer) to 20 cycles (UARTs and SPI)
+ */
+void timing_default_config(struct TimingConfig *config);
+
+/* Changes `config` as given by a comma separated list of key=value:
+ *   predictor=not-taken|btfn|bimodal|gshare, table=bits, history=bits,
+ *   load-use=, taken=, mispredict=cycles,
+ *   a block (arithmetic, memory, ...) or opcode name (add, lw, ...)=cycles,
+ *   a device name (uart0, spi0, intc, ...)=cycles
+ * e.g. "predictor=bimodal,lw=3,uart0=50". "default" changes nothing.
+ */
+bool timing_parse_config(const char *spec, struct TimingConfig *config);
+
+/* Starts counting from zero, a model already on is replaced */
+bool timing_start(struct Machine *m, const struct TimingConfig *config);
+void timing_stop(struct Machine *m);
+void timing_report(struct Machine *m, FILE *out);
+
+/* Model, called by the reference interpreter */
+void timing_instruction(struct Timing *timing, const struct DecodedInstruction *d);
+void timing_branch(struct Timing *timing, const struct DecodedInstruction *d, uint32_t target,
+                   bool taken);
+
+static inline void timing_access(struct Machine *m, struct Timing *timing, uint8_t dst,
+                                 uint32_t address, uint8_t size)
+{
+  uint8_t latency = timing->config.device_latency[mmu_translate_address(m, address, size)];
+
+  timing->cycles += latency;
+  timing->device_cycles += latency;
+  timing->load_dst = dst;
+}
+
+#define TIMING_INSTRUCTION(m, d)                       \
+  do {                                                 \
+    if ((m)->timing)                                   \
+      timing_instruction((m)->timing, d);              \
+  } while (0)
+
+#define TIMING_BRANCH(m, d, target, taken)             \
+  do {                                                 \
+    if ((m)->timing)                                   \
+      timing_branch((m)->timing, d, target, taken);    \
+  } while (0)
+
+#define TIMING_LOAD(m, dst, address, size)                        \
+  do {                                                            \
+    if ((m)->timing)                                              \
+      timing_access(m, (m)->timing, dst, address, size);          \
+  } while (0)
+
+#define TIMING_STORE(m, address, size)                                      \
+  do {                                                                      \
+    if ((m)->timing)                                                        \
+      timing_access(m, (m)->timing, TIMING_NO_LOAD, address, size);         \
+  } while (0)
+
+#endif
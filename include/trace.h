@@ -0,0 +1,253 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "rscs.h"
+#include "icache.h"
+
+struct Machine;
+
+/* Execution trace.
+ * Every retired instruction is recorded with its PC, instruction word,
+ * the register it wrote and the memory it accessed. Records are delta
+ * encoded into a chunk buffer by the thread running the machine, full
+ * chunks are compressed and written out by a background thread.
+ * Chunks are compressed independently and the delta state starts over
+ * with every chunk, so a reader finds an instruction by skipping chunk
+ * headers and decompresses only the chunk holding it.
+ * Translated code isn't instrumented, the JIT engine runs the fast
+ * interpreter while a trace is recorded.
+ *
+ * File layout, integers little endian:
+ *   struct TraceFileHeader
+ *   { struct TraceChunkHeader, compressed_size bytes of zlib data } ...
+ * Record layout, varints are LEB128 of zigzag encoded deltas:
+ *   flags             TRACE_RECORD_*
+ *   pc                varint delta to the PC following the last record,
+ *                     if TRACE_RECORD_JUMP
+ *   instruction       4 bytes, unless TRACE_RECORD_REPEAT says it's the
+ *                     same as the last time this PC was traced
+ *   register, value   1 byte, varint delta to the last value traced for
+ *                     the register, if TRACE_RECORD_REGISTER
+ *   size, address,    1 byte, varint delta to the last address traced,
+ *   value             varint delta to the last value, if TRACE_RECORD_LOAD
+ *                     or TRACE_RECORD_STORE
+ */
+#define TRACE_MAGIC "RSCTRACE"
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_SIZE (256 * 1024)
+#define TRACE_MAX_RECORD 32
+#define TRACE_BUFFERS 4 // chunks in flight to the writer thread
+#define TRACE_COMPRESSION_LEVEL 1
+#define TRACE_INSTRUCTION_CACHE 1024 // must be power of two
+
+#define TRACE_RECORD_JUMP     0x01
+#define TRACE_RECORD_REGISTER 0x02
+#define TRACE_RECORD_LOAD     0x04
+#define TRACE_RECORD_STORE    0x08
+#define TRACE_RECORD_REPEAT   0x10
+
+struct TraceFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t chunk_size;
+  uint64_t first_instret; // m->instret when recording started
+};
+
+struct TraceChunkHeader {
+  uint64_t first_instruction; // index of the first record, counted from the start of the trace
+  uint32_t records;
+  uint32_t raw_size;
+  uint32_t compressed_size;
+  uint32_t __unused;
+};
+
+/* Delta encoding state, reset with every chunk */
+struct TraceDeltaState {
+  uint32_t next_pc;
+  uint32_t registers[32];
+  uint32_t address;
+  uint32_t value;
+  struct {
+    uint32_t pc;
+    uint32_t instruction;
+  } instructions[TRACE_INSTRUCTION_CACHE];
+};
+
+struct TraceBuffer {
+  uint8_t data[TRACE_CHUNK_SIZE];
+  uint32_t size;
+  uint32_t records;
+  uint64_t first_instruction;
+};
+
+struct Trace {
+  /* written by the machine's thread only */
+  struct TraceBuffer *current;
+  uint8_t *cursor;
+  uint8_t *flags; // of the record being written
+  struct TraceDeltaState delta;
+  uint64_t instructions;
+
+  /* shared with the writer thread */
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct TraceBuffer buffers[TRACE_BUFFERS];
+  uint64_t submitted; // chunks handed to the writer
+  uint64_t written;   // chunks the writer is done with
+  bool stopping;
+  bool failed;
+  FILE *file;
+  uint64_t bytes_written;
+};
+
+bool trace_start(struct Machine *m, const char *path);
+void trace_stop(struct Machine *m);
+void trace_submit(struct Trace *trace);
+
+/* One decoded record */
+struct TraceRecord {
+  uint64_t index;
+  uint32_t pc;
+  uint32_t instruction;
+  uint8_t flags; // TRACE_RECORD_REGISTER, _LOAD and _STORE tell which fields are valid
+  uint8_t reg;
+  uint32_t reg_value;
+  uint8_t size;
+  uint32_t address;
+  uint32_t value;
+};
+
+struct TraceReader {
+  FILE *file;
+  struct TraceFileHeader header;
+  struct TraceChunkHeader chunk;
+  long chunk_offset; // of the chunk header
+  uint8_t *data;     // decompressed chunk
+  uint32_t position;
+  uint64_t index;    // of the next record
+  struct TraceDeltaState delta;
+};
+
+struct TraceReader *trace_reader_open(const char *path);
+void trace_reader_close(struct TraceReader *reader);
+bool trace_reader_seek(struct TraceReader *reader, uint64_t index);
+bool trace_reader_next(struct TraceReader *reader, struct TraceRecord *record);
+
+/* Recording, called by the interpreters. The cursor is kept in a local,
+ * stores through it could alias everything else.
+ */
+static inline uint8_t *trace_put_varint(uint8_t *cursor, uint32_t delta)
+{
+  uint32_t zigzag = (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+  uint32_t length = (32 - __builtin_clz(zigzag | 1) + 6) / 7;
+  uint64_t bytes;
+
+  /* branch free, deltas are too random for the predictor. Writes up to
+   * three bytes past the varint, TRACE_MAX_RECORD leaves room for them.
+   */
+  bytes = (zigzag & 0x7f) | (zigzag & 0x3f80) << 1 | (zigzag & 0x1fc000) << 2 |
+          (zigzag & 0xfe00000) << 3 | (uint64_t)(zigzag & 0xf0000000) << 4;
+  bytes |= 0x8080808080ULL & ((1ULL << (8 * (length - 1))) - 1);
+  bytes = htole64(bytes);
+  memcpy(cursor, &bytes, sizeof(bytes));
+  return cursor + length;
+}
+
+static inline void trace_instruction(struct Trace *trace, const struct DecodedInstruction *d)
+{
+  uint32_t index = (d->pc / SIZE_WORD) & (TRACE_INSTRUCTION_CACHE - 1);
+  uint32_t pc = d->pc;
+  uint32_t instruction = d->instruction;
+  uint8_t *cursor;
+  uint8_t flags = 0;
+
+  if (trace->cursor - trace->current->data > TRACE_CHUNK_SIZE - TRACE_MAX_RECORD)
+    trace_submit(trace);
+
+  cursor = trace->cursor;
+  trace->flags = cursor++;
+  if (pc != trace->delta.next_pc) {
+    flags |= TRACE_RECORD_JUMP;
+    cursor = trace_put_varint(cursor, pc - trace->delta.next_pc);
+  }
+  trace->delta.next_pc = pc + SIZE_WORD;
+  trace->current->records++;
+
+  if (trace->delta.instructions[index].pc == pc &&
+      trace->delta.instructions[index].instruction == instruction) {
+    flags |= TRACE_RECORD_REPEAT;
+  } else {
+    trace->delta.instructions[index].pc = pc;
+    trace->delta.instructions[index].instruction = instruction;
+    cursor[0] = instruction;
+    cursor[1] = instruction >> 8;
+    cursor[2] = instruction >> 16;
+    cursor[3] = instruction >> 24;
+    cursor += 4;
+  }
+
+  *trace->flags = flags;
+  trace->cursor = cursor;
+}
+
+static inline void trace_register(struct Trace *trace, uint8_t reg, uint32_t value)
+{
+  uint32_t delta = value - trace->delta.registers[reg];
+  uint8_t *cursor = trace->cursor;
+
+  trace->delta.registers[reg] = value;
+  *trace->flags |= TRACE_RECORD_REGISTER;
+  *cursor++ = reg;
+  trace->cursor = trace_put_varint(cursor, delta);
+}
+
+static inline void trace_memory(struct Trace *trace, uint8_t flag, uint32_t address, uint32_t value,
+                                uint8_t size)
+{
+  uint32_t address_delta = address - trace->delta.address;
+  uint32_t value_delta;
+  uint8_t *cursor = trace->cursor;
+
+  value &= UINT32_MAX >> (32 - 8 * size);
+  value_delta = value - trace->delta.value;
+  trace->delta.address = address;
+  trace->delta.value = value;
+  *trace->flags |= flag;
+  *cursor++ = size;
+  cursor = trace_put_varint(cursor, address_delta);
+  trace->cursor = trace_put_varint(cursor, value_delta);
+}
+
+#define TRACE_INSTRUCTION(m, d)             \
+  do {                                      \
+    if ((m)->trace)                         \
+      trace_instruction((m)->trace, d);     \
+  } while (0)
+
+#define TRACE_REGISTER(m, reg, value)               \
+  do {                                              \
+    if ((m)->trace)                                 \
+      trace_register((m)->trace, reg, value);       \
+  } while (0)
+
+#define TRACE_LOAD(m, address, value, size)                                   \
+  do {                                                                        \
+    if ((m)->trace)                                                           \
+      trace_memory((m)->trace, TRACE_RECORD_LOAD, address, value, size);      \
+  } while (0)
+
+#define TRACE_STORE(m, address, value, size)                                  \
+  do {                                                                        \
+    if ((m)->trace)                                                           \
+      trace_memory((m)->trace, TRACE_RECORD_STORE, address, value, size);     \
+  } while (0)
+
+#endif
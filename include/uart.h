@@ -0,0 +1,74 @@
+#ifndef __UART_H
+#define __UART_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+struct Machine;
+
+/* Buffered UARTs.
+ * Guest output goes to a ring buffer per UART, drained in batches with
+ * writev() by a host I/O thread shared by all machines. The same thread
+ * fills the input rings from the attached host descriptors. Both rings have
+ * a single producer and a single consumer and are lock free, the guest only
+ * makes a syscall to wake the I/O thread after it went idle.
+ * Output is dropped (and counted) when the I/O thread falls behind, the
+ * guest never waits for the host. A UART attached with UART_ATTACH_BLOCKING
+ * waits for room in the ring instead and loses nothing, a host that stops
+ * reading then stops the guest (every hart of an SMP machine). Reading a
+ * UART returns the next input byte, or UART_RX_EMPTY if there is none.
+ */
+#define UART_COUNT 4
+#define UART_TX_RING_SIZE (64 * 1024) // power of two
+#define UART_RX_RING_SIZE 4096        // power of two
+#define UART_RX_EMPTY 0xffffffff
+#define UART_LINGER_MS 1 // the I/O thread keeps polling this long after the last output
+
+#define UART_ATTACH_BLOCKING 0x1 // wait for the host instead of dropping output
+
+struct UartRing {
+  _Atomic uint32_t head; // written by the producer only
+  _Atomic uint32_t tail; // written by the consumer only
+  uint32_t size;
+  uint8_t *data;
+};
+
+/* Part of a UART the I/O thread works on */
+struct UartChannel {
+  struct UartRing tx;
+  struct UartRing rx;
+  int out_fd;
+  int in_fd;
+  bool in_eof;
+  struct UartChannel *next;
+};
+
+struct Uart {
+  int out_fd; // -1 discards output
+  int in_fd;  // -1 for no input
+  struct UartChannel *channel; // registered with the I/O thread on first use
+  bool blocking; // UART_ATTACH_BLOCKING
+  uint64_t tx_bytes;
+  uint64_t rx_bytes;
+  uint64_t overruns;
+  uint64_t stalls; // writes that waited for room in the output ring, blocking only
+};
+
+void uart_init(struct Machine *m);
+void uart_destroy(struct Machine *m);
+void uart_attach(struct Machine *m, uint8_t index, int in_fd, int out_fd, uint8_t flags);
+void uart_flush(struct Machine *m);
+void uart_dump_stats(struct Machine *m);
+
+/* One set of handlers per UART, the device map gives them no index */
+#define UART_HANDLERS(n)                                                                 \
+  void uart##n##_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size); \
+  uint32_t uart##n##_read(struct Machine *m, uint32_t address, uint8_t size);
+
+UART_HANDLERS(0)
+UART_HANDLERS(1)
+UART_HANDLERS(2)
+UART_HANDLERS(3)
+
+#endif
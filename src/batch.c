@@ -0,0 +1,633 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "loader.h"
+#include "uart.h"
+#include "machine.h"
+
+/* Batch runner.
+ * Runs every job of a manifest, one guest image per line with optional
+ * settings, on a pool of host threads and writes one JSON result per job
+ * in manifest order. Each thread reuses one machine for all its jobs.
+ * The manifest is split into one contiguous range of jobs per thread, a
+ * thread which runs out takes the upper half of the range of another one.
+ * UART0 reads the job's input file and its output is captured in memory,
+ * the other UARTs are disconnected, so jobs never touch the host console
+ * and always see their whole input.
+ */
+#define BATCH_MAX_LINE 4096
+#define BATCH_DEFAULT_BUDGET 100000000
+#define BATCH_DEFAULT_OUTPUT (64 * 1024)
+
+struct BatchJob {
+  uint32_t line;
+  char *image;
+  char *input; // NULL for none
+  uint64_t budget;
+  uint64_t memory_size;
+  uint32_t load_address;
+  uint32_t entry;
+  bool entry_set;
+  uint8_t engine;
+};
+
+/* Jobs [head, tail) of the manifest */
+struct BatchQueue {
+  pthread_mutex_t lock;
+  uint32_t head;
+  uint32_t tail;
+};
+
+struct BatchWorker {
+  pthread_t thread;
+  uint32_t id;
+  struct BatchQueue queue;
+  struct Machine *m;
+};
+
+/* UART0 of the job running on a thread */
+struct BatchConsole {
+  const uint8_t *input;
+  size_t input_length;
+  size_t input_offset;
+  uint8_t *output;
+  size_t output_length;
+  size_t output_size;
+  bool truncated;
+};
+
+struct Batch {
+  struct BatchJob *jobs;
+  uint32_t count;
+  uint32_t threads;
+  struct BatchWorker *workers;
+  size_t output_limit;
+
+  pthread_mutex_t results_lock;
+  char **results; // JSON lines of finished jobs not written yet
+  uint32_t next_result;
+  FILE *out;
+
+  _Atomic uint64_t instructions;
+  _Atomic uint32_t exits[MACHINE_EXIT_LIMIT + 1];
+  _Atomic uint32_t failed;
+  _Atomic uint32_t steals;
+};
+
+static struct Batch batch;
+static __thread struct BatchConsole *batch_console;
+
+static const char *engine_names[] = {
+  [MACHINE_ENGINE_FSM] = "fsm",
+  [MACHINE_ENGINE_FAST] = "fast",
+  [MACHINE_ENGINE_JIT] = "jit",
+};
+
+static const char *exit_names[] = {
+  [MACHINE_EXIT_HALT] = "halt",
+  [MACHINE_EXIT_BREAK] = "break",
+  [MACHINE_EXIT_ERROR] = "error",
+  [MACHINE_EXIT_LIMIT] = "limit",
+};
+
+/* Size with an optional k, M or G suffix */
+static bool parse_size(const char *arg, uint64_t *size)
+{
+  char *end;
+  uint64_t value = strtoull(arg, &end, 0);
+
+  switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+    case 'g': case 'G': value <<= 30; end++; break;
+  }
+
+  if (end == arg || *end)
+    return false;
+
+  *size = value;
+  return true;
+}
+
+static bool parse_engine(const char *arg, uint8_t *engine)
+{
+  for (int i = 0; i <= MACHINE_ENGINE_JIT; i++) {
+    if (!strcmp(arg, engine_names[i])) {
+      *engine = i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Sets one key=value of a job */
+static bool batch_parse_setting(struct BatchJob *job, char *setting)
+{
+  char *value = strchr(setting, '=');
+  uint64_t number;
+
+  if (!value)
+    return false;
+  *value++ = '\0';
+
+  if (!strcmp(setting, "input")) {
+    job->input = strdup(value);
+    return job->input != NULL;
+  }
+
+  if (!strcmp(setting, "engine"))
+    return parse_engine(value, &job->engine);
+
+  if (!parse_size(value, &number))
+    return false;
+
+  if (!strcmp(setting, "budget")) {
+    job->budget = number;
+  } else if (!strcmp(setting, "memory")) {
+    job->memory_size = number;
+  } else if (!strcmp(setting, "load") && number <= UINT32_MAX) {
+    job->load_address = number;
+  } else if (!strcmp(setting, "entry") && number <= UINT32_MAX) {
+    job->entry = number;
+    job->entry_set = true;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+/* Manifest lines: image [input=path] [budget=n] [engine=fsm|fast|jit]
+ * [memory=size] [load=address] [entry=address], # starts a comment. The
+ * defaults come from defaults.
+ */
+static bool batch_load_manifest(const char *path, const struct BatchJob *defaults)
+{
+  FILE *file = fopen(path, "r");
+  char text[BATCH_MAX_LINE];
+  uint32_t size = 0;
+  uint32_t line = 0;
+
+  if (!file) {
+    perror(path);
+    return false;
+  }
+
+  while (fgets(text, sizeof(text), file)) {
+    struct BatchJob *job;
+    char *save;
+    char *word;
+
+    line++;
+    if (strchr(text, '#'))
+      *strchr(text, '#') = '\0';
+
+    word = strtok_r(text, " \t\r\n", &save);
+    if (!word)
+      continue;
+
+    if (batch.count == size) {
+      size = size ? size * 2 : 256;
+      job = realloc(batch.jobs, size * sizeof(*job));
+      if (!job) {
+        perror("batch_load_manifest");
+        fclose(file);
+        return false;
+      }
+      batch.jobs = job;
+    }
+
+    job = &batch.jobs[batch.count++];
+    *job = *defaults;
+    job->line = line;
+    job->image = strdup(word);
+    if (!job->image) {
+      perror("batch_load_manifest");
+      fclose(file);
+      return false;
+    }
+
+    while ((word = strtok_r(NULL, " \t\r\n", &save))) {
+      if (!batch_parse_setting(job, word)) {
+        fprintf(stderr, "%s:%u: Invalid setting %s\n", path, line, word);
+        fclose(file);
+        return false;
+      }
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+static bool batch_read_file(const char *path, uint8_t **data, size_t *length)
+{
+  FILE *file = fopen(path, "rb");
+  size_t size = 0;
+  size_t count;
+
+  *data = NULL;
+  *length = 0;
+  if (!file) {
+    perror(path);
+    return false;
+  }
+
+  do {
+    if (*length == size) {
+      uint8_t *bigger = realloc(*data, size = size ? size * 2 : 4096);
+
+      if (!bigger) {
+        perror(path);
+        fclose(file);
+        return false;
+      }
+      *data = bigger;
+    }
+
+    count = fread(*data + *length, 1, size - *length, file);
+    *length += count;
+  } while (count);
+
+  fclose(file);
+  return true;
+}
+
+static void batch_uart_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size)
+{
+  struct BatchConsole *console = batch_console;
+
+  if (console->output_length == batch.output_limit) {
+    console->truncated = true;
+    return;
+  }
+
+  if (console->output_length == console->output_size) {
+    size_t bigger = console->output_size ? console->output_size * 2 : 256;
+    uint8_t *output;
+
+    if (bigger > batch.output_limit)
+      bigger = batch.output_limit;
+
+    output = realloc(console->output, bigger);
+    if (!output) {
+      console->truncated = true;
+      return;
+    }
+    console->output = output;
+    console->output_size = bigger;
+  }
+
+  console->output[console->output_length++] = data;
+}
+
+static uint32_t batch_uart_read(struct Machine *m, uint32_t address, uint8_t size)
+{
+  struct BatchConsole *console = batch_console;
+
+  if (console->input_offset == console->input_length)
+    return UART_RX_EMPTY;
+
+  return console->input[console->input_offset++];
+}
+
+static void batch_json_string(FILE *out, const uint8_t *data, size_t length)
+{
+  fputc('"', out);
+  for (size_t i = 0; i < length; i++) {
+    switch (data[i]) {
+      case '"':  fputs("\\\"", out); break;
+      case '\\': fputs("\\\\", out); break;
+      case '\n': fputs("\\n", out); break;
+      case '\r': fputs("\\r", out); break;
+      case '\t': fputs("\\t", out); break;
+
+      default:
+        if (data[i] < 0x20 || data[i] >= 0x7f)
+          fprintf(out, "\\u%04x", data[i]);
+        else
+          fputc(data[i], out);
+        break;
+    }
+  }
+  fputc('"', out);
+}
+
+/* Runs one job, returns its result as a JSON line */
+static char *batch_run(struct BatchWorker *w, uint32_t index)
+{
+  const struct BatchJob *job = &batch.jobs[index];
+  struct BatchConsole console = { NULL };
+  struct Machine *m = w->m;
+  struct timespec start;
+  struct timespec end;
+  uint8_t *input = NULL;
+  const char *failure = NULL;
+  uint8_t reason = MACHINE_EXIT_ERROR;
+  double seconds = 0;
+  size_t size = 0;
+  char *text = NULL;
+  FILE *out;
+
+  if (job->input && !batch_read_file(job->input, &input, &console.input_length)) {
+    failure = "can't read the input";
+  } else if (!system_memory_configure(m, job->memory_size)) {
+    failure = "invalid memory size";
+  } else {
+    machine_reset(m);
+    m->engine = job->engine;
+    if (!machine_load(m, job->image, job->load_address))
+      failure = "can't load the image";
+  }
+
+  if (!failure) {
+    if (job->entry_set)
+      regfile_write(m, REGISTER_PC, job->entry);
+
+    /* reset restored the handlers of the device map */
+    m->mmio_map[VIRT_UART0].read = batch_uart_read;
+    m->mmio_map[VIRT_UART0].write = batch_uart_write;
+    console.input = input;
+    batch_console = &console;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    reason = machine_run(m, job->budget);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    batch_console = NULL;
+    atomic_fetch_add(&batch.exits[reason], 1);
+    atomic_fetch_add(&batch.instructions, m->instret);
+  } else {
+    fprintf(stderr, "Job %u (line %u): %s\n", index, job->line, failure);
+    atomic_fetch_add(&batch.failed, 1);
+  }
+
+  out = open_memstream(&text, &size);
+  if (!out) {
+    perror("open_memstream");
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(out, "{\"job\": %u, \"line\": %u, \"image\": ", index, job->line);
+  batch_json_string(out, (const uint8_t *)job->image, strlen(job->image));
+
+  if (failure) {
+    fprintf(out, ", \"exit\": \"failed\", \"message\": \"%s\"}\n", failure);
+  } else {
+    fprintf(out, ", \"engine\": \"%s\", \"exit\": \"%s\", \"instret\": %llu, \"seconds\": %.6f",
+            engine_names[job->engine], exit_names[reason], (unsigned long long)m->instret, seconds);
+
+    fprintf(out, ", \"registers\": [");
+    for (int i = 0; i < GENERAL_PURPOSE_REGISTER_COUNT; i++)
+      fprintf(out, "%s%u", i ? ", " : "", m->regfile.gp_registers[i]);
+    fprintf(out, "], \"zf\": %d, \"nf\": %d", regfile_zf(&m->regfile), regfile_nf(&m->regfile));
+
+    fprintf(out, ", \"input_read\": %zu, \"uart\": ", console.input_offset);
+    batch_json_string(out, console.output, console.output_length);
+    fprintf(out, ", \"uart_truncated\": %s}\n", console.truncated ? "true" : "false");
+  }
+
+  fclose(out);
+  free(console.output);
+  free(input);
+  return text;
+}
+
+/* Results are written in manifest order, whoever finishes the next one
+ * writes it and all finished after it */
+static void batch_finish(uint32_t index, char *text)
+{
+  pthread_mutex_lock(&batch.results_lock);
+  batch.results[index] = text;
+
+  while (batch.next_result < batch.count && batch.results[batch.next_result]) {
+    fputs(batch.results[batch.next_result], batch.out);
+    free(batch.results[batch.next_result]);
+    batch.results[batch.next_result++] = NULL;
+  }
+
+  pthread_mutex_unlock(&batch.results_lock);
+}
+
+/* Next job of the worker, stolen from another one if it has none left */
+static bool batch_next(struct BatchWorker *w, uint32_t *index)
+{
+  struct BatchQueue *queue = &w->queue;
+  bool found = false;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *index = queue->head++;
+    found = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  for (uint32_t i = 1; i < batch.threads && !found; i++) {
+    struct BatchQueue *victim = &batch.workers[(w->id + i) % batch.threads].queue;
+    uint32_t middle = 0;
+    uint32_t tail = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail) {
+      middle = victim->head + (victim->tail - victim->head) / 2;
+      tail = victim->tail;
+      victim->tail = middle;
+      found = true;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (found) {
+      pthread_mutex_lock(&queue->lock);
+      *index = middle;
+      queue->head = middle + 1;
+      queue->tail = tail;
+      pthread_mutex_unlock(&queue->lock);
+      atomic_fetch_add(&batch.steals, 1);
+    }
+  }
+
+  return found;
+}
+
+static void *batch_worker(void *arg)
+{
+  struct BatchWorker *w = arg;
+  uint32_t index;
+
+  while (batch_next(w, &index))
+    batch_finish(index, batch_run(w, index));
+
+  return NULL;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-j threads] [-o results] [-m fsm|fast|jit] [-M size] [-i budget]\n"
+                  "          [-u bytes] manifest\n", prog);
+  fprintf(stderr, "  -j  threads (default one per host CPU)\n");
+  fprintf(stderr, "  -o  results file, one JSON object per job (default stdout)\n");
+  fprintf(stderr, "  -m  default engine (default fast)\n");
+  fprintf(stderr, "  -M  default system memory size (default 16M)\n");
+  fprintf(stderr, "  -i  default instruction budget, 0 for none (default %u)\n", BATCH_DEFAULT_BUDGET);
+  fprintf(stderr, "  -u  UART output kept per job (default %u)\n", BATCH_DEFAULT_OUTPUT);
+  fprintf(stderr, "Manifest lines: image [input=path] [budget=n] [engine=fsm|fast|jit]\n");
+  fprintf(stderr, "                [memory=size] [load=address] [entry=address]\n");
+}
+
+int main(int argc, char *argv[])
+{
+  struct BatchJob defaults = {
+    .budget = BATCH_DEFAULT_BUDGET,
+    .memory_size = MMIO_SYSTEM_MEMORY_SIZE,
+    .load_address = LOADER_DEFAULT_ADDRESS,
+    .engine = MACHINE_ENGINE_FAST,
+  };
+  const char *output_path = NULL;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  struct timespec start;
+  struct timespec end;
+  uint64_t value;
+  double seconds;
+  int opt;
+
+  batch.output_limit = BATCH_DEFAULT_OUTPUT;
+
+  while ((opt = getopt(argc, argv, "j:o:m:M:i:u:h")) != -1) {
+    switch (opt) {
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 1) {
+          fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'o':
+        output_path = optarg;
+        break;
+
+      case 'm':
+        if (!parse_engine(optarg, &defaults.engine)) {
+          fprintf(stderr, "Unknown mode: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'M':
+        if (!parse_size(optarg, &defaults.memory_size)) {
+          fprintf(stderr, "Invalid memory size: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'i':
+        if (!parse_size(optarg, &defaults.budget)) {
+          fprintf(stderr, "Invalid budget: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'u':
+        if (!parse_size(optarg, &value)) {
+          fprintf(stderr, "Invalid output size: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        batch.output_limit = value;
+        break;
+
+      case 'h':
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 1) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!batch_load_manifest(argv[optind], &defaults))
+    return EXIT_FAILURE;
+
+  if (threads < 1)
+    threads = 1;
+  if (batch.count && threads > batch.count)
+    threads = batch.count;
+
+  batch.out = output_path ? fopen(output_path, "w") : stdout;
+  if (!batch.out) {
+    perror(output_path);
+    return EXIT_FAILURE;
+  }
+
+  batch.threads = threads;
+  batch.workers = calloc(threads, sizeof(*batch.workers));
+  batch.results = calloc(batch.count ? batch.count : 1, sizeof(*batch.results));
+  if (!batch.workers || !batch.results) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+  pthread_mutex_init(&batch.results_lock, NULL);
+
+  for (uint32_t i = 0; i < batch.threads; i++) {
+    struct BatchWorker *w = &batch.workers[i];
+
+    w->id = i;
+    w->queue.head = (uint64_t)batch.count * i / batch.threads;
+    w->queue.tail = (uint64_t)batch.count * (i + 1) / batch.threads;
+    pthread_mutex_init(&w->queue.lock, NULL);
+
+    w->m = machine_create(defaults.memory_size);
+    if (!w->m)
+      return EXIT_FAILURE;
+    for (uint8_t uart = 1; uart < UART_COUNT; uart++)
+      uart_attach(w->m, uart, -1, -1, 0);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < batch.threads; i++) {
+    if (pthread_create(&batch.workers[i].thread, NULL, batch_worker, &batch.workers[i])) {
+      fprintf(stderr, "Can't start thread %u\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (uint32_t i = 0; i < batch.threads; i++) {
+    pthread_join(batch.workers[i].thread, NULL);
+    machine_destroy(batch.workers[i].m);
+    pthread_mutex_destroy(&batch.workers[i].queue.lock);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  if (batch.out != stdout)
+    fclose(batch.out);
+  else
+    fflush(stdout);
+
+  fprintf(stderr, "%u jobs on %u thread(s) in %.2f s, %.0f jobs/s, %.1f M instructions/s, %u steals\n",
+          batch.count, batch.threads, seconds, batch.count / seconds,
+          atomic_load(&batch.instructions) / seconds / 1e6, atomic_load(&batch.steals));
+  fprintf(stderr, "halt %u, break %u, error %u, limit %u, failed %u\n",
+          atomic_load(&batch.exits[MACHINE_EXIT_HALT]), atomic_load(&batch.exits[MACHINE_EXIT_BREAK]),
+          atomic_load(&batch.exits[MACHINE_EXIT_ERROR]), atomic_load(&batch.exits[MACHINE_EXIT_LIMIT]),
+          atomic_load(&batch.failed));
+
+  for (uint32_t i = 0; i < batch.count; i++) {
+    free(batch.jobs[i].image);
+    free(batch.jobs[i].input);
+  }
+  free(batch.jobs);
+  free(batch.results);
+  free(batch.workers);
+  return atomic_load(&batch.failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
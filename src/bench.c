@@ -0,0 +1,444 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "core.h"
+#include "spi.h"
+#include "uart.h"
+#include "machine.h"
+
+/* Guest microbenchmarks.
+ * Every benchmark is a small loop assembled below, run to completion on a
+ * fresh machine with each engine. Runs are repeated and the median time
+ * per instruction is reported, optionally compared to a baseline saved by
+ * an earlier run.
+ */
+#define BENCH_MAX_CODE 64
+#define BENCH_DATA 0x10000 // guest address of benchmark data
+#define BENCH_MAX_REPEATS 101
+#define BENCH_MAX_RESULTS 64
+
+/* Registers used by the loops */
+enum { R_COUNT = REGISTER_R1, R_A, R_B, R_C, R_D, R_E, R_F };
+
+struct BenchProgram {
+  uint32_t code[BENCH_MAX_CODE];
+  uint32_t length;
+};
+
+struct Bench {
+  const char *name;
+  void (*build)(struct BenchProgram *p, uint32_t iterations);
+  uint32_t iterations;
+};
+
+struct BenchResult {
+  char name[32];
+  char engine[8];
+  double ns_per_instruction;
+};
+
+static const char *engine_names[] = {
+  [MACHINE_ENGINE_FSM] = "fsm",
+  [MACHINE_ENGINE_FAST] = "fast",
+  [MACHINE_ENGINE_JIT] = "jit",
+};
+
+static int devnull = -1;
+
+static void emit(struct BenchProgram *p, uint32_t instruction)
+{
+  if (p->length == BENCH_MAX_CODE) {
+    fprintf(stderr, "%s: Benchmark too long\n", __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  p->code[p->length++] = instruction;
+}
+
+static uint32_t encode_r(uint8_t block, uint8_t opcode, uint8_t dst, uint8_t src, uint8_t src2)
+{
+  return block | CODING_SCHEME_R << 3 | opcode << 5 | dst << 8 | src << 13 | src2 << 18;
+}
+
+static uint32_t encode_i(uint8_t block, uint8_t opcode, uint8_t dst, uint8_t src, int32_t imm)
+{
+  return block | CODING_SCHEME_SI << 3 | opcode << 5 | dst << 8 | src << 13 | (imm & 0x3fff) << 18;
+}
+
+static uint32_t encode_ib(uint8_t block, uint8_t opcode, uint8_t dst, uint32_t imm)
+{
+  return block | CODING_SCHEME_IB << 3 | opcode << 5 | dst << 8 | (imm & 0x3ffff) << 13;
+}
+
+/* reg = value, for any 32 bit value */
+static void emit_constant(struct BenchProgram *p, uint8_t reg, uint32_t value)
+{
+  emit(p, encode_ib(BLOCK_ARITHMETIC, OPCODE_ADD, reg, value >> 14));
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_SHL, reg, reg, 14));
+  emit(p, encode_r(BLOCK_ARITHMETIC, OPCODE_XOR, REGISTER_R27, REGISTER_R27, REGISTER_R27));
+  emit(p, encode_ib(BLOCK_ARITHMETIC, OPCODE_ADD, REGISTER_R27, value & 0x3fff));
+  emit(p, encode_r(BLOCK_ARITHMETIC, OPCODE_OR, reg, reg, REGISTER_R27));
+}
+
+/* Count R_COUNT down and branch back to top while it is above zero */
+static void emit_loop_end(struct BenchProgram *p, uint32_t top)
+{
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_SUB, R_COUNT, R_COUNT, 1));
+  emit(p, encode_i(BLOCK_BRANCH, OPCODE_CMP, 0, R_COUNT, 0));
+  emit(p, encode_i(BLOCK_BRANCH, OPCODE_BGT, REGISTER_PC, REGISTER_PC,
+                   ((int32_t)top - (int32_t)p->length) * SIZE_WORD));
+  emit(p, encode_r(BLOCK_CONTROL, OPCODE_HALT, 0, 0, 0));
+}
+
+static void build_alu(struct BenchProgram *p, uint32_t iterations)
+{
+  uint32_t top;
+
+  emit_constant(p, R_COUNT, iterations);
+  emit_constant(p, R_A, 0x12345678);
+  emit_constant(p, R_B, 0x9abcdef0);
+  top = p->length;
+  emit(p, encode_r(BLOCK_ARITHMETIC, OPCODE_ADD, R_C, R_A, R_B));
+  emit(p, encode_r(BLOCK_ARITHMETIC, OPCODE_XOR, R_A, R_A, R_C));
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_SHL, R_D, R_C, 3));
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_SHR, R_E, R_A, 5));
+  emit(p, encode_r(BLOCK_ARITHMETIC, OPCODE_OR, R_B, R_D, R_E));
+  emit(p, encode_r(BLOCK_ARITHMETIC, OPCODE_AND, R_F, R_B, R_C));
+  emit(p, encode_r(BLOCK_ARITHMETIC, OPCODE_SUB, R_B, R_B, R_F));
+  emit(p, encode_r(BLOCK_ARITHMETIC, OPCODE_NOT, R_F, 0, 0));
+  emit_loop_end(p, top);
+}
+
+/* Read-modify-write every word of a 256k buffer, over and over */
+static void build_memory(struct BenchProgram *p, uint32_t iterations)
+{
+  uint32_t top;
+
+  emit_constant(p, R_COUNT, iterations);
+  emit_constant(p, R_A, 0);                // offset
+  emit_constant(p, R_B, 0x3fffc);          // offset mask
+  emit_constant(p, R_C, BENCH_DATA);
+  top = p->length;
+  emit(p, encode_r(BLOCK_ARITHMETIC, OPCODE_AND, R_D, R_A, R_B));
+  emit(p, encode_r(BLOCK_ARITHMETIC, OPCODE_ADD, R_D, R_D, R_C));
+  emit(p, encode_i(BLOCK_MEMORY, OPCODE_LW, R_E, R_D, 0));
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_ADD, R_E, R_E, 1));
+  emit(p, encode_r(BLOCK_MEMORY, OPCODE_SW, R_D, REGISTER_RZ, R_E));
+  emit(p, encode_i(BLOCK_MEMORY, OPCODE_LB, R_F, R_D, 1));
+  emit(p, encode_r(BLOCK_MEMORY, OPCODE_SB, R_D, REGISTER_RZ, R_F));
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_ADD, R_A, R_A, SIZE_WORD));
+  emit_loop_end(p, top);
+}
+
+/* Compares and conditional branches, taken and not taken in turn */
+static void build_branch(struct BenchProgram *p, uint32_t iterations)
+{
+  uint32_t top;
+
+  emit_constant(p, R_COUNT, iterations);
+  top = p->length;
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_AND, R_A, R_COUNT, 1));
+  emit(p, encode_i(BLOCK_BRANCH, OPCODE_CMP, 0, R_A, 0));
+  emit(p, encode_i(BLOCK_BRANCH, OPCODE_BEQ, REGISTER_PC, REGISTER_PC, 2 * SIZE_WORD));
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_ADD, R_B, R_B, 1));
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_AND, R_C, R_COUNT, 3));
+  emit(p, encode_i(BLOCK_BRANCH, OPCODE_CMP, 0, R_C, 2));
+  emit(p, encode_i(BLOCK_BRANCH, OPCODE_BLT, REGISTER_PC, REGISTER_PC, 2 * SIZE_WORD));
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_ADD, R_D, R_D, 1));
+  emit(p, encode_i(BLOCK_BRANCH, OPCODE_CMP, 0, R_C, 1));
+  emit(p, encode_i(BLOCK_BRANCH, OPCODE_BGE, REGISTER_PC, REGISTER_PC, 2 * SIZE_WORD));
+  emit(p, encode_i(BLOCK_ARITHMETIC, OPCODE_ADD, R_E, R_E, 1));
+  emit_loop_end(p, top);
+}
+
+/* Byte after byte to UART0, written to /dev/null by the host */
+static void build_uart(struct BenchProgram *p, uint32_t iterations)
+{
+  uint32_t top;
+
+  emit_constant(p, R_COUNT, iterations);
+  emit_constant(p, R_A, MMIO_UART_0);
+  top = p->length;
+  emit(p, encode_i(BLOCK_MEMORY, OPCODE_SB, R_A, REGISTER_RZ, 'x'));
+  emit(p, encode_i(BLOCK_MEMORY, OPCODE_SB, R_A, REGISTER_RZ, '\n'));
+  emit_loop_end(p, top);
+}
+
+/* Device register traffic, polling the SPI status and the UART */
+static void build_mmio(struct BenchProgram *p, uint32_t iterations)
+{
+  uint32_t top;
+
+  emit_constant(p, R_COUNT, iterations);
+  emit_constant(p, R_A, SPI_REG_SECTOR);
+  emit_constant(p, R_B, MMIO_UART_1);
+  top = p->length;
+  emit(p, encode_r(BLOCK_MEMORY, OPCODE_SW, R_A, REGISTER_RZ, R_COUNT));
+  emit(p, encode_i(BLOCK_MEMORY, OPCODE_LW, R_C, REGISTER_RZ, SPI_REG_STATUS));
+  emit(p, encode_i(BLOCK_MEMORY, OPCODE_LW, R_D, R_A, 0));
+  emit(p, encode_i(BLOCK_MEMORY, OPCODE_LB, R_E, R_B, 0));
+  emit_loop_end(p, top);
+}
+
+static const struct Bench benches[] = {
+  { "alu", build_alu, 2000000 },
+  { "memory", build_memory, 2000000 },
+  { "branch", build_branch, 2000000 },
+  { "uart", build_uart, 2000000 },
+  { "mmio", build_mmio, 2000000 },
+};
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+/* Run one benchmark to completion, returns the time taken in ns */
+static double bench_run(const struct Bench *bench, uint8_t engine, uint32_t iterations,
+                        uint64_t *instructions)
+{
+  struct BenchProgram program = { .length = 0 };
+  struct Machine *m = machine_create(MMIO_SYSTEM_MEMORY_SIZE);
+  struct timespec start;
+  struct timespec end;
+  uint8_t reason;
+
+  if (!m)
+    exit(EXIT_FAILURE);
+
+  bench->build(&program, iterations);
+  system_memory_store(m, 0, program.code, program.length * SIZE_WORD);
+  regfile_write(m, REGISTER_PC, MMIO_SYSTEM_MEMORY_START);
+  uart_attach(m, 0, -1, devnull, 0);
+  m->engine = engine;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  reason = machine_run(m, MACHINE_RUN_UNLIMITED);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (reason != MACHINE_EXIT_HALT) {
+    fprintf(stderr, "%s: %s didn't halt on %s\n", __FUNCTION__, bench->name, engine_names[engine]);
+    exit(EXIT_FAILURE);
+  }
+
+  *instructions = m->instret;
+  machine_destroy(m);
+  return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static uint32_t load_baseline(const char *path, struct BenchResult *results)
+{
+  FILE *file = fopen(path, "r");
+  uint32_t count = 0;
+
+  if (!file) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  while (count < BENCH_MAX_RESULTS &&
+         fscanf(file, "%31s %7s %lf", results[count].name, results[count].engine,
+                &results[count].ns_per_instruction) == 3)
+    count++;
+
+  fclose(file);
+  return count;
+}
+
+static const struct BenchResult *find_result(const struct BenchResult *results, uint32_t count,
+                                             const char *name, const char *engine)
+{
+  for (uint32_t i = 0; i < count; i++) {
+    if (!strcmp(results[i].name, name) && !strcmp(results[i].engine, engine))
+      return &results[i];
+  }
+
+  return NULL;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-m fsm|fast|jit] [-r repeats] [-s scale] [-b baseline] [-t percent]\n"
+                  "          [-o output] [benchmark...]\n", prog);
+  fprintf(stderr, "  -m  engine to run, may be repeated (default fsm and fast)\n");
+  fprintf(stderr, "  -r  runs per benchmark, the median is reported (default 5)\n");
+  fprintf(stderr, "  -s  iteration count multiplier (default 1)\n");
+  fprintf(stderr, "  -b  compare against results saved with -o\n");
+  fprintf(stderr, "  -t  slowdown counted as regression, in percent (default 10)\n");
+  fprintf(stderr, "  -o  save results\n");
+  fprintf(stderr, "Benchmarks:");
+  for (uint32_t i = 0; i < BENCH_COUNT; i++)
+    fprintf(stderr, " %s", benches[i].name);
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+  struct BenchResult baseline[BENCH_MAX_RESULTS];
+  struct BenchResult results[BENCH_MAX_RESULTS];
+  double samples[BENCH_MAX_REPEATS];
+  bool engines[MACHINE_ENGINE_JIT + 1] = { false };
+  bool engines_set = false;
+  const char *baseline_path = NULL;
+  const char *output_path = NULL;
+  uint32_t baseline_count = 0;
+  uint32_t result_count = 0;
+  double threshold = 10.0;
+  double scale = 1.0;
+  int repeats = 5;
+  int regressions = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:r:s:b:t:o:h")) != -1) {
+    switch (opt) {
+      case 'm':
+        for (int i = 0; i <= MACHINE_ENGINE_JIT; i++) {
+          if (!strcmp(optarg, engine_names[i])) {
+            engines[i] = true;
+            engines_set = true;
+            break;
+          }
+          if (i == MACHINE_ENGINE_JIT) {
+            fprintf(stderr, "Unknown mode: %s\n", optarg);
+            return EXIT_FAILURE;
+          }
+        }
+        break;
+
+      case 'r':
+        repeats = atoi(optarg);
+        if (repeats < 1 || repeats > BENCH_MAX_REPEATS) {
+          fprintf(stderr, "Invalid repeat count: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 's':
+        scale = atof(optarg);
+        if (scale <= 0) {
+          fprintf(stderr, "Invalid scale: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'b':
+        baseline_path = optarg;
+        break;
+
+      case 't':
+        threshold = atof(optarg);
+        break;
+
+      case 'o':
+        output_path = optarg;
+        break;
+
+      case 'h':
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (!engines_set) {
+    engines[MACHINE_ENGINE_FSM] = true;
+    engines[MACHINE_ENGINE_FAST] = true;
+  }
+
+  if (baseline_path)
+    baseline_count = load_baseline(baseline_path, baseline);
+
+  devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (devnull < 0) {
+    perror("/dev/null");
+    return EXIT_FAILURE;
+  }
+
+  printf("%-8s %-6s %12s %10s %10s %10s %10s", "bench", "engine", "instructions", "ns/insn",
+         "min", "max", "MIPS");
+  printf(baseline_count ? " %10s\n" : "\n", "baseline");
+
+  for (uint32_t i = 0; i < BENCH_COUNT; i++) {
+    const struct Bench *bench = &benches[i];
+    bool selected = optind == argc;
+
+    for (int arg = optind; arg < argc; arg++)
+      selected |= !strcmp(argv[arg], bench->name);
+
+    if (!selected)
+      continue;
+
+    for (int engine = 0; engine <= MACHINE_ENGINE_JIT; engine++) {
+      uint32_t iterations = bench->iterations * scale;
+      const struct BenchResult *base;
+      struct BenchResult *result;
+      uint64_t instructions = 0;
+      double median;
+
+      if (!engines[engine])
+        continue;
+
+      if (!iterations)
+        iterations = 1;
+
+      for (int run = 0; run < repeats; run++)
+        samples[run] = bench_run(bench, engine, iterations, &instructions) / instructions;
+
+      qsort(samples, repeats, sizeof(samples[0]), compare_double);
+      median = repeats % 2 ? samples[repeats / 2]
+                           : (samples[repeats / 2 - 1] + samples[repeats / 2]) / 2;
+
+      printf("%-8s %-6s %12lu %10.3f %10.3f %10.3f %10.1f", bench->name, engine_names[engine],
+             (unsigned long)instructions, median, samples[0], samples[repeats - 1], 1e3 / median);
+
+      base = find_result(baseline, baseline_count, bench->name, engine_names[engine]);
+      if (base) {
+        double change = 100.0 * (median - base->ns_per_instruction) / base->ns_per_instruction;
+
+        printf(" %+9.1f%%%s", change, change > threshold ? " REGRESSION" : "");
+        regressions += change > threshold;
+      }
+      printf("\n");
+      fflush(stdout);
+
+      if (result_count < BENCH_MAX_RESULTS) {
+        result = &results[result_count++];
+        snprintf(result->name, sizeof(result->name), "%s", bench->name);
+        snprintf(result->engine, sizeof(result->engine), "%s", engine_names[engine]);
+        result->ns_per_instruction = median;
+      }
+    }
+  }
+
+  close(devnull);
+
+  if (output_path) {
+    FILE *file = fopen(output_path, "w");
+
+    if (!file) {
+      perror(output_path);
+      return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < result_count; i++)
+      fprintf(file, "%s %s %.4f\n", results[i].name, results[i].engine,
+              results[i].ns_per_instruction);
+    fclose(file);
+  }
+
+  if (regressions)
+    fprintf(stderr, "%d regression(s) over %.1f%%\n", regressions, threshold);
+
+  return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
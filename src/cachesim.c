@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "rscs.h"
+#include "cachesim.h"
+#include "machine.h"
+
+static const char *cachesim_level_names[CACHESIM_LEVELS] = { "l1i", "l1d", "l2" };
+static const char *cachesim_policy_names[] = { "lru", "plru" };
+
+void cachesim_default_config(struct CacheSimConfig *config)
+{
+  config->levels[CACHESIM_L1I] = (struct CacheSimLevelConfig){ 32 << 10, 8, 64, CACHESIM_POLICY_LRU };
+  config->levels[CACHESIM_L1D] = (struct CacheSimLevelConfig){ 32 << 10, 8, 64, CACHESIM_POLICY_LRU };
+  config->levels[CACHESIM_L2] = (struct CacheSimLevelConfig){ 1 << 20, 16, 64, CACHESIM_POLICY_LRU };
+}
+
+/* Number with an optional k or M suffix */
+static bool cachesim_parse_number(const char *arg, uint32_t *number)
+{
+  char *end;
+  uint64_t value = strtoull(arg, &end, 0);
+
+  switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+  }
+
+  if (end == arg || *end || value > UINT32_MAX)
+    return false;
+
+  *number = value;
+  return true;
+}
+
+bool cachesim_parse_config(const char *spec, struct CacheSimConfig *config)
+{
+  char *copy = strdup(spec);
+  char *save = NULL;
+  bool ret = true;
+
+  if (!copy) {
+    perror("cachesim_parse_config");
+    return false;
+  }
+
+  for (char *item = strtok_r(copy, ",", &save); item && ret; item = strtok_r(NULL, ",", &save)) {
+    struct CacheSimLevelConfig *level = NULL;
+    char *value = strchr(item, '=');
+    char *fields = NULL;
+    char *field;
+    int i;
+
+    if (!strcmp(item, "default"))
+      continue;
+
+    if (value) {
+      *value++ = 0;
+      for (i = 0; i < CACHESIM_LEVELS; i++)
+        if (!strcmp(item, cachesim_level_names[i]))
+          level = &config->levels[i];
+    }
+
+    if (!level) {
+      fprintf(stderr, "Unknown cache level: %s\n", item);
+      ret = false;
+      break;
+    }
+
+    /* size[:ways[:line_size[:policy]]] */
+    for (i = 0, field = strtok_r(value, ":", &fields); field && ret;
+         i++, field = strtok_r(NULL, ":", &fields)) {
+      switch (i) {
+        case 0:
+          ret = cachesim_parse_number(field, &level->size);
+          break;
+
+        case 1:
+          ret = cachesim_parse_number(field, &level->ways);
+          break;
+
+        case 2:
+          ret = cachesim_parse_number(field, &level->line_size);
+          break;
+
+        case 3:
+          if (!strcmp(field, "lru"))
+            level->policy = CACHESIM_POLICY_LRU;
+          else if (!strcmp(field, "plru"))
+            level->policy = CACHESIM_POLICY_PLRU;
+          else
+            ret = false;
+          break;
+
+        default:
+          ret = false;
+          break;
+      }
+    }
+
+    if (!ret || !i) {
+      fprintf(stderr, "Invalid cache configuration for %s\n", item);
+      ret = false;
+    }
+  }
+
+  free(copy);
+  return ret;
+}
+
+static bool cachesim_check_level(const struct CacheSimLevelConfig *config, uint8_t index)
+{
+  uint32_t sets;
+
+  if (!config->size && index == CACHESIM_L2)
+    return true;
+
+  if (config->line_size < SIZE_WORD || config->line_size & (config->line_size - 1)
+      || !config->ways || config->size % ((uint64_t)config->ways * config->line_size)) {
+    fprintf(stderr, "%s: Size of %s isn't a multiple of its ways and line size\n", __FUNCTION__,
+            cachesim_level_names[index]);
+    return false;
+  }
+
+  sets = config->size / config->ways / config->line_size;
+  if (!sets || sets & (sets - 1)) {
+    fprintf(stderr, "%s: Number of %s sets must be a power of two\n", __FUNCTION__,
+            cachesim_level_names[index]);
+    return false;
+  }
+
+  if (config->policy == CACHESIM_POLICY_PLRU
+      && (config->ways > 64 || config->ways & (config->ways - 1))) {
+    fprintf(stderr, "%s: Pseudo-LRU %s needs a power of two ways up to 64\n", __FUNCTION__,
+            cachesim_level_names[index]);
+    return false;
+  }
+
+  return true;
+}
+
+/* Cache model, run by the simulator thread */
+
+static void cachesim_touch(struct CacheSimLevel *level, uint32_t set, uint32_t way)
+{
+  uint32_t ways = level->config.ways;
+  uint64_t tree;
+  uint32_t node = 1;
+
+  if (level->config.policy == CACHESIM_POLICY_LRU) {
+    level->stamps[set * ways + way] = ++level->clock;
+    return;
+  }
+
+  /* point every node on the way to the line away from it */
+  tree = level->trees[set];
+  for (uint32_t bit = ways >> 1; bit; bit >>= 1) {
+    uint32_t right = !!(way & bit);
+
+    tree = (tree & ~(1ULL << node)) | (uint64_t)!right << node;
+    node = node * 2 + right;
+  }
+  level->trees[set] = tree;
+}
+
+static uint32_t cachesim_victim(struct CacheSimLevel *level, uint32_t set)
+{
+  uint32_t ways = level->config.ways;
+  uint32_t *tags = &level->tags[set * ways];
+  uint64_t *stamps = &level->stamps[set * ways];
+  uint32_t victim = 0;
+  uint32_t node = 1;
+
+  for (uint32_t way = 0; way < ways; way++)
+    if (!tags[way])
+      return way;
+
+  if (level->config.policy == CACHESIM_POLICY_LRU) {
+    for (uint32_t way = 1; way < ways; way++)
+      if (stamps[way] < stamps[victim])
+        victim = way;
+    return victim;
+  }
+
+  for (uint32_t bit = ways >> 1; bit; bit >>= 1) {
+    uint32_t right = level->trees[set] >> node & 1;
+
+    victim = victim * 2 + right;
+    node = node * 2 + right;
+  }
+  return victim;
+}
+
+/* Looks up the line holding `address` and fills it on a miss, true on a
+ * hit. A dirty line pushed out is returned in `evicted`, 0 if none.
+ */
+static bool cachesim_lookup(struct CacheSimLevel *level, uint32_t address, bool write,
+                            uint32_t *evicted)
+{
+  uint32_t line = address >> level->line_shift;
+  uint32_t set = line & (level->sets - 1);
+  uint32_t ways = level->config.ways;
+  uint32_t *tags = &level->tags[set * ways];
+  uint8_t *dirty = &level->dirty[set * ways];
+  uint32_t way;
+  bool hit;
+
+  *evicted = 0;
+  for (way = 0; way < ways; way++)
+    if (tags[way] == line + 1)
+      break;
+
+  hit = way < ways;
+  if (!hit) {
+    way = cachesim_victim(level, set);
+    if (tags[way] && dirty[way]) {
+      *evicted = (tags[way] - 1) << level->line_shift;
+      level->writebacks++;
+    }
+    tags[way] = line + 1;
+    dirty[way] = false;
+  }
+
+  dirty[way] |= write;
+  cachesim_touch(level, set, way);
+  return hit;
+}
+
+static void cachesim_simulate(struct CacheSim *sim, const struct CacheSimAccess *record)
+{
+  uint8_t kind = record->pc & (SIZE_WORD - 1);
+  uint32_t pc = record->pc & ~(SIZE_WORD - 1);
+  struct CacheSimLevel *l1 = &sim->levels[kind == CACHESIM_FETCH ? CACHESIM_L1I : CACHESIM_L1D];
+  struct CacheSimLevel *l2 = &sim->levels[CACHESIM_L2];
+  struct CacheSimPcStats dummy = { 0 };
+  struct CacheSimPcStats *stats = &dummy;
+  uint32_t evicted;
+
+  /* device registers aren't cached */
+  if (record->address - MMIO_SYSTEM_MEMORY_START >= sim->pc_stats_size)
+    return;
+
+  if (pc - MMIO_SYSTEM_MEMORY_START < sim->pc_stats_size)
+    stats = &sim->pc_stats[(pc - MMIO_SYSTEM_MEMORY_START) / SIZE_WORD];
+
+  l1->accesses++;
+  if (kind == CACHESIM_FETCH)
+    stats->fetches++;
+  else
+    stats->accesses++;
+
+  if (cachesim_lookup(l1, record->address, kind == CACHESIM_WRITE, &evicted))
+    return;
+
+  l1->misses++;
+  if (kind == CACHESIM_FETCH)
+    stats->fetch_misses++;
+  else
+    stats->access_misses++;
+
+  if (!l2->config.size)
+    return;
+
+  l2->accesses++;
+  if (!cachesim_lookup(l2, record->address, false, &(uint32_t){ 0 })) {
+    l2->misses++;
+    stats->l2_misses++;
+  }
+
+  /* a write back from L1 isn't counted as an L2 access */
+  if (evicted)
+    cachesim_lookup(l2, evicted, true, &(uint32_t){ 0 });
+}
+
+static void *cachesim_simulator(void *arg)
+{
+  struct CacheSim *sim = arg;
+
+  pthread_mutex_lock(&sim->lock);
+  for (;;) {
+    struct CacheSimBuffer *buffer;
+
+    while (sim->simulated == sim->submitted && !sim->stopping)
+      pthread_cond_wait(&sim->cond, &sim->lock);
+
+    if (sim->simulated == sim->submitted)
+      break;
+
+    buffer = &sim->buffers[sim->simulated % CACHESIM_BUFFERS];
+    pthread_mutex_unlock(&sim->lock);
+
+    for (uint32_t i = 0; i < buffer->count; i++)
+      cachesim_simulate(sim, &buffer->records[i]);
+
+    pthread_mutex_lock(&sim->lock);
+    sim->simulated++;
+    pthread_cond_broadcast(&sim->cond);
+  }
+  pthread_mutex_unlock(&sim->lock);
+
+  return NULL;
+}
+
+/* Recording */
+
+static void cachesim_begin_batch(struct CacheSim *sim)
+{
+  struct CacheSimBuffer *buffer = &sim->buffers[sim->submitted % CACHESIM_BUFFERS];
+
+  sim->cursor = buffer->records;
+  sim->end = buffer->records + CACHESIM_BATCH - 1;
+}
+
+/* Hand the current batch to the simulator and start the next one */
+void cachesim_submit(struct CacheSim *sim)
+{
+  struct CacheSimBuffer *buffer = &sim->buffers[sim->submitted % CACHESIM_BUFFERS];
+
+  buffer->count = sim->cursor - buffer->records;
+
+  pthread_mutex_lock(&sim->lock);
+  sim->submitted++;
+  pthread_cond_broadcast(&sim->cond);
+  while (sim->submitted - sim->simulated == CACHESIM_BUFFERS)
+    pthread_cond_wait(&sim->cond, &sim->lock);
+  pthread_mutex_unlock(&sim->lock);
+
+  cachesim_begin_batch(sim);
+}
+
+static void cachesim_free(struct CacheSim *sim)
+{
+  for (int i = 0; i < CACHESIM_LEVELS; i++) {
+    free(sim->levels[i].tags);
+    free(sim->levels[i].dirty);
+    free(sim->levels[i].stamps);
+    free(sim->levels[i].trees);
+  }
+
+  if (sim->pc_stats)
+    munmap(sim->pc_stats, (uint64_t)sim->pc_stats_size / SIZE_WORD * sizeof(*sim->pc_stats));
+  free(sim);
+}
+
+bool cachesim_start(struct Machine *m, const struct CacheSimConfig *config)
+{
+  struct CacheSim *sim;
+  void *pc_stats;
+  uint32_t shortest = UINT32_MAX;
+
+  for (int i = 0; i < CACHESIM_LEVELS; i++)
+    if (!cachesim_check_level(&config->levels[i], i))
+      return false;
+
+  if (m->cachesim)
+    cachesim_stop(m);
+
+  sim = calloc(1, sizeof(*sim));
+  if (!sim) {
+    perror("cachesim_start");
+    return false;
+  }
+
+  for (int i = 0; i < CACHESIM_LEVELS; i++) {
+    struct CacheSimLevel *level = &sim->levels[i];
+    uint32_t lines;
+
+    level->config = config->levels[i];
+    if (!level->config.size)
+      continue;
+
+    lines = level->config.size / level->config.line_size;
+    level->sets = lines / level->config.ways;
+    level->line_shift = __builtin_ctz(level->config.line_size);
+    level->tags = calloc(lines, sizeof(*level->tags));
+    level->dirty = calloc(lines, sizeof(*level->dirty));
+    level->stamps = calloc(lines, sizeof(*level->stamps));
+    level->trees = calloc(level->sets, sizeof(*level->trees));
+    if (!level->tags || !level->dirty || !level->stamps || !level->trees) {
+      perror("cachesim_start");
+      cachesim_free(sim);
+      return false;
+    }
+
+    if (level->config.line_size < shortest)
+      shortest = level->config.line_size;
+  }
+
+  /* like system memory, only the pages of executed code get committed */
+  pc_stats = mmap(NULL, (uint64_t)m->memory.size / SIZE_WORD * sizeof(*sim->pc_stats),
+                  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pc_stats == MAP_FAILED) {
+    perror("cachesim_start");
+    cachesim_free(sim);
+    return false;
+  }
+  sim->pc_stats = pc_stats;
+  sim->pc_stats_size = m->memory.size;
+  sim->line_mask = shortest - 1;
+
+  pthread_mutex_init(&sim->lock, NULL);
+  pthread_cond_init(&sim->cond, NULL);
+  if (pthread_create(&sim->simulator, NULL, cachesim_simulator, sim)) {
+    perror("cachesim_start");
+    cachesim_free(sim);
+    return false;
+  }
+
+  cachesim_begin_batch(sim);
+  m->cachesim = sim;
+  return true;
+}
+
+/* Simulate what's left and wait for it */
+static void cachesim_flush(struct CacheSim *sim)
+{
+  cachesim_submit(sim);
+
+  pthread_mutex_lock(&sim->lock);
+  while (sim->simulated != sim->submitted)
+    pthread_cond_wait(&sim->cond, &sim->lock);
+  pthread_mutex_unlock(&sim->lock);
+}
+
+void cachesim_stop(struct Machine *m)
+{
+  struct CacheSim *sim = m->cachesim;
+
+  if (!sim)
+    return;
+
+  pthread_mutex_lock(&sim->lock);
+  sim->stopping = true;
+  pthread_cond_broadcast(&sim->cond);
+  pthread_mutex_unlock(&sim->lock);
+  pthread_join(sim->simulator, NULL);
+
+  pthread_mutex_destroy(&sim->lock);
+  pthread_cond_destroy(&sim->cond);
+  cachesim_free(sim);
+  m->cachesim = NULL;
+}
+
+/* Report */
+
+static uint64_t cachesim_pc_misses(const struct CacheSimPcStats *stats)
+{
+  return stats->fetch_misses + stats->access_misses;
+}
+
+/* Indices of the PCs missing L1 most often, count of them returned */
+static uint32_t cachesim_top_pcs(const struct CacheSim *sim, uint32_t *top, uint32_t max)
+{
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < sim->pc_stats_size / SIZE_WORD; i++) {
+    uint64_t misses = cachesim_pc_misses(&sim->pc_stats[i]);
+    uint32_t j;
+
+    if (!misses || (count == max && misses <= cachesim_pc_misses(&sim->pc_stats[top[count - 1]])))
+      continue;
+
+    if (count < max)
+      count++;
+
+    for (j = count - 1; j > 0 && cachesim_pc_misses(&sim->pc_stats[top[j - 1]]) < misses; j--)
+      top[j] = top[j - 1];
+    top[j] = i;
+  }
+
+  return count;
+}
+
+static const char *cachesim_format_size(uint32_t size, char *buffer)
+{
+  if (!(size & ((1 << 20) - 1)))
+    sprintf(buffer, "%uM", size >> 20);
+  else if (!(size & ((1 << 10) - 1)))
+    sprintf(buffer, "%uK", size >> 10);
+  else
+    sprintf(buffer, "%u", size);
+  return buffer;
+}
+
+static double cachesim_rate(uint64_t misses, uint64_t accesses)
+{
+  return accesses ? 100.0 * misses / accesses : 0.0;
+}
+
+void cachesim_report(struct Machine *m, FILE *out)
+{
+  struct CacheSim *sim = m->cachesim;
+  uint32_t top[CACHESIM_REPORT_TOP_PCS];
+  uint32_t count;
+  char size[16];
+
+  if (!sim)
+    return;
+
+  cachesim_flush(sim);
+
+  fprintf(out, "caches:\n");
+  for (int i = 0; i < CACHESIM_LEVELS; i++) {
+    const struct CacheSimLevel *level = &sim->levels[i];
+
+    if (!level->config.size)
+      continue;
+
+    fprintf(out, "  %-3s %6s %2u way %3u byte lines %-4s %14lu accesses %14lu misses %6.2f%% %12lu writebacks\n",
+            cachesim_level_names[i], cachesim_format_size(level->config.size, size), level->config.ways,
+            level->config.line_size, cachesim_policy_names[level->config.policy],
+            (unsigned long)level->accesses, (unsigned long)level->misses,
+            cachesim_rate(level->misses, level->accesses), (unsigned long)level->writebacks);
+  }
+
+  count = cachesim_top_pcs(sim, top, CACHESIM_REPORT_TOP_PCS);
+  fprintf(out, "most L1 misses:\n  %-10s %14s %10s %14s %10s %14s\n", "pc", "fetches", "l1i miss",
+          "accesses", "l1d miss", "l2 misses");
+  for (uint32_t i = 0; i < count; i++) {
+    const struct CacheSimPcStats *stats = &sim->pc_stats[top[i]];
+
+    fprintf(out, "  0x%08x %14lu %9.2f%% %14lu %9.2f%% %14lu\n",
+            top[i] * SIZE_WORD + MMIO_SYSTEM_MEMORY_START, (unsigned long)stats->fetches,
+            cachesim_rate(stats->fetch_misses, stats->fetches), (unsigned long)stats->accesses,
+            cachesim_rate(stats->access_misses, stats->accesses), (unsigned long)stats->l2_misses);
+  }
+}
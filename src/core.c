@@ -1,73 +1,95 @@
+#include "config.h"
+
+#include <endian.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #include "rscs.h"
 #include "core.h"
+#include "cachesim.h"
+#include "icache.h"
+#include "intc.h"
+#include "interp.h"
+#include "jit.h"
+#include "perf.h"
+#include "smp.h"
+#include "timing.h"
+#include "trace.h"
+#include "uart.h"
+#include "machine.h"
 
-extern struct Regfile regfile;
-
-static uint8_t fsm_current_state;
-static uint8_t fsm_next_state;
+static inline void inc_pc(struct Machine *m);
+static void execute_arith(struct Machine *m, uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2);
+static void execute_memory(struct Machine *m, uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2);
+static void execute_branch(struct Machine *m, uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2);
+static void execute_atomic(struct Machine *m, uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2);
+static void execute_ctrl(struct Machine *m, uint8_t opcode);
 
-static union Decoder decoder;
-static uint32_t execute_op1;
-static uint32_t execute_op2;
-
-void core_init()
+void core_init(struct Machine *m)
 {
-  fsm_init();
-  regfile_init();
-  mmu_init();
+  fsm_init(m);
+  regfile_init(m);
+  mmu_init(m);
+  icache_init(m);
+  jit_init(m);
 }
 
-void fsm_init()
+void fsm_init(struct Machine *m)
 {
-  fsm_current_state = STATE_INIT;
-  fsm_next_state = STATE_INIT;
-  decoder.instruction = 0;
+  m->core.fsm_current_state = STATE_INIT;
+  m->core.fsm_next_state = STATE_INIT;
+  m->core.decoded = NULL;
 }
 
-bool fsm_cycle_state()
+bool fsm_cycle_state(struct Machine *m)
 {
+  struct Core *core = &m->core;
   bool retval = true;
-  uint8_t check = 0;
   
-  switch (fsm_current_state) {
+  switch (core->fsm_current_state) {
     case STATE_INIT:
-      fsm_next_state = STATE_FETCH;
+      core->fsm_next_state = STATE_FETCH;
       break;
       
     case STATE_FETCH:
-      decoder.instruction = mmu_read(regfile.gp_registers[REGISTER_PC], SIZE_WORD);
-      fsm_next_state = STATE_DECODE;
+      core->decoded = icache_fetch(m, m->regfile.gp_registers[REGISTER_PC]);
+      core->fsm_next_state = STATE_DECODE;
+      if (core->decoded->handler == HANDLER_BREAKPOINT) {
+        /* stop before it */
+        m->regfile.ctrl_regs.ctrl_brk = true;
+        core->fsm_next_state = STATE_CHECK;
+      }
       break;
       
     case STATE_DECODE:
-      decode();
-      fsm_next_state = STATE_EXECUTE;
+      decode(m);
+      core->fsm_next_state = STATE_EXECUTE;
       break;
       
     case STATE_EXECUTE:
-      execute_instruction();
-      fsm_next_state = STATE_CHECK;
+      execute_instruction(m);
+      m->instret++;
+      /* ctrl flags set by the instruction are handled in STATE_CHECK:
+       *   ctrl_hlt, ctrl_brk  control instructions
+       *   ctrl_err            faulting memory, device, atomic or unimplemented instructions
+       *   ctrl_evt            devices and WFI */
+      if (m->regfile.ctrl_regs.ctrl_hlt | m->regfile.ctrl_regs.ctrl_brk | m->regfile.ctrl_regs.ctrl_err |
+          m->regfile.ctrl_regs.ctrl_evt)
+        core->fsm_next_state = STATE_CHECK;
+      else
+        core->fsm_next_state = STATE_FETCH;
       break;
           
     case STATE_CHECK:
-      fsm_next_state = check_ctrl_regs();
+      core->fsm_next_state = check_ctrl_regs(m);
       break;
       
     case STATE_BREAK:
-      fsm_next_state = STATE_BREAK;
+      core->fsm_next_state = STATE_BREAK;
       break;
       
     case STATE_ERROR:
-      fprintf(stderr, "Error occured\n");
-
-      printf("INSTRUCTION: \n");
-      printf("0x%08x\n", decoder.instruction);
-          
-      printf("REGISTERS: \n");
-      regfile_dump_registers();
+      core_dump_error(m, core->decoded->instruction);
       retval = false;
       break;
       
@@ -76,42 +98,38 @@ bool fsm_cycle_state()
       break;
       
     default:
-      fprintf(stderr, "Invalid state: %d\n", fsm_current_state);
+      fprintf(stderr, "Invalid state: %d\n", core->fsm_current_state);
       break;
   }
 
-  fsm_current_state = fsm_next_state;
+  core->fsm_current_state = core->fsm_next_state;
   return retval;
 }
 
-void decode()
+void decode(struct Machine *m)
 {
-  uint32_t op1;
-  uint32_t op2;
+  struct Core *core = &m->core;
+  const struct DecodedInstruction *decoded = core->decoded;
 
-  switch (decoder.common.__scheme) {
+  switch (decoded->scheme) {
     case CODING_SCHEME_R:
-      execute_op1 = regfile.gp_registers[decoder.common.__srcreg];
-      execute_op2 = regfile.gp_registers[decoder.type_reg.__src2reg];
+      core->execute_op1 = m->regfile.gp_registers[decoded->srcreg];
+      core->execute_op2 = m->regfile.gp_registers[decoded->src2reg];
       break;
       
     case CODING_SCHEME_SI:
-      execute_op1 = regfile.gp_registers[decoder.common.__srcreg];
-      execute_op2 = sign_extend(decoder.type_imm.__imm);
-      break;
-      
     case CODING_SCHEME_UI:
-      execute_op1 = regfile.gp_registers[decoder.common.__srcreg];
-      execute_op2 = decoder.type_imm.__imm;
+      core->execute_op1 = m->regfile.gp_registers[decoded->srcreg];
+      core->execute_op2 = decoded->imm;
       break;
       
     case CODING_SCHEME_IB:
-      execute_op1 = 0;
-      execute_op2 = decoder.type_imm_extended.__imm;
+      core->execute_op1 = 0;
+      core->execute_op2 = decoded->imm;
       break;
       
     default:
-      fprintf(stderr, "Unknown coding scheme: %u\n", decoder.common.__scheme);
+      fprintf(stderr, "Unknown coding scheme: %u\n", decoded->scheme);
       break;
   }
 }
@@ -128,104 +146,155 @@ uint32_t sign_extend(uint32_t n)
   return n;
 }
 
-void inc_pc()
+static inline void inc_pc(struct Machine *m)
+{
+  m->regfile.gp_registers[REGISTER_PC] = m->regfile.gp_registers[REGISTER_PC] + 4;
+}
+
+/* Execute an already decoded instruction outside of the FSM */
+void execute_decoded(struct Machine *m, const struct DecodedInstruction *entry)
 {
-  regfile.gp_registers[REGISTER_PC] = regfile.gp_registers[REGISTER_PC] + 4;
+  m->core.decoded = entry;
+  decode(m);
+  execute_instruction(m);
 }
 
-void execute_instruction()
+void execute_instruction(struct Machine *m)
 {
-  switch (decoder.common.__block) {
+  const struct DecodedInstruction *decoded = m->core.decoded;
+  uint32_t op1 = m->core.execute_op1;
+  uint32_t op2 = m->core.execute_op2;
+
+  PERF_COUNT_INSTRUCTION(m, decoded);
+  TRACE_INSTRUCTION(m, decoded);
+  CACHESIM_FETCH(m, decoded);
+  TIMING_INSTRUCTION(m, decoded);
+  switch (decoded->block) {
     case BLOCK_ARITHMETIC:
-      execute_arith(decoder.common.__opcode, decoder.common.__dstreg, execute_op1, execute_op2);
+      execute_arith(m, decoded->opcode, decoded->dstreg, op1, op2);
       break;
       
     case BLOCK_MEMORY:
-      execute_memory(decoder.common.__opcode, decoder.common.__dstreg, execute_op1, execute_op2);
+      execute_memory(m, decoded->opcode, decoded->dstreg, op1, op2);
       break;
       
     case BLOCK_BRANCH:
-      execute_branch(decoder.common.__opcode, decoder.common.__dstreg, execute_op1, execute_op2);
+      execute_branch(m, decoded->opcode, decoded->dstreg, op1, op2);
       break;
       
+    case BLOCK_ATOMIC:
+      execute_atomic(m, decoded->opcode, decoded->dstreg, op1, op2);
+      break;
+
     case BLOCK_CONTROL:
-      execute_ctrl(decoder.common.__opcode);
+      execute_ctrl(m, decoded->opcode);
       break;
       
     default:
       fprintf(stderr, "Block not implemented!\n");
-      regfile.ctrl_regs.ctrl_err = true;
+      m->regfile.ctrl_regs.ctrl_err = true;
       break;
   }
 }
 
-void execute_arith(uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2)
+static void execute_arith(struct Machine *m, uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2)
 {
+  struct Regfile *regfile = &m->regfile;
+
   switch (opcode) {
     case OPCODE_ADD:
-      regfile.gp_registers[dstreg] = op1 + op2;
+      regfile->gp_registers[dstreg] = op1 + op2;
       break;
 
     case OPCODE_SUB:
-      regfile.gp_registers[dstreg] = op1 - op2;
+      regfile->gp_registers[dstreg] = op1 - op2;
       break;
       
     case OPCODE_SHL:
-      regfile.gp_registers[dstreg] = op1 << op2;
+      regfile->gp_registers[dstreg] = op1 << op2;
       break;
       
     case OPCODE_SHR:
-      regfile.gp_registers[dstreg] = op1 >> op2;
+      regfile->gp_registers[dstreg] = op1 >> op2;
       break;
       
     case OPCODE_AND:
-      regfile.gp_registers[dstreg] = op1 & op2;
+      regfile->gp_registers[dstreg] = op1 & op2;
       break;
       
     case OPCODE_OR:
-      regfile.gp_registers[dstreg] = op1 | op2;
+      regfile->gp_registers[dstreg] = op1 | op2;
       break;
       
     case OPCODE_NOT:
-      regfile.gp_registers[dstreg] = ~regfile.gp_registers[dstreg];
+      regfile->gp_registers[dstreg] = ~regfile->gp_registers[dstreg];
       break;
       
     case OPCODE_XOR:
-      regfile.gp_registers[dstreg] = op1 ^ op2;
+      regfile->gp_registers[dstreg] = op1 ^ op2;
       break;
       
     default:
       fprintf(stderr, "Error! Invalid opcode: %d\n", opcode);
   }
-  inc_pc();
+  TRACE_REGISTER(m, dstreg, regfile->gp_registers[dstreg]);
+  inc_pc(m);
 }
 
-void execute_memory(uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2)
+static void execute_memory(struct Machine *m, uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2)
 {
-  uint32_t ptr = regfile.gp_registers[dstreg];
+  struct Regfile *regfile = &m->regfile;
+  uint32_t ptr = regfile->gp_registers[dstreg];
   switch (opcode) {
     case OPCODE_LB:
-      regfile.gp_registers[dstreg] = mmu_read(op1 + op2, SIZE_BYTE);
+      PERF_COUNT_READ(m, op1 + op2, SIZE_BYTE);
+      CACHESIM_READ(m, m->core.decoded->pc, op1 + op2, SIZE_BYTE);
+      regfile->gp_registers[dstreg] = mmu_read(m, op1 + op2, SIZE_BYTE);
+      TRACE_REGISTER(m, dstreg, regfile->gp_registers[dstreg]);
+      TRACE_LOAD(m, op1 + op2, regfile->gp_registers[dstreg], SIZE_BYTE);
+      TIMING_LOAD(m, dstreg, op1 + op2, SIZE_BYTE);
       break;
       
     case OPCODE_LHW:
-      regfile.gp_registers[dstreg] = mmu_read(op1 + op2, SIZE_HWORD);
+      PERF_COUNT_READ(m, op1 + op2, SIZE_HWORD);
+      CACHESIM_READ(m, m->core.decoded->pc, op1 + op2, SIZE_HWORD);
+      regfile->gp_registers[dstreg] = mmu_read(m, op1 + op2, SIZE_HWORD);
+      TRACE_REGISTER(m, dstreg, regfile->gp_registers[dstreg]);
+      TRACE_LOAD(m, op1 + op2, regfile->gp_registers[dstreg], SIZE_HWORD);
+      TIMING_LOAD(m, dstreg, op1 + op2, SIZE_HWORD);
       break;
 
     case OPCODE_LW:
-      regfile.gp_registers[dstreg] = mmu_read(op1 + op2, SIZE_WORD);
+      PERF_COUNT_READ(m, op1 + op2, SIZE_WORD);
+      CACHESIM_READ(m, m->core.decoded->pc, op1 + op2, SIZE_WORD);
+      regfile->gp_registers[dstreg] = mmu_read(m, op1 + op2, SIZE_WORD);
+      TRACE_REGISTER(m, dstreg, regfile->gp_registers[dstreg]);
+      TRACE_LOAD(m, op1 + op2, regfile->gp_registers[dstreg], SIZE_WORD);
+      TIMING_LOAD(m, dstreg, op1 + op2, SIZE_WORD);
       break;
       
     case OPCODE_SB:
-      mmu_write(ptr + op1, op2, SIZE_BYTE);
+      PERF_COUNT_WRITE(m, ptr + op1, SIZE_BYTE);
+      TRACE_STORE(m, ptr + op1, op2, SIZE_BYTE);
+      CACHESIM_WRITE(m, m->core.decoded->pc, ptr + op1, SIZE_BYTE);
+      TIMING_STORE(m, ptr + op1, SIZE_BYTE);
+      mmu_write(m, ptr + op1, op2, SIZE_BYTE);
       break;
 
     case OPCODE_SHW:
-      mmu_write(ptr + op1, op2, SIZE_HWORD);
+      PERF_COUNT_WRITE(m, ptr + op1, SIZE_HWORD);
+      TRACE_STORE(m, ptr + op1, op2, SIZE_HWORD);
+      CACHESIM_WRITE(m, m->core.decoded->pc, ptr + op1, SIZE_HWORD);
+      TIMING_STORE(m, ptr + op1, SIZE_HWORD);
+      mmu_write(m, ptr + op1, op2, SIZE_HWORD);
       break;
           
     case OPCODE_SW:
-      mmu_write(ptr + op1, op2, SIZE_WORD);
+      PERF_COUNT_WRITE(m, ptr + op1, SIZE_WORD);
+      TRACE_STORE(m, ptr + op1, op2, SIZE_WORD);
+      CACHESIM_WRITE(m, m->core.decoded->pc, ptr + op1, SIZE_WORD);
+      TIMING_STORE(m, ptr + op1, SIZE_WORD);
+      mmu_write(m, ptr + op1, op2, SIZE_WORD);
       break;
       
     default:
@@ -233,33 +302,127 @@ void execute_memory(uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2)
       break;
   }
 
-  inc_pc();
+  inc_pc(m);
+}
+
+static void execute_atomic(struct Machine *m, uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2)
+{
+  struct Regfile *regfile = &m->regfile;
+  uint32_t value = htole32(regfile->gp_registers[dstreg]);
+  uint32_t expected;
+  uint32_t *word;
+
+  switch (opcode) {
+    case OPCODE_FENCE:
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (m->smp)
+        smp_sync_code(m);
+      inc_pc(m);
+      return;
+
+    case OPCODE_HARTID:
+      regfile->gp_registers[dstreg] = m->hart_id;
+      TRACE_REGISTER(m, dstreg, regfile->gp_registers[dstreg]);
+      inc_pc(m);
+      return;
+
+    case OPCODE_SWAP:
+    case OPCODE_CAS:
+    case OPCODE_FADD:
+      break;
+
+    default:
+      fprintf(stderr, "Error in %s! Opcode %d not implemented\n", __FUNCTION__, opcode);
+      inc_pc(m);
+      return;
+  }
+
+  PERF_COUNT_WRITE(m, op1 + op2, SIZE_WORD);
+  CACHESIM_WRITE(m, m->core.decoded->pc, op1 + op2, SIZE_WORD);
+  word = system_memory_atomic(m, op1 + op2);
+  if (!word) {
+    fprintf(stderr, "Atomic access to invalid address 0x%08x\n", op1 + op2);
+    regfile_write(m, REGISTER_ERROR, true);
+    inc_pc(m);
+    return;
+  }
+
+  switch (opcode) {
+    case OPCODE_SWAP:
+      value = __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST);
+      break;
+
+    case OPCODE_CAS:
+      expected = htole32(regfile->gp_registers[REGISTER_CR]);
+      __atomic_compare_exchange_n(word, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      value = expected;
+      regfile_compare(regfile, le32toh(value), regfile->gp_registers[REGISTER_CR]);
+      break;
+
+    case OPCODE_FADD:
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      value = __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST);
+#else
+      expected = __atomic_load_n(word, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(word, &expected,
+                                          htole32(le32toh(expected) + le32toh(value)), false,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
+      value = expected;
+#endif
+      break;
+  }
+
+  if (m->smp && system_memory_is_code(&m->memory, op1 + op2 - MMIO_SYSTEM_MEMORY_START, SIZE_WORD))
+    smp_code_written(m);
+
+  regfile->gp_registers[dstreg] = le32toh(value);
+  TRACE_REGISTER(m, dstreg, regfile->gp_registers[dstreg]);
+  inc_pc(m);
 }
 
-void execute_ctrl(uint8_t opcode)
+static void execute_ctrl(struct Machine *m, uint8_t opcode)
 {
   switch (opcode) {
     case OPCODE_HALT:
-      regfile_write(REGISTER_HALT, true);
+      regfile_write(m, REGISTER_HALT, true);
       break;
       
     case OPCODE_BRK:
-      regfile_write(REGISTER_BREAK, true);
+      regfile_write(m, REGISTER_BREAK, true);
+      break;
+
+    case OPCODE_WFI:
+      /* machine_run() waits, after the instruction */
+      m->intc.waiting = true;
+      m->regfile.ctrl_regs.ctrl_evt = true;
       break;
+
+    case OPCODE_EI:
+      regfile_write(m, REGISTER_IF, true);
+      intc_update(m);
+      break;
+
+    case OPCODE_DI:
+      regfile_write(m, REGISTER_IF, false);
+      break;
+
+    case OPCODE_IRET:
+      intc_return(m);
+      return;
       
     default:
       fprintf(stderr, "Error in %s! Opcode %d not implemented\n", __FUNCTION__, opcode);
   }
 
-  inc_pc();
+  inc_pc(m);
 }
 
-void execute_branch(uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2)
+static void execute_branch(struct Machine *m, uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2)
 {
   bool take_jump = false;
-  bool __zf = regfile_read(REGISTER_ZF);
-  bool __nf = regfile_read(REGISTER_NF);
-  int32_t comparator = 0;
+  bool __zf = regfile_zf(&m->regfile);
+  bool __nf = regfile_nf(&m->regfile);
   
   switch (opcode) {
     case OPCODE_BR:
@@ -287,17 +450,7 @@ void execute_branch(uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2)
       break;
       
     case OPCODE_CMP:
-      comparator = op1 - op2;
-      if (comparator < 0) {
-        regfile_write(REGISTER_ZF, false); // set zero flag low
-        regfile_write(REGISTER_NF, true);  // set negative flag high
-      } else if (comparator == 0) {
-        regfile_write(REGISTER_ZF, true);  // set zero flag high
-        regfile_write(REGISTER_NF, false); // set negative flag low
-      } else {
-        regfile_write(REGISTER_ZF, false); // set zero flag low
-        regfile_write(REGISTER_NF, false); // set negative flag low
-      }
+      regfile_compare(&m->regfile, op1, op2);
       break;
       
     default:
@@ -305,16 +458,34 @@ void execute_branch(uint8_t opcode, uint8_t dstreg, uint32_t op1, uint32_t op2)
       break;
   }
 
+  if (opcode != OPCODE_CMP) {
+    PERF_COUNT_BRANCH(m, take_jump);
+    TIMING_BRANCH(m, m->core.decoded, op1 + op2, take_jump);
+  }
+
   if (take_jump) {
-    regfile.gp_registers[dstreg] = op1 + op2;
+    m->regfile.gp_registers[dstreg] = op1 + op2;
+    TRACE_REGISTER(m, dstreg, m->regfile.gp_registers[dstreg]);
   } else {
-    inc_pc();
+    inc_pc(m);
   }
 }
 
-uint8_t check_ctrl_regs()
+uint8_t check_ctrl_regs(struct Machine *m)
+{
+  return (regfile_read(m, REGISTER_HALT) ? STATE_HALT :
+          (regfile_read(m, REGISTER_BREAK) ? STATE_BREAK :
+           (regfile_read(m, REGISTER_ERROR) ? STATE_ERROR : STATE_FETCH)));
+}
+
+void core_dump_error(struct Machine *m, uint32_t instruction)
 {
-  return (regfile_read(REGISTER_HALT) ? STATE_HALT :
-          (regfile_read(REGISTER_BREAK) ? STATE_BREAK :
-           (regfile_read(REGISTER_ERROR) ? STATE_ERROR : STATE_FETCH)));
+  uart_flush(m);
+  fprintf(stderr, "Error occured\n");
+
+  printf("INSTRUCTION: \n");
+  printf("0x%08x\n", instruction);
+
+  printf("REGISTERS: \n");
+  regfile_dump_registers(m);
 }
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "rscs.h"
+#include "dma.h"
+#include "intc.h"
+#include "machine.h"
+
+void dma_init(struct Machine *m)
+{
+  memset(&m->dma, 0, sizeof(m->dma));
+}
+
+/* Offset in system memory of [address, address + length), false if it
+ * isn't all in there */
+static bool dma_range(struct Machine *m, uint32_t address, uint32_t length, uint32_t *offset)
+{
+  if (address < MMIO_SYSTEM_MEMORY_START)
+    return false;
+
+  address -= MMIO_SYSTEM_MEMORY_START;
+  if (length > m->memory.size || address > m->memory.size - length)
+    return false;
+
+  *offset = address;
+  return true;
+}
+
+static uint32_t dma_compare(struct Machine *m, uint32_t source, uint32_t destination, uint32_t length)
+{
+  const uint8_t *a = m->memory.base + source;
+  const uint8_t *b = m->memory.base + destination;
+  uint32_t i;
+
+  if (!memcmp(a, b, length))
+    return length;
+
+  for (i = 0; a[i] == b[i]; i++)
+    ;
+  return i;
+}
+
+static void dma_start(struct Machine *m, uint32_t command)
+{
+  struct Dma *dma = &m->dma;
+  uint32_t source = 0;
+  uint32_t destination;
+  bool valid;
+
+  valid = dma_range(m, dma->destination, dma->length, &destination);
+  if (command != DMA_COMMAND_FILL)
+    valid = valid && dma_range(m, dma->source, dma->length, &source);
+
+  dma->status = DMA_STATUS_DONE;
+  dma->result = 0;
+
+  if (!valid) {
+    dma->status |= DMA_STATUS_ERROR;
+    dma->stats.errors++;
+  } else {
+    switch (command) {
+      case DMA_COMMAND_COPY:
+        system_memory_copy(m, destination, source, dma->length);
+        break;
+
+      case DMA_COMMAND_FILL:
+        system_memory_fill(m, destination, dma->value, dma->length);
+        break;
+
+      case DMA_COMMAND_COMPARE:
+        dma->result = dma_compare(m, source, destination, dma->length);
+        if (dma->result != dma->length)
+          dma->status |= DMA_STATUS_MISMATCH;
+        break;
+    }
+
+    dma->stats.transfers++;
+    dma->stats.bytes += dma->length;
+  }
+
+  intc_raise(m, INTC_LINE_DMA);
+}
+
+void dma_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size)
+{
+  struct Dma *dma = &m->dma;
+
+  if (size != SIZE_WORD) {
+    fprintf(stderr, "DMA invalid size: %d\n", size);
+    return;
+  }
+
+  switch (address) {
+    case DMA_REG_SOURCE:
+      dma->source = data;
+      break;
+
+    case DMA_REG_DESTINATION:
+      dma->destination = data;
+      break;
+
+    case DMA_REG_LENGTH:
+      dma->length = data;
+      break;
+
+    case DMA_REG_VALUE:
+      dma->value = data;
+      break;
+
+    case DMA_REG_COMMAND:
+      if (data < DMA_COMMAND_COPY || data > DMA_COMMAND_COMPARE) {
+        fprintf(stderr, "DMA unknown command: %u\n", data);
+        return;
+      }
+      dma_start(m, data);
+      break;
+
+    default:
+      break;
+  }
+}
+
+uint32_t dma_read(struct Machine *m, uint32_t address, uint8_t size)
+{
+  struct Dma *dma = &m->dma;
+
+  if (size != SIZE_WORD) {
+    fprintf(stderr, "DMA invalid size: %d\n", size);
+    return 0;
+  }
+
+  switch (address) {
+    case DMA_REG_SOURCE:
+      return dma->source;
+
+    case DMA_REG_DESTINATION:
+      return dma->destination;
+
+    case DMA_REG_LENGTH:
+      return dma->length;
+
+    case DMA_REG_VALUE:
+      return dma->value;
+
+    case DMA_REG_STATUS:
+      return dma->status;
+
+    case DMA_REG_RESULT:
+      return dma->result;
+
+    default:
+      return 0;
+  }
+}
+
+void dma_dump_stats(struct Machine *m)
+{
+  const struct DmaStats *stats = &m->dma.stats;
+
+  if (!stats->transfers && !stats->errors)
+    return;
+
+  fprintf(stderr, "dma: %lu transfers, %lu bytes, %lu errors\n", (unsigned long)stats->transfers,
+          (unsigned long)stats->bytes, (unsigned long)stats->errors);
+}
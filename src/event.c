@@ -0,0 +1,105 @@
+#include <stdio.h>
+
+#include "rscs.h"
+#include "event.h"
+#include "machine.h"
+
+void event_init(struct Machine *m)
+{
+  m->events.count = 0;
+  m->events.idle = 0;
+}
+
+uint64_t event_clock(const struct Machine *m)
+{
+  return machine_instret(m) + m->events.idle;
+}
+
+static void event_swap(struct Event *a, struct Event *b)
+{
+  struct Event tmp = *a;
+
+  *a = *b;
+  *b = tmp;
+}
+
+static void event_sift_up(struct EventQueue *queue, uint32_t i)
+{
+  while (i && queue->heap[i].when < queue->heap[(i - 1) / 2].when) {
+    event_swap(&queue->heap[i], &queue->heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+}
+
+static void event_sift_down(struct EventQueue *queue, uint32_t i)
+{
+  for (;;) {
+    uint32_t smallest = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+
+    if (left < queue->count && queue->heap[left].when < queue->heap[smallest].when)
+      smallest = left;
+    if (right < queue->count && queue->heap[right].when < queue->heap[smallest].when)
+      smallest = right;
+    if (smallest == i)
+      return;
+
+    event_swap(&queue->heap[i], &queue->heap[smallest]);
+    i = smallest;
+  }
+}
+
+static void event_remove(struct EventQueue *queue, uint32_t i)
+{
+  queue->heap[i] = queue->heap[--queue->count];
+  if (i < queue->count) {
+    event_sift_down(queue, i);
+    event_sift_up(queue, i);
+  }
+}
+
+/* The current run may go past the new event, it is ended after the
+ * instruction scheduling it */
+bool event_schedule(struct Machine *m, EVENT_HANDLER handler, uint64_t when)
+{
+  struct EventQueue *queue = &m->events;
+
+  event_cancel(m, handler);
+  if (queue->count == EVENT_QUEUE_SIZE) {
+    fprintf(stderr, "%s: Event queue is full\n", __FUNCTION__);
+    return false;
+  }
+
+  queue->heap[queue->count].when = when;
+  queue->heap[queue->count].handler = handler;
+  event_sift_up(queue, queue->count++);
+  m->regfile.ctrl_regs.ctrl_evt = true;
+  return true;
+}
+
+void event_cancel(struct Machine *m, EVENT_HANDLER handler)
+{
+  struct EventQueue *queue = &m->events;
+
+  for (uint32_t i = 0; i < queue->count; i++) {
+    if (queue->heap[i].handler == handler) {
+      event_remove(queue, i);
+      return;
+    }
+  }
+}
+
+/* Handlers get the time they were due at and may schedule their next
+ * event, which has to be later than that */
+void event_run_due(struct Machine *m, uint64_t now)
+{
+  struct EventQueue *queue = &m->events;
+
+  while (queue->count && queue->heap[0].when <= now) {
+    struct Event event = queue->heap[0];
+
+    event_remove(queue, 0);
+    event.handler(m, event.when);
+  }
+}
@@ -0,0 +1,777 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "core.h"
+#include "intc.h"
+#include "timer.h"
+#include "machine.h"
+
+/* Differential fuzzing of the execution engines.
+ * Every case is a random program of valid instructions from all blocks of
+ * core.h with a random register file, optionally interrupted by a periodic
+ * timer. It is run on the reference FSM and on each engine under test in
+ * slices of random length, and after every slice the register files,
+ * flags, control and interrupt state and the whole system memory have to
+ * match. A failing case is shrunk by replacing instructions with NOPs and
+ * clearing the initial state before it is printed.
+ * Cases are generated so that they mostly stay valid: a few registers
+ * (FUZZ_R_*) hold pointers and are never written by the program, loads,
+ * stores and atomics address the data area, the code (self-modifying code
+ * stores valid instructions) or the interrupt controller, and branches
+ * target instructions of the program.
+ */
+#define FUZZ_MEMORY_SIZE 0x4000
+#define FUZZ_CODE MMIO_SYSTEM_MEMORY_START
+#define FUZZ_DATA (FUZZ_CODE + 0x1000)
+#define FUZZ_DATA_SIZE 0x400
+#define FUZZ_MAX_LENGTH 1024
+#define FUZZ_MAX_SLICE 64
+#define FUZZ_REPORT_SECONDS 5
+
+/* Reserved registers, the rest are written at random */
+enum {
+  FUZZ_R_BASE = REGISTER_R22, // FUZZ_DATA
+  FUZZ_R_PTR,                 // somewhere in the data area
+  FUZZ_R_CODE,                // FUZZ_CODE
+  FUZZ_R_SMC,                 // offset of the instruction self-modifying code replaces
+  FUZZ_R_WORD,                // the instruction replacing it
+  FUZZ_R_INTC,                // MMIO_INTC_START
+};
+
+#define FUZZ_WRITABLE_FIRST REGISTER_FP
+#define FUZZ_WRITABLE_COUNT (FUZZ_R_BASE - REGISTER_FP)
+
+struct FuzzCase {
+  uint64_t seed;
+  uint32_t length; // the last instruction is a halt
+  uint32_t code[FUZZ_MAX_LENGTH];
+  uint32_t registers[GENERAL_PURPOSE_REGISTER_COUNT];
+  bool interrupts; // IF at the start
+  uint32_t vector;
+  uint32_t timer_interval; // 0 for no timer
+  uint64_t instructions; // to run at most
+};
+
+struct FuzzMismatch {
+  uint8_t engine;
+  uint64_t instret; // of the reference after the slice which differed
+  char what[96];
+};
+
+struct FuzzWorker {
+  pthread_t thread;
+  struct Machine *machines[MACHINE_ENGINE_JIT + 1];
+  _Atomic uint64_t cases;
+  _Atomic uint64_t instructions;
+};
+
+struct Fuzz {
+  bool engines[MACHINE_ENGINE_JIT + 1]; // under test, always compared to the FSM
+  uint32_t length;
+  uint64_t instructions;
+  uint64_t first_seed;
+  uint64_t count;
+  _Atomic uint64_t next; // case to run next
+  _Atomic bool failed;
+  _Atomic uint32_t running;
+  FILE *report;
+};
+
+static struct Fuzz fuzz;
+
+static const char *engine_names[] = {
+  [MACHINE_ENGINE_FSM] = "fsm",
+  [MACHINE_ENGINE_FAST] = "fast",
+  [MACHINE_ENGINE_JIT] = "jit",
+};
+
+static const char *register_names[GENERAL_PURPOSE_REGISTER_COUNT] = {
+  "rz", "pc", "fp", "lr", "cr", "r1", "r2", "r3", "r4", "r5", "r6",
+  "r7", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "r16",
+  "r17", "r18", "r19", "r20", "r21", "r22", "r23", "r24", "r25", "r26", "r27",
+};
+
+static const char *mnemonics[BLOCK_CONTROL + 1][8] = {
+  [BLOCK_ARITHMETIC] = { "add", "sub", "shl", "shr", "and", "or", "not", "xor" },
+  [BLOCK_MEMORY] = { "lb", "lhw", "lw", "sb", "shw", "sw" },
+  [BLOCK_BRANCH] = { "br", "beq", "blt", "ble", "bgt", "bge", "cmp" },
+  [BLOCK_ATOMIC] = { "swap", "cas", "fadd", "fence", "hartid" },
+  [BLOCK_CONTROL] = { "brk", "wfi", "ei", "di", "iret", [OPCODE_HALT] = "halt" },
+};
+
+/* splitmix64, every case has its own stream */
+static uint64_t fuzz_random(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+static uint32_t fuzz_below(uint64_t *state, uint32_t n)
+{
+  return fuzz_random(state) % n;
+}
+
+static uint32_t fuzz_encode(uint8_t block, uint8_t scheme, uint8_t opcode, uint8_t dst, uint8_t src,
+                            uint32_t operand)
+{
+  uint32_t word = block | scheme << 3 | opcode << 5 | dst << 8;
+
+  switch (scheme) {
+    case CODING_SCHEME_R:
+      return word | src << 13 | (operand & 0x1f) << 18;
+
+    case CODING_SCHEME_IB:
+      return word | (operand & 0x3ffff) << 13;
+
+    default:
+      return word | src << 13 | (operand & 0x3fff) << 18;
+  }
+}
+
+/* Leaves every register and flag as it is */
+static uint32_t fuzz_nop(void)
+{
+  return fuzz_encode(BLOCK_ARITHMETIC, CODING_SCHEME_UI, OPCODE_ADD, FUZZ_R_BASE, FUZZ_R_BASE, 0);
+}
+
+static uint8_t fuzz_writable(uint64_t *rng)
+{
+  return FUZZ_WRITABLE_FIRST + fuzz_below(rng, FUZZ_WRITABLE_COUNT);
+}
+
+static uint32_t fuzz_arith(uint64_t *rng)
+{
+  uint8_t scheme = fuzz_below(rng, 4);
+
+  return fuzz_encode(BLOCK_ARITHMETIC, scheme, fuzz_below(rng, 8), fuzz_writable(rng),
+                     fuzz_below(rng, GENERAL_PURPOSE_REGISTER_COUNT), fuzz_random(rng));
+}
+
+static uint32_t fuzz_load(uint64_t *rng, uint32_t length)
+{
+  uint8_t opcode = fuzz_below(rng, OPCODE_LW + 1);
+  uint8_t dst = fuzz_writable(rng);
+
+  switch (fuzz_below(rng, 5)) {
+    case 0:
+      return fuzz_encode(BLOCK_MEMORY, CODING_SCHEME_R, opcode, dst, FUZZ_R_PTR, REGISTER_RZ);
+
+    case 1:
+      return fuzz_encode(BLOCK_MEMORY, CODING_SCHEME_IB, opcode, dst, 0,
+                         FUZZ_DATA + fuzz_below(rng, FUZZ_DATA_SIZE - 3));
+
+    case 2:
+      return fuzz_encode(BLOCK_MEMORY, CODING_SCHEME_UI, opcode, dst, FUZZ_R_CODE,
+                         fuzz_below(rng, length * SIZE_WORD - 3));
+
+    default:
+      return fuzz_encode(BLOCK_MEMORY, CODING_SCHEME_UI + fuzz_below(rng, 2), opcode, dst,
+                         fuzz_below(rng, 2) ? FUZZ_R_BASE : FUZZ_R_PTR,
+                         fuzz_below(rng, FUZZ_DATA_SIZE - 3));
+  }
+}
+
+/* The address is dst + op1, op1 is RZ so stores go where the pointers are */
+static uint32_t fuzz_store(uint64_t *rng)
+{
+  uint8_t opcode = OPCODE_SB + fuzz_below(rng, 3);
+  uint8_t scheme = fuzz_below(rng, 4);
+  uint8_t dst = fuzz_below(rng, 2) ? FUZZ_R_BASE : FUZZ_R_PTR;
+
+  if (scheme == CODING_SCHEME_R)
+    return fuzz_encode(BLOCK_MEMORY, scheme, opcode, dst, REGISTER_RZ,
+                       fuzz_below(rng, GENERAL_PURPOSE_REGISTER_COUNT));
+
+  return fuzz_encode(BLOCK_MEMORY, scheme, opcode, dst, REGISTER_RZ, fuzz_random(rng));
+}
+
+static uint32_t fuzz_branch(uint64_t *rng, uint32_t index, uint32_t length)
+{
+  uint8_t opcode = fuzz_below(rng, OPCODE_CMP + 1);
+  uint32_t target = fuzz_below(rng, length);
+
+  if (opcode == OPCODE_CMP)
+    return fuzz_encode(BLOCK_BRANCH, fuzz_below(rng, 4), opcode, 0,
+                       fuzz_below(rng, GENERAL_PURPOSE_REGISTER_COUNT), fuzz_random(rng));
+
+  switch (fuzz_below(rng, 4)) {
+    case 0:
+      return fuzz_encode(BLOCK_BRANCH, CODING_SCHEME_IB, opcode, REGISTER_PC, 0,
+                         FUZZ_CODE + target * SIZE_WORD);
+
+    case 1:
+      /* taken branches to any other register just write the target to it */
+      return fuzz_encode(BLOCK_BRANCH, fuzz_below(rng, 2) ? CODING_SCHEME_R : CODING_SCHEME_UI, opcode,
+                         fuzz_writable(rng), fuzz_below(rng, GENERAL_PURPOSE_REGISTER_COUNT),
+                         fuzz_random(rng));
+
+    default:
+      return fuzz_encode(BLOCK_BRANCH, CODING_SCHEME_SI, opcode, REGISTER_PC, REGISTER_PC,
+                         ((int32_t)target - (int32_t)index) * SIZE_WORD);
+  }
+}
+
+static uint32_t fuzz_atomic(uint64_t *rng)
+{
+  uint8_t opcode = fuzz_below(rng, OPCODE_HARTID + 1);
+  uint8_t dst = fuzz_writable(rng);
+  uint32_t offset = fuzz_below(rng, FUZZ_DATA_SIZE / SIZE_WORD) * SIZE_WORD;
+
+  /* now and then a misaligned one, which is an error */
+  if (!fuzz_below(rng, 32))
+    offset |= 1 + fuzz_below(rng, 3);
+
+  switch (fuzz_below(rng, 3)) {
+    case 0:
+      return fuzz_encode(BLOCK_ATOMIC, CODING_SCHEME_R, opcode, dst, FUZZ_R_BASE, REGISTER_RZ);
+
+    case 1:
+      return fuzz_encode(BLOCK_ATOMIC, CODING_SCHEME_IB, opcode, dst, 0, FUZZ_DATA + offset);
+
+    default:
+      return fuzz_encode(BLOCK_ATOMIC, CODING_SCHEME_UI, opcode, dst, FUZZ_R_BASE, offset);
+  }
+}
+
+static uint32_t fuzz_control(uint64_t *rng)
+{
+  uint32_t pick = fuzz_below(rng, 100);
+  uint8_t opcode;
+
+  if (pick < 30)
+    opcode = OPCODE_EI;
+  else if (pick < 55)
+    opcode = OPCODE_DI;
+  else if (pick < 75)
+    opcode = OPCODE_BRK;
+  else if (pick < 90)
+    opcode = OPCODE_WFI;
+  else if (pick < 98)
+    opcode = OPCODE_IRET;
+  else
+    opcode = OPCODE_HALT;
+
+  return fuzz_encode(BLOCK_CONTROL, CODING_SCHEME_R, opcode, 0, 0, 0);
+}
+
+/* Moving the pointers, acknowledging interrupts and self-modifying code */
+static uint32_t fuzz_special(uint64_t *rng, uint32_t length)
+{
+  switch (fuzz_below(rng, 4)) {
+    case 0:
+      return fuzz_encode(BLOCK_MEMORY, CODING_SCHEME_UI, OPCODE_SW, FUZZ_R_INTC, REGISTER_RZ,
+                         1 << INTC_LINE_TIMER);
+
+    case 1:
+      return fuzz_encode(BLOCK_ARITHMETIC, CODING_SCHEME_UI, OPCODE_ADD, FUZZ_R_PTR, FUZZ_R_BASE,
+                         fuzz_below(rng, FUZZ_DATA_SIZE));
+
+    case 2:
+      return fuzz_encode(BLOCK_ARITHMETIC, CODING_SCHEME_UI, OPCODE_ADD, FUZZ_R_SMC, REGISTER_RZ,
+                         fuzz_below(rng, length - 1) * SIZE_WORD);
+
+    default:
+      return fuzz_encode(BLOCK_MEMORY, CODING_SCHEME_R, OPCODE_SW, FUZZ_R_CODE, FUZZ_R_SMC, FUZZ_R_WORD);
+  }
+}
+
+static uint32_t fuzz_instruction(uint64_t *rng, uint32_t index, uint32_t length)
+{
+  uint32_t kind = fuzz_below(rng, 100);
+
+  if (kind < 40)
+    return fuzz_arith(rng);
+  if (kind < 52)
+    return fuzz_load(rng, length);
+  if (kind < 62)
+    return fuzz_store(rng);
+  if (kind < 80)
+    return fuzz_branch(rng, index, length);
+  if (kind < 88)
+    return fuzz_atomic(rng);
+  if (kind < 94)
+    return fuzz_control(rng);
+  return fuzz_special(rng, length);
+}
+
+static void fuzz_generate(struct FuzzCase *c, uint64_t seed)
+{
+  uint64_t rng = seed;
+  uint32_t i;
+
+  memset(c, 0, sizeof(*c));
+  c->seed = seed;
+  c->length = fuzz.length;
+  c->instructions = fuzz.instructions;
+
+  for (i = 0; i < c->length - 1; i++)
+    c->code[i] = fuzz_instruction(&rng, i, c->length);
+  c->code[i] = fuzz_encode(BLOCK_CONTROL, CODING_SCHEME_R, OPCODE_HALT, 0, 0, 0);
+
+  for (i = FUZZ_WRITABLE_FIRST; i < FUZZ_R_BASE; i++)
+    c->registers[i] = fuzz_random(&rng);
+  c->registers[REGISTER_PC] = FUZZ_CODE;
+  c->registers[FUZZ_R_BASE] = FUZZ_DATA;
+  c->registers[FUZZ_R_PTR] = FUZZ_DATA + fuzz_below(&rng, FUZZ_DATA_SIZE);
+  c->registers[FUZZ_R_CODE] = FUZZ_CODE;
+  c->registers[FUZZ_R_SMC] = fuzz_below(&rng, c->length - 1) * SIZE_WORD;
+  c->registers[FUZZ_R_WORD] = fuzz_arith(&rng);
+  c->registers[FUZZ_R_INTC] = MMIO_INTC_START;
+
+  c->interrupts = fuzz_below(&rng, 2);
+  c->vector = FUZZ_CODE + fuzz_below(&rng, c->length) * SIZE_WORD;
+  if (fuzz_below(&rng, 4))
+    c->timer_interval = 1 + fuzz_below(&rng, 300);
+}
+
+static void fuzz_setup(struct Machine *m, const struct FuzzCase *c)
+{
+  machine_reset(m);
+  system_memory_store(m, 0, c->code, c->length * SIZE_WORD);
+  memcpy(m->regfile.gp_registers, c->registers, sizeof(c->registers));
+  m->regfile.status_regs.status_if = c->interrupts;
+  /* IRET before the first interrupt restarts the program */
+  intc_write(m, INTC_REG_EPC, FUZZ_CODE, SIZE_WORD);
+
+  if (c->timer_interval) {
+    intc_write(m, INTC_REG_VECTOR, c->vector, SIZE_WORD);
+    intc_write(m, INTC_REG_ENABLE, 1 << INTC_LINE_TIMER, SIZE_WORD);
+    timer_write(m, TIMER_REG_CONTROL, TIMER_CONTROL_PERIODIC, SIZE_WORD);
+    timer_write(m, TIMER_REG_INTERVAL, c->timer_interval, SIZE_WORD);
+  }
+}
+
+/* Describes the first difference in mismatch, returns true if there is none */
+static bool fuzz_compare(const struct Machine *ref, uint8_t ref_reason, const struct Machine *m,
+                         uint8_t reason, struct FuzzMismatch *mismatch)
+{
+  const struct Regfile *a = &ref->regfile;
+  const struct Regfile *b = &m->regfile;
+  uint32_t i;
+
+#define FUZZ_DIFFERS(name, x, y)                                                              \
+  if ((x) != (y)) {                                                                           \
+    snprintf(mismatch->what, sizeof(mismatch->what), "%s 0x%llx, fsm has 0x%llx", name,      \
+             (unsigned long long)(y), (unsigned long long)(x));                               \
+    return false;                                                                             \
+  }
+
+  FUZZ_DIFFERS("exit reason", ref_reason, reason);
+  FUZZ_DIFFERS("instret", ref->instret, m->instret);
+  for (i = 0; i < GENERAL_PURPOSE_REGISTER_COUNT; i++)
+    FUZZ_DIFFERS(register_names[i], a->gp_registers[i], b->gp_registers[i]);
+  FUZZ_DIFFERS("zf", regfile_zf(a), regfile_zf(b));
+  FUZZ_DIFFERS("nf", regfile_nf(a), regfile_nf(b));
+  FUZZ_DIFFERS("if", a->status_regs.status_if, b->status_regs.status_if);
+  FUZZ_DIFFERS("halt", a->ctrl_regs.ctrl_hlt, b->ctrl_regs.ctrl_hlt);
+  FUZZ_DIFFERS("break", a->ctrl_regs.ctrl_brk, b->ctrl_regs.ctrl_brk);
+  FUZZ_DIFFERS("error", a->ctrl_regs.ctrl_err, b->ctrl_regs.ctrl_err);
+  FUZZ_DIFFERS("pending", ref->intc.pending, m->intc.pending);
+  FUZZ_DIFFERS("epc", ref->intc.epc, m->intc.epc);
+  FUZZ_DIFFERS("cause", ref->intc.cause, m->intc.cause);
+  FUZZ_DIFFERS("interrupts taken", ref->intc.taken, m->intc.taken);
+  FUZZ_DIFFERS("idle ticks", ref->events.idle, m->events.idle);
+
+  if (memcmp(ref->memory.base, m->memory.base, ref->memory.size)) {
+    for (i = 0; ref->memory.base[i] == m->memory.base[i]; i++)
+      ;
+    snprintf(mismatch->what, sizeof(mismatch->what), "memory at 0x%08x 0x%02x, fsm has 0x%02x",
+             i + MMIO_SYSTEM_MEMORY_START, m->memory.base[i], ref->memory.base[i]);
+    return false;
+  }
+
+#undef FUZZ_DIFFERS
+  return true;
+}
+
+/* Runs the case on every engine, returns false if they disagree */
+static bool fuzz_run(struct FuzzWorker *w, const struct FuzzCase *c, struct FuzzMismatch *mismatch)
+{
+  struct Machine *ref = w->machines[MACHINE_ENGINE_FSM];
+  uint64_t slices = c->seed ^ 0x736c696365; // the same slices for every engine
+  uint64_t steps = 0;
+  uint8_t ref_reason;
+  uint8_t reason;
+
+  for (int engine = 0; engine <= MACHINE_ENGINE_JIT; engine++) {
+    if (w->machines[engine])
+      fuzz_setup(w->machines[engine], c);
+  }
+
+  while (ref->instret < c->instructions && steps++ < c->instructions) {
+    uint64_t slice = 1 + fuzz_below(&slices, FUZZ_MAX_SLICE);
+
+    if (slice > c->instructions - ref->instret)
+      slice = c->instructions - ref->instret;
+
+    ref_reason = machine_run(ref, slice);
+    for (int engine = MACHINE_ENGINE_FAST; engine <= MACHINE_ENGINE_JIT; engine++) {
+      if (!w->machines[engine])
+        continue;
+
+      reason = machine_run(w->machines[engine], slice);
+      if (!fuzz_compare(ref, ref_reason, w->machines[engine], reason, mismatch)) {
+        mismatch->engine = engine;
+        mismatch->instret = ref->instret;
+        return false;
+      }
+    }
+
+    if (ref_reason == MACHINE_EXIT_HALT || ref_reason == MACHINE_EXIT_ERROR)
+      break;
+  }
+
+  atomic_fetch_add_explicit(&w->instructions, ref->instret, memory_order_relaxed);
+  return true;
+}
+
+/* Greedily simplify a failing case for as long as it still fails */
+static void fuzz_shrink(struct FuzzWorker *w, struct FuzzCase *c, struct FuzzMismatch *mismatch)
+{
+  struct FuzzCase candidate;
+  struct FuzzMismatch result;
+  bool progress = true;
+
+#define FUZZ_TRY(change)                                                                      \
+  do {                                                                                        \
+    candidate = *c;                                                                           \
+    change;                                                                                   \
+    if (memcmp(&candidate, c, sizeof(candidate)) && !fuzz_run(w, &candidate, &result)) {      \
+      *c = candidate;                                                                         \
+      *mismatch = result;                                                                     \
+      c->instructions = result.instret;                                                       \
+      progress = true;                                                                        \
+    }                                                                                         \
+  } while (0)
+
+  c->instructions = mismatch->instret;
+  while (progress) {
+    progress = false;
+
+    for (uint32_t i = 0; i < c->length - 1; i++)
+      FUZZ_TRY(candidate.code[i] = fuzz_nop());
+
+    FUZZ_TRY(candidate.timer_interval = 0);
+    FUZZ_TRY(candidate.interrupts = false);
+    for (uint32_t i = FUZZ_WRITABLE_FIRST; i < FUZZ_R_BASE; i++)
+      FUZZ_TRY(candidate.registers[i] = 0);
+  }
+
+#undef FUZZ_TRY
+}
+
+static void fuzz_print_instruction(FILE *file, uint32_t address, uint32_t instruction)
+{
+  union Decoder d = { .instruction = instruction };
+  uint8_t block = d.common.__block;
+  uint8_t opcode = d.common.__opcode;
+  const char *dst = register_names[d.common.__dstreg];
+  const char *src = register_names[d.common.__srcreg];
+  const char *name = block <= BLOCK_CONTROL ? mnemonics[block][opcode] : NULL;
+
+  fprintf(file, "  0x%08x: 0x%08x  ", address, instruction);
+  if (!name) {
+    fprintf(file, "?\n");
+    return;
+  }
+
+  if (instruction == fuzz_nop()) {
+    fprintf(file, "nop\n");
+    return;
+  }
+
+  if (block == BLOCK_CONTROL) {
+    fprintf(file, "%s\n", name);
+    return;
+  }
+
+  switch (d.common.__scheme) {
+    case CODING_SCHEME_R:
+      fprintf(file, "%s %s, %s, %s\n", name, dst, src, register_names[d.type_reg.__src2reg]);
+      break;
+
+    case CODING_SCHEME_UI:
+      fprintf(file, "%s %s, %s, 0x%x\n", name, dst, src, d.type_imm.__imm);
+      break;
+
+    case CODING_SCHEME_SI:
+      fprintf(file, "%s %s, %s, %d\n", name, dst, src, (int32_t)sign_extend(d.type_imm.__imm));
+      break;
+
+    case CODING_SCHEME_IB:
+      fprintf(file, "%s %s, 0x%x\n", name, dst, d.type_imm_extended.__imm);
+      break;
+  }
+}
+
+static void fuzz_print_mismatch(FILE *file, const struct FuzzCase *c, const struct FuzzMismatch *mismatch)
+{
+  fprintf(file, "Mismatch in case %llu on %s after %llu instructions: %s\n",
+          (unsigned long long)c->seed, engine_names[mismatch->engine],
+          (unsigned long long)mismatch->instret, mismatch->what);
+}
+
+static void fuzz_print_case(FILE *file, const struct FuzzCase *c)
+{
+  uint32_t shown = 0;
+
+  fprintf(file, "IF %u", c->interrupts);
+  if (c->timer_interval)
+    fprintf(file, ", timer every %u ticks, vector 0x%08x", c->timer_interval, c->vector);
+  fprintf(file, "\nRegisters:\n");
+  for (uint32_t i = 0; i < GENERAL_PURPOSE_REGISTER_COUNT; i++) {
+    if (!c->registers[i])
+      continue;
+    fprintf(file, "  %-3s 0x%08x", register_names[i], c->registers[i]);
+    if (++shown % 4 == 0)
+      fprintf(file, "\n");
+  }
+  if (shown % 4)
+    fprintf(file, "\n");
+
+  fprintf(file, "Code (the rest are nops):\n");
+  for (uint32_t i = 0; i < c->length; i++) {
+    if (c->code[i] != fuzz_nop())
+      fuzz_print_instruction(file, FUZZ_CODE + i * SIZE_WORD, c->code[i]);
+  }
+}
+
+static void *fuzz_worker(void *arg)
+{
+  struct FuzzWorker *w = arg;
+  struct FuzzMismatch mismatch;
+  struct FuzzCase c;
+  uint64_t index;
+
+  while (!atomic_load(&fuzz.failed)) {
+    index = atomic_fetch_add(&fuzz.next, 1);
+    if (index >= fuzz.count)
+      break;
+
+    fuzz_generate(&c, fuzz.first_seed + index);
+    if (!fuzz_run(w, &c, &mismatch)) {
+      if (atomic_exchange(&fuzz.failed, true))
+        break;
+
+      fuzz_print_mismatch(fuzz.report, &c, &mismatch);
+      fprintf(fuzz.report, "Reproduce with: emulator-fuzz -s %llu -n 1 -l %u -i %llu -m %s\n",
+              (unsigned long long)c.seed, fuzz.length, (unsigned long long)fuzz.instructions,
+              engine_names[mismatch.engine]);
+      fflush(fuzz.report);
+
+      fuzz_shrink(w, &c, &mismatch);
+      fprintf(fuzz.report, "Shrunk to:\n");
+      fuzz_print_mismatch(fuzz.report, &c, &mismatch);
+      fuzz_print_case(fuzz.report, &c);
+      fflush(fuzz.report);
+      break;
+    }
+
+    atomic_fetch_add_explicit(&w->cases, 1, memory_order_relaxed);
+  }
+
+  atomic_fetch_sub(&fuzz.running, 1);
+  return NULL;
+}
+
+static void fuzz_progress(struct FuzzWorker *workers, uint32_t count, double seconds)
+{
+  uint64_t cases = 0;
+  uint64_t instructions = 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    cases += atomic_load_explicit(&workers[i].cases, memory_order_relaxed);
+    instructions += atomic_load_explicit(&workers[i].instructions, memory_order_relaxed);
+  }
+
+  fprintf(fuzz.report, "%llu cases in %.1f s, %.0f execs/s, %.1f M guest instructions/s\n",
+          (unsigned long long)cases, seconds, cases / seconds, instructions / seconds / 1e6);
+  fflush(fuzz.report);
+}
+
+static double fuzz_elapsed(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-m fast|jit] [-n cases] [-s seed] [-l length] [-i instructions]\n"
+                  "          [-j threads] [-v]\n", prog);
+  fprintf(stderr, "  -m  engine compared with the reference fsm, may be repeated\n");
+  fprintf(stderr, "      (default fast and jit)\n");
+  fprintf(stderr, "  -n  number of cases (default 100000)\n");
+  fprintf(stderr, "  -s  seed of the first case, the others follow (default random)\n");
+  fprintf(stderr, "  -l  instructions per program, 2 to %u (default 48)\n", FUZZ_MAX_LENGTH);
+  fprintf(stderr, "  -i  instructions to run per case (default 2000)\n");
+  fprintf(stderr, "  -j  threads (default one per host CPU)\n");
+  fprintf(stderr, "  -v  don't hide the messages of the emulator\n");
+}
+
+int main(int argc, char *argv[])
+{
+  struct FuzzWorker *workers;
+  struct timespec start;
+  bool engines_set = false;
+  bool verbose = false;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  double last = 0;
+  int devnull;
+  int opt;
+
+  fuzz.length = 48;
+  fuzz.instructions = 2000;
+  fuzz.count = 100000;
+  fuzz.first_seed = (uint64_t)time(NULL) << 20;
+
+  while ((opt = getopt(argc, argv, "m:n:s:l:i:j:vh")) != -1) {
+    switch (opt) {
+      case 'm':
+        if (!strcmp(optarg, "fast")) {
+          fuzz.engines[MACHINE_ENGINE_FAST] = true;
+        } else if (!strcmp(optarg, "jit")) {
+          fuzz.engines[MACHINE_ENGINE_JIT] = true;
+        } else {
+          fprintf(stderr, "Unknown mode: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        engines_set = true;
+        break;
+
+      case 'n':
+        fuzz.count = strtoull(optarg, NULL, 0);
+        break;
+
+      case 's':
+        fuzz.first_seed = strtoull(optarg, NULL, 0);
+        break;
+
+      case 'l':
+        fuzz.length = atoi(optarg);
+        if (fuzz.length < 2 || fuzz.length > FUZZ_MAX_LENGTH) {
+          fprintf(stderr, "Invalid program length: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'i':
+        fuzz.instructions = strtoull(optarg, NULL, 0);
+        if (!fuzz.instructions) {
+          fprintf(stderr, "Invalid instruction count: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 1) {
+          fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'v':
+        verbose = true;
+        break;
+
+      case 'h':
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (!engines_set) {
+    fuzz.engines[MACHINE_ENGINE_FAST] = true;
+    fuzz.engines[MACHINE_ENGINE_JIT] = true;
+  }
+  if (threads < 1)
+    threads = 1;
+
+  workers = calloc(threads, sizeof(*workers));
+  if (!workers) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+
+  for (long i = 0; i < threads; i++) {
+    for (int engine = 0; engine <= MACHINE_ENGINE_JIT; engine++) {
+      struct Machine *m;
+
+      if (engine != MACHINE_ENGINE_FSM && !fuzz.engines[engine])
+        continue;
+
+      m = machine_create(FUZZ_MEMORY_SIZE);
+      if (!m)
+        return EXIT_FAILURE;
+      m->engine = engine;
+      workers[i].machines[engine] = m;
+    }
+  }
+
+  /* failing cases print errors and register dumps, only the report is kept */
+  fuzz.report = fdopen(dup(STDOUT_FILENO), "w");
+  if (!fuzz.report) {
+    perror("fdopen");
+    return EXIT_FAILURE;
+  }
+  if (!verbose) {
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull < 0) {
+      perror("/dev/null");
+      return EXIT_FAILURE;
+    }
+    fflush(stdout);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+  }
+
+  fprintf(fuzz.report, "Fuzzing cases %llu to %llu on %ld thread(s), programs of %u instructions run for %llu\n",
+          (unsigned long long)fuzz.first_seed, (unsigned long long)(fuzz.first_seed + fuzz.count - 1),
+          threads, fuzz.length, (unsigned long long)fuzz.instructions);
+  fflush(fuzz.report);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  atomic_store(&fuzz.running, threads);
+  for (long i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, fuzz_worker, &workers[i])) {
+      fprintf(fuzz.report, "Can't start thread %ld\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  while (atomic_load(&fuzz.running)) {
+    usleep(100000);
+    if (fuzz_elapsed(&start) - last >= FUZZ_REPORT_SECONDS) {
+      last = fuzz_elapsed(&start);
+      fuzz_progress(workers, threads, last);
+    }
+  }
+
+  for (long i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    for (int engine = 0; engine <= MACHINE_ENGINE_JIT; engine++) {
+      if (workers[i].machines[engine])
+        machine_destroy(workers[i].machines[engine]);
+    }
+  }
+
+  fuzz_progress(workers, threads, fuzz_elapsed(&start));
+  free(workers);
+  fclose(fuzz.report);
+  return atomic_load(&fuzz.failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
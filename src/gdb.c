@@ -0,0 +1,583 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "icache.h"
+#include "gdb.h"
+#include "machine.h"
+
+#define GDB_REGISTER_COUNT (GENERAL_PURPOSE_REGISTER_COUNT + 1) // and the flags
+#define GDB_SIGINT  2
+#define GDB_SIGTRAP 5
+#define GDB_SIGSEGV 11
+
+struct Gdb {
+  struct Machine *m;
+  int fd;
+  bool no_ack;
+  uint8_t input[GDB_PACKET_SIZE];
+  size_t input_length;
+  size_t input_position;
+  char packet[GDB_PACKET_SIZE + 1];
+  char reply[GDB_PACKET_SIZE + 1];
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Parse hex digits up to the first non-hex character */
+static uint32_t parse_hex(const char **p)
+{
+  uint32_t value = 0;
+
+  while (hex_value(**p) >= 0)
+    value = value << 4 | hex_value(*(*p)++);
+
+  return value;
+}
+
+static char *put_hex_byte(char *out, uint8_t byte)
+{
+  *out++ = hex_digits[byte >> 4];
+  *out++ = hex_digits[byte & 0xf];
+  return out;
+}
+
+/* Registers are sent in target byte order, little endian */
+static char *put_hex_word(char *out, uint32_t word)
+{
+  for (int i = 0; i < 4; i++)
+    out = put_hex_byte(out, word >> (8 * i));
+  return out;
+}
+
+static bool get_hex_word(const char **p, uint32_t *word)
+{
+  *word = 0;
+  for (int i = 0; i < 4; i++) {
+    int high = hex_value((*p)[0]);
+    int low = high < 0 ? -1 : hex_value((*p)[1]);
+
+    if (low < 0)
+      return false;
+    *word |= (uint32_t)(high << 4 | low) << (8 * i);
+    *p += 2;
+  }
+
+  return true;
+}
+
+/* Next byte from the debugger, -1 if it hung up */
+static int gdb_getc(struct Gdb *gdb)
+{
+  if (gdb->input_position == gdb->input_length) {
+    ssize_t count;
+
+    do {
+      count = read(gdb->fd, gdb->input, sizeof(gdb->input));
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0)
+      return -1;
+
+    gdb->input_length = count;
+    gdb->input_position = 0;
+  }
+
+  return gdb->input[gdb->input_position++];
+}
+
+static bool gdb_write(struct Gdb *gdb, const char *data, size_t length)
+{
+  while (length) {
+    ssize_t count = write(gdb->fd, data, length);
+
+    if (count < 0 && errno == EINTR)
+      continue;
+
+    if (count <= 0) {
+      perror("gdb_write");
+      return false;
+    }
+
+    data += count;
+    length -= count;
+  }
+
+  return true;
+}
+
+static bool gdb_send(struct Gdb *gdb, const char *data)
+{
+  char frame[GDB_PACKET_SIZE + 5];
+  uint8_t checksum = 0;
+  size_t length = strlen(data);
+
+  for (size_t i = 0; i < length; i++)
+    checksum += data[i];
+
+  frame[0] = '$';
+  memcpy(frame + 1, data, length);
+  frame[length + 1] = '#';
+  put_hex_byte(frame + length + 2, checksum);
+  return gdb_write(gdb, frame, length + 4);
+}
+
+/* Read the next packet into gdb->packet. Acknowledgements are skipped, an
+ * interrupt outside of a packet is returned as "\x03".
+ */
+static bool gdb_receive(struct Gdb *gdb)
+{
+  for (;;) {
+    uint8_t checksum = 0;
+    size_t length = 0;
+    int high;
+    int low;
+    int c;
+
+    do {
+      c = gdb_getc(gdb);
+      if (c < 0)
+        return false;
+
+      if (c == 0x03) {
+        strcpy(gdb->packet, "\x03");
+        return true;
+      }
+    } while (c != '$');
+
+    while ((c = gdb_getc(gdb)) != '#') {
+      if (c < 0)
+        return false;
+
+      if (length < GDB_PACKET_SIZE)
+        gdb->packet[length++] = c;
+      checksum += c;
+    }
+    gdb->packet[length] = '\0';
+
+    high = gdb_getc(gdb);
+    low = gdb_getc(gdb);
+    if (high < 0 || low < 0)
+      return false;
+
+    if (gdb->no_ack)
+      return true;
+
+    if ((hex_value(high) << 4 | hex_value(low)) == checksum) {
+      if (!gdb_write(gdb, "+", 1))
+        return false;
+      return true;
+    }
+
+    if (!gdb_write(gdb, "-", 1))
+      return false;
+  }
+}
+
+static uint32_t gdb_read_register(struct Machine *m, uint32_t reg)
+{
+  if (reg < GENERAL_PURPOSE_REGISTER_COUNT)
+    return m->regfile.gp_registers[reg];
+
+  return regfile_zf(&m->regfile) | regfile_nf(&m->regfile) << 1;
+}
+
+static void gdb_write_register(struct Machine *m, uint32_t reg, uint32_t value)
+{
+  if (reg < GENERAL_PURPOSE_REGISTER_COUNT) {
+    m->regfile.gp_registers[reg] = value;
+    return;
+  }
+
+  regfile_write(m, REGISTER_ZF, value & 1);
+  regfile_write(m, REGISTER_NF, value >> 1 & 1);
+}
+
+/* m addr,length */
+static void gdb_read_memory(struct Gdb *gdb, const char *args)
+{
+  uint8_t data[GDB_PACKET_SIZE / 2];
+  uint32_t address = parse_hex(&args);
+  uint32_t length;
+  char *out = gdb->reply;
+
+  if (*args++ != ',') {
+    strcpy(gdb->reply, "E01");
+    return;
+  }
+
+  length = parse_hex(&args);
+  if (length > sizeof(data))
+    length = sizeof(data);
+
+  /* devices have side effects, only system memory is accessible */
+  if (address < MMIO_SYSTEM_MEMORY_START ||
+      !system_memory_load(gdb->m, address - MMIO_SYSTEM_MEMORY_START, data, length)) {
+    strcpy(gdb->reply, "E14");
+    return;
+  }
+
+  for (uint32_t i = 0; i < length; i++)
+    out = put_hex_byte(out, data[i]);
+  *out = '\0';
+}
+
+/* M addr,length:XX... */
+static void gdb_write_memory(struct Gdb *gdb, const char *args)
+{
+  uint8_t data[GDB_PACKET_SIZE / 2];
+  uint32_t address = parse_hex(&args);
+  uint32_t length;
+
+  strcpy(gdb->reply, "E01");
+  if (*args++ != ',')
+    return;
+
+  length = parse_hex(&args);
+  if (*args++ != ':' || length > sizeof(data))
+    return;
+
+  for (uint32_t i = 0; i < length; i++) {
+    int high = hex_value(args[2 * i]);
+    int low = high < 0 ? -1 : hex_value(args[2 * i + 1]);
+
+    if (low < 0)
+      return;
+    data[i] = high << 4 | low;
+  }
+
+  /* the store drops decoded and translated copies of the code written */
+  if (address < MMIO_SYSTEM_MEMORY_START ||
+      !system_memory_store(gdb->m, address - MMIO_SYSTEM_MEMORY_START, data, length)) {
+    strcpy(gdb->reply, "E14");
+    return;
+  }
+
+  strcpy(gdb->reply, "OK");
+}
+
+/* Z0,addr,kind and z0,addr,kind, hardware breakpoints are the same thing */
+static void gdb_breakpoint(struct Gdb *gdb, const char *args, bool insert)
+{
+  uint32_t address;
+
+  if ((args[0] != '0' && args[0] != '1') || args[1] != ',') {
+    gdb->reply[0] = '\0';
+    return;
+  }
+
+  args += 2;
+  address = parse_hex(&args);
+  /* removing one that isn't there is fine */
+  if (!insert || icache_insert_breakpoint(gdb->m, address)) {
+    if (!insert)
+      icache_remove_breakpoint(gdb->m, address);
+    strcpy(gdb->reply, "OK");
+  } else {
+    strcpy(gdb->reply, "E01");
+  }
+}
+
+/* Check for Ctrl-C without blocking */
+static bool gdb_interrupted(struct Gdb *gdb)
+{
+  struct pollfd fd = { .fd = gdb->fd, .events = POLLIN };
+
+  while (gdb->input_position < gdb->input_length || poll(&fd, 1, 0) > 0) {
+    int c = gdb_getc(gdb);
+
+    if (c < 0 || c == 0x03)
+      return true;
+  }
+
+  return false;
+}
+
+/* Run until something stops the guest and put the stop reply. Returns
+ * false when the guest is gone. */
+static bool gdb_resume(struct Gdb *gdb, bool step)
+{
+  struct Machine *m = gdb->m;
+  uint32_t pc = regfile_read(m, REGISTER_PC);
+  uint8_t reason = MACHINE_EXIT_LIMIT;
+
+  /* step over a breakpoint the guest stopped at */
+  if (icache_remove_breakpoint(m, pc)) {
+    reason = machine_run(m, 1);
+    icache_insert_breakpoint(m, pc);
+  } else if (step) {
+    reason = machine_run(m, 1);
+  }
+
+  if (!step) {
+    while (reason == MACHINE_EXIT_LIMIT && !gdb_interrupted(gdb))
+      reason = machine_run(m, GDB_RUN_SLICE);
+  }
+
+  switch (reason) {
+    case MACHINE_EXIT_HALT:
+      strcpy(gdb->reply, "W00");
+      return false;
+
+    case MACHINE_EXIT_ERROR:
+      sprintf(gdb->reply, "S%02x", GDB_SIGSEGV);
+      break;
+
+    case MACHINE_EXIT_LIMIT:
+      sprintf(gdb->reply, "S%02x", step ? GDB_SIGTRAP : GDB_SIGINT);
+      break;
+
+    default:
+      sprintf(gdb->reply, "S%02x", GDB_SIGTRAP);
+      break;
+  }
+
+  return true;
+}
+
+/* Handle packets until the debugger detaches or the guest is gone */
+static uint8_t gdb_session(struct Gdb *gdb)
+{
+  struct Machine *m = gdb->m;
+  bool running = true;
+
+  while (gdb_receive(gdb)) {
+    const char *args = gdb->packet + 1;
+    char *out = gdb->reply;
+    uint32_t reg;
+    uint32_t value;
+
+    gdb->reply[0] = '\0';
+    switch (gdb->packet[0]) {
+      case '?':
+        if (running)
+          sprintf(gdb->reply, "S%02x", GDB_SIGTRAP);
+        else
+          strcpy(gdb->reply, "W00");
+        break;
+
+      case 'g':
+        for (reg = 0; reg < GDB_REGISTER_COUNT; reg++)
+          out = put_hex_word(out, gdb_read_register(m, reg));
+        *out = '\0';
+        break;
+
+      case 'G':
+        for (reg = 0; reg < GDB_REGISTER_COUNT && get_hex_word(&args, &value); reg++)
+          gdb_write_register(m, reg, value);
+        strcpy(gdb->reply, "OK");
+        break;
+
+      case 'p':
+        reg = parse_hex(&args);
+        if (reg < GDB_REGISTER_COUNT) {
+          *put_hex_word(out, gdb_read_register(m, reg)) = '\0';
+        } else {
+          strcpy(gdb->reply, "E01");
+        }
+        break;
+
+      case 'P':
+        reg = parse_hex(&args);
+        if (reg < GDB_REGISTER_COUNT && *args++ == '=' && get_hex_word(&args, &value)) {
+          gdb_write_register(m, reg, value);
+          strcpy(gdb->reply, "OK");
+        } else {
+          strcpy(gdb->reply, "E01");
+        }
+        break;
+
+      case 'm':
+        gdb_read_memory(gdb, args);
+        break;
+
+      case 'M':
+        gdb_write_memory(gdb, args);
+        break;
+
+      case 'Z':
+      case 'z':
+        gdb_breakpoint(gdb, args, gdb->packet[0] == 'Z');
+        break;
+
+      case 'c':
+      case 's':
+        if (*args)
+          m->regfile.gp_registers[REGISTER_PC] = parse_hex(&args);
+        if (running)
+          running = gdb_resume(gdb, gdb->packet[0] == 's');
+        else
+          strcpy(gdb->reply, "W00");
+        break;
+
+      case 'H':
+        strcpy(gdb->reply, "OK");
+        break;
+
+      case 'q':
+        if (!strncmp(gdb->packet, "qSupported", 10))
+          sprintf(gdb->reply, "PacketSize=%x;QStartNoAckMode+", GDB_PACKET_SIZE);
+        else if (!strcmp(gdb->packet, "qAttached"))
+          strcpy(gdb->reply, "1");
+        else if (!strcmp(gdb->packet, "qC"))
+          strcpy(gdb->reply, "QC1");
+        break;
+
+      case 'Q':
+        if (!strcmp(gdb->packet, "QStartNoAckMode")) {
+          if (!gdb_send(gdb, "OK"))
+            return GDB_FAILED;
+          gdb->no_ack = true;
+          continue;
+        }
+        break;
+
+      case 'D':
+        gdb_send(gdb, "OK");
+        return running ? GDB_DETACHED : GDB_EXITED;
+
+      case 'k':
+        return GDB_EXITED;
+
+      case '\x03':
+        /* the guest isn't running, nothing to interrupt */
+        continue;
+
+      default:
+        break;
+    }
+
+    if (!gdb_send(gdb, gdb->reply))
+      return GDB_FAILED;
+  }
+
+  return GDB_EXITED;
+}
+
+static int gdb_listen(const char *address)
+{
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+  struct addrinfo *result;
+  const char *colon = strrchr(address, ':');
+  char host[256];
+  int one = 1;
+  int fd;
+  int error;
+
+  if (strchr(address, '/')) {
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+    if (strlen(address) >= sizeof(sun.sun_path)) {
+      fprintf(stderr, "%s: Socket path too long\n", address);
+      return -1;
+    }
+    strcpy(sun.sun_path, address);
+    unlink(address);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(fd, 1) < 0) {
+      perror(address);
+      if (fd >= 0)
+        close(fd);
+      return -1;
+    }
+
+    return fd;
+  }
+
+  if (!colon || colon - address >= (long)sizeof(host)) {
+    fprintf(stderr, "%s: Expected host:port, :port or a socket path\n", address);
+    return -1;
+  }
+
+  /* without a host only local debuggers can connect */
+  memcpy(host, address, colon - address);
+  host[colon - address] = '\0';
+  error = getaddrinfo(*host ? host : "127.0.0.1", colon + 1, &hints, &result);
+  if (error) {
+    fprintf(stderr, "%s: %s\n", address, gai_strerror(error));
+    return -1;
+  }
+
+  fd = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC, result->ai_protocol);
+  if (fd >= 0)
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (fd < 0 || bind(fd, result->ai_addr, result->ai_addrlen) < 0 || listen(fd, 1) < 0) {
+    perror(address);
+    if (fd >= 0)
+      close(fd);
+    freeaddrinfo(result);
+    return -1;
+  }
+
+  freeaddrinfo(result);
+  return fd;
+}
+
+uint8_t gdb_serve(struct Machine *m, const char *address)
+{
+  struct Gdb *gdb;
+  int listener = gdb_listen(address);
+  int one = 1;
+  uint8_t result;
+
+  if (listener < 0)
+    return GDB_FAILED;
+
+  gdb = calloc(1, sizeof(*gdb));
+  if (!gdb) {
+    perror("gdb_serve");
+    close(listener);
+    return GDB_FAILED;
+  }
+
+  fprintf(stderr, "Waiting for GDB on %s\n", address);
+  do {
+    gdb->fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+  } while (gdb->fd < 0 && errno == EINTR);
+
+  close(listener);
+  if (strchr(address, '/'))
+    unlink(address);
+
+  if (gdb->fd < 0) {
+    perror("gdb_serve");
+    free(gdb);
+    return GDB_FAILED;
+  }
+
+  /* packets are small and answered one at a time */
+  setsockopt(gdb->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  gdb->m = m;
+  result = gdb_session(gdb);
+
+  /* whatever the debugger left behind */
+  while (m->icache.breakpoint_count)
+    icache_remove_breakpoint(m, m->icache.breakpoints[0]);
+
+  close(gdb->fd);
+  free(gdb);
+  return result;
+}
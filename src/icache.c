@@ -0,0 +1,195 @@
+#include <stdio.h>
+
+#include "rscs.h"
+#include "core.h"
+#include "icache.h"
+#include "interp.h"
+#include "jit.h"
+#include "machine.h"
+
+static inline uint32_t icache_index(uint32_t pc)
+{
+  return (pc / SIZE_WORD) & (ICACHE_ENTRIES - 1);
+}
+
+void icache_init(struct Machine *m)
+{
+  icache_flush(m);
+  m->icache.stats.hits = 0;
+  m->icache.stats.misses = 0;
+}
+
+void icache_decode(struct DecodedInstruction *entry, uint32_t pc, uint32_t instruction)
+{
+  union Decoder decoder = { .instruction = instruction };
+
+  entry->pc = pc;
+  entry->instruction = instruction;
+  entry->block = decoder.common.__block;
+  entry->scheme = decoder.common.__scheme;
+  entry->opcode = decoder.common.__opcode;
+  entry->dstreg = decoder.common.__dstreg;
+  entry->srcreg = decoder.common.__srcreg;
+  entry->src2reg = decoder.type_reg.__src2reg;
+  entry->handler = HANDLER_INDEX(entry->block, entry->scheme, entry->opcode);
+
+  switch (entry->scheme) {
+    case CODING_SCHEME_R:
+      entry->imm = 0;
+      break;
+
+    case CODING_SCHEME_SI:
+      entry->imm = sign_extend(decoder.type_imm.__imm);
+      break;
+
+    case CODING_SCHEME_UI:
+      entry->imm = decoder.type_imm.__imm;
+      break;
+
+    case CODING_SCHEME_IB:
+      entry->imm = decoder.type_imm_extended.__imm;
+      break;
+  }
+}
+
+static bool icache_is_breakpoint(struct Machine *m, uint32_t pc)
+{
+  for (uint32_t i = 0; i < m->icache.breakpoint_count; i++) {
+    if (m->icache.breakpoints[i] == pc)
+      return true;
+  }
+
+  return false;
+}
+
+/* Every conditional branch is preceded by a CMP, the fast interpreter runs
+ * the pair in one handler when the branch goes to a fixed address (relative
+ * to its PC or absolute). The CMP entry then depends on the instruction
+ * after it as well, see icache_invalidate().
+ */
+static void icache_fuse(struct Machine *m, struct DecodedInstruction *entry)
+{
+  struct DecodedInstruction branch;
+  uint32_t next = entry->pc + SIZE_WORD;
+
+  if (mmu_translate_address(m, next, SIZE_WORD) != VIRT_DRAM)
+    return;
+
+  icache_decode(&branch, next, mmu_read(m, next, SIZE_WORD));
+  if (branch.block != BLOCK_BRANCH || branch.opcode < OPCODE_BEQ || branch.opcode > OPCODE_BGE ||
+      branch.dstreg != REGISTER_PC || icache_is_breakpoint(m, next))
+    return;
+
+  if (branch.scheme == CODING_SCHEME_IB)
+    entry->branch_target = branch.imm;
+  else if (branch.scheme != CODING_SCHEME_R && branch.srcreg == REGISTER_PC)
+    entry->branch_target = next + branch.imm;
+  else
+    return;
+
+  entry->handler = HANDLER_FUSED_CMP(entry->scheme != CODING_SCHEME_R, branch.opcode);
+  system_memory_mark_code(m, next - MMIO_SYSTEM_MEMORY_START, SIZE_WORD);
+}
+
+const struct DecodedInstruction *icache_fetch(struct Machine *m, uint32_t pc)
+{
+  struct Icache *icache = &m->icache;
+  struct DecodedInstruction *entry = &icache->entries[icache_index(pc)];
+
+  if (entry->valid && entry->pc == pc) {
+    icache->stats.hits++;
+    return entry;
+  }
+
+  icache->stats.misses++;
+  if (mmu_translate_address(m, pc, SIZE_WORD) != VIRT_DRAM) {
+    /* fetch from device has side effects, don't cache it */
+    icache_decode(&icache->uncached, pc, mmu_read(m, pc, SIZE_WORD));
+    icache->uncached.handler = HANDLER_FALLBACK;
+    return &icache->uncached;
+  }
+
+  icache_decode(entry, pc, mmu_read(m, pc, SIZE_WORD));
+  if (m->icache.breakpoint_count && icache_is_breakpoint(m, pc))
+    entry->handler = HANDLER_BREAKPOINT;
+  else if (entry->block == BLOCK_BRANCH && entry->opcode == OPCODE_CMP && entry->scheme != CODING_SCHEME_IB)
+    icache_fuse(m, entry);
+  entry->valid = true;
+  system_memory_mark_code(m, pc - MMIO_SYSTEM_MEMORY_START, SIZE_WORD);
+  return entry;
+}
+
+/* Drop every cached instruction which overlaps [address, address + size) */
+void icache_invalidate(struct Machine *m, uint32_t address, uint8_t size)
+{
+  uint32_t first = address - (SIZE_WORD - 1);
+  uint32_t last = address + size - 1;
+
+  for (uint32_t pc = first & ~(SIZE_WORD - 1); pc <= last; pc += SIZE_WORD) {
+    struct DecodedInstruction *entry = &m->icache.entries[icache_index(pc)];
+
+    if (entry->valid && entry->pc - first <= last - first)
+      entry->valid = false;
+  }
+
+  /* a CMP fused with an instruction written */
+  {
+    uint32_t pc = (address & ~(SIZE_WORD - 1)) - SIZE_WORD;
+    struct DecodedInstruction *entry = &m->icache.entries[icache_index(pc)];
+
+    if (entry->valid && entry->pc == pc && HANDLER_IS_FUSED(entry->handler))
+      entry->valid = false;
+  }
+}
+
+void icache_flush(struct Machine *m)
+{
+  for (int i = 0; i < ICACHE_ENTRIES; i++)
+    m->icache.entries[i].valid = false;
+}
+
+/* Translated code runs past breakpoints, it is thrown away */
+bool icache_insert_breakpoint(struct Machine *m, uint32_t pc)
+{
+  struct Icache *icache = &m->icache;
+
+  if (pc % SIZE_WORD || mmu_translate_address(m, pc, SIZE_WORD) != VIRT_DRAM)
+    return false;
+
+  if (icache_is_breakpoint(m, pc))
+    return true;
+
+  if (icache->breakpoint_count == ICACHE_MAX_BREAKPOINTS)
+    return false;
+
+  icache->breakpoints[icache->breakpoint_count++] = pc;
+  icache_invalidate(m, pc, SIZE_WORD);
+  jit_flush(m);
+  return true;
+}
+
+bool icache_remove_breakpoint(struct Machine *m, uint32_t pc)
+{
+  struct Icache *icache = &m->icache;
+
+  for (uint32_t i = 0; i < icache->breakpoint_count; i++) {
+    if (icache->breakpoints[i] == pc) {
+      icache->breakpoints[i] = icache->breakpoints[--icache->breakpoint_count];
+      icache_invalidate(m, pc, SIZE_WORD);
+      jit_flush(m);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void icache_dump_stats(struct Machine *m)
+{
+  const struct IcacheStats *stats = &m->icache.stats;
+  uint64_t total = stats->hits + stats->misses;
+
+  fprintf(stderr, "icache: %lu hits, %lu misses (%.2f%% hit rate)\n",
+          (unsigned long)stats->hits, (unsigned long)stats->misses,
+          total ? 100.0 * stats->hits / total : 0.0);
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+
+#include "rscs.h"
+#include "intc.h"
+#include "machine.h"
+
+void intc_init(struct Machine *m)
+{
+  m->intc.pending = 0;
+  m->intc.enable = 0;
+  m->intc.vector = 0;
+  m->intc.epc = 0;
+  m->intc.cause = 0;
+  m->intc.waiting = false;
+  m->intc.taken = 0;
+}
+
+void intc_raise(struct Machine *m, uint8_t line)
+{
+  m->intc.pending |= 1u << line;
+  intc_update(m);
+}
+
+/* Called when an interrupt may have become deliverable, the engines don't
+ * check for interrupts, the run ends after the current instruction and
+ * machine_run() takes it */
+void intc_update(struct Machine *m)
+{
+  if (intc_active(&m->intc) && (m->regfile.status_regs.status_if || m->intc.waiting))
+    m->regfile.ctrl_regs.ctrl_evt = true;
+}
+
+/* Take the lowest pending interrupt, between two instructions */
+bool intc_deliver(struct Machine *m)
+{
+  struct Intc *intc = &m->intc;
+  uint32_t active = intc_active(intc);
+
+  if (!active || !m->regfile.status_regs.status_if)
+    return false;
+
+  intc->cause = __builtin_ctz(active);
+  intc->epc = m->regfile.gp_registers[REGISTER_PC];
+  intc->taken++;
+  m->regfile.status_regs.status_if = false;
+  m->regfile.gp_registers[REGISTER_PC] = intc->vector;
+  return true;
+}
+
+/* IRET */
+void intc_return(struct Machine *m)
+{
+  m->regfile.gp_registers[REGISTER_PC] = m->intc.epc;
+  m->regfile.status_regs.status_if = true;
+  intc_update(m);
+}
+
+void intc_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size)
+{
+  struct Intc *intc = &m->intc;
+
+  if (size != SIZE_WORD) {
+    fprintf(stderr, "INTC invalid size: %d\n", size);
+    return;
+  }
+
+  switch (address) {
+    case INTC_REG_PENDING:
+      intc->pending &= ~data;
+      break;
+
+    case INTC_REG_ENABLE:
+      intc->enable = data;
+      intc_update(m);
+      break;
+
+    case INTC_REG_RAISE:
+      intc->pending |= data;
+      intc_update(m);
+      break;
+
+    case INTC_REG_VECTOR:
+      intc->vector = data;
+      break;
+
+    case INTC_REG_EPC:
+      intc->epc = data;
+      break;
+
+    default:
+      break;
+  }
+}
+
+uint32_t intc_read(struct Machine *m, uint32_t address, uint8_t size)
+{
+  struct Intc *intc = &m->intc;
+
+  if (size != SIZE_WORD) {
+    fprintf(stderr, "INTC invalid size: %d\n", size);
+    return 0;
+  }
+
+  switch (address) {
+    case INTC_REG_PENDING:
+      return intc->pending;
+
+    case INTC_REG_ENABLE:
+      return intc->enable;
+
+    case INTC_REG_VECTOR:
+      return intc->vector;
+
+    case INTC_REG_EPC:
+      return intc->epc;
+
+    case INTC_REG_CAUSE:
+      return intc->cause;
+
+    default:
+      return 0;
+  }
+}
+
+void intc_dump_stats(struct Machine *m)
+{
+  if (!m->intc.taken && !m->events.idle)
+    return;
+
+  fprintf(stderr, "intc: %lu interrupts taken, %lu timer expiries, %lu idle ticks skipped\n",
+          (unsigned long)m->intc.taken, (unsigned long)m->timer.fired,
+          (unsigned long)m->events.idle);
+}
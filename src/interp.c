@@ -0,0 +1,267 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "rscs.h"
+#include "core.h"
+#include "icache.h"
+#include "interp.h"
+#include "perf.h"
+#include "trace.h"
+#include "machine.h"
+
+/* Handlers are generated for every (block, opcode) pair in INTERP_OPS, with
+ * one specialization per operand fetch: register (R), immediate (UI and SI
+ * share one, the immediate is already resolved in the icache) and the
+ * extended immediate with op1 forced to zero (IB).
+ * Everything not listed runs through the reference execute_decoded().
+ */
+#define INTERP_OPS(X)                          \
+  X(BLOCK_ARITHMETIC, OPCODE_ADD, add)         \
+  X(BLOCK_ARITHMETIC, OPCODE_SUB, sub)         \
+  X(BLOCK_ARITHMETIC, OPCODE_SHL, shl)         \
+  X(BLOCK_ARITHMETIC, OPCODE_SHR, shr)         \
+  X(BLOCK_ARITHMETIC, OPCODE_AND, and)         \
+  X(BLOCK_ARITHMETIC, OPCODE_OR, or)           \
+  X(BLOCK_ARITHMETIC, OPCODE_NOT, not)         \
+  X(BLOCK_ARITHMETIC, OPCODE_XOR, xor)         \
+  X(BLOCK_MEMORY, OPCODE_LB, lb)               \
+  X(BLOCK_MEMORY, OPCODE_LHW, lhw)             \
+  X(BLOCK_MEMORY, OPCODE_LW, lw)               \
+  X(BLOCK_MEMORY, OPCODE_SB, sb)               \
+  X(BLOCK_MEMORY, OPCODE_SHW, shw)             \
+  X(BLOCK_MEMORY, OPCODE_SW, sw)               \
+  X(BLOCK_BRANCH, OPCODE_BR, br)               \
+  X(BLOCK_BRANCH, OPCODE_BEQ, beq)             \
+  X(BLOCK_BRANCH, OPCODE_BLT, blt)             \
+  X(BLOCK_BRANCH, OPCODE_BLE, ble)             \
+  X(BLOCK_BRANCH, OPCODE_BGT, bgt)             \
+  X(BLOCK_BRANCH, OPCODE_BGE, bge)             \
+  X(BLOCK_BRANCH, OPCODE_CMP, cmp)             \
+  X(BLOCK_CONTROL, OPCODE_BRK, brk)            \
+  X(BLOCK_CONTROL, OPCODE_HALT, hlt)
+
+#define PC r[REGISTER_PC]
+#define ZF regfile_zf(&m->regfile)
+#define NF regfile_nf(&m->regfile)
+
+/* ctrl registers are only written by the memory and control handlers and
+ * the fallback to execute_decoded() (atomics), each checks after itself */
+#define CTRL_PENDING() \
+  (m->regfile.ctrl_regs.ctrl_hlt | m->regfile.ctrl_regs.ctrl_brk | m->regfile.ctrl_regs.ctrl_err | \
+   m->regfile.ctrl_regs.ctrl_evt)
+
+#define CHECK_CTRL()   \
+  if (CTRL_PENDING())  \
+    goto check_ctrl
+
+#define WRITE_DST(value)                              \
+  r[d->dstreg] = (value);                             \
+  TRACE_REGISTER(m, d->dstreg, r[d->dstreg])
+
+#define BRANCH(cond)                                  \
+  PERF_COUNT_BRANCH(m, cond);                         \
+  if (cond) {                                         \
+    WRITE_DST(op1 + op2);                             \
+  } else {                                            \
+    PC += 4;                                          \
+  }
+
+#define BODY_add WRITE_DST(op1 + op2); PC += 4
+#define BODY_sub WRITE_DST(op1 - op2); PC += 4
+#define BODY_shl WRITE_DST(op1 << op2); PC += 4
+#define BODY_shr WRITE_DST(op1 >> op2); PC += 4
+#define BODY_and WRITE_DST(op1 & op2); PC += 4
+#define BODY_or  WRITE_DST(op1 | op2); PC += 4
+#define BODY_not WRITE_DST(~r[d->dstreg]); PC += 4
+#define BODY_xor WRITE_DST(op1 ^ op2); PC += 4
+
+/* devices read the retired instruction count off the budget */
+#define LOAD(size)                                      \
+  m->budget = remaining;                                \
+  PERF_COUNT_READ(m, op1 + op2, size);                  \
+  WRITE_DST(mmu_read(m, op1 + op2, size));              \
+  TRACE_LOAD(m, op1 + op2, r[d->dstreg], size);         \
+  PC += 4;                                              \
+  CHECK_CTRL()
+
+#define STORE(size)                                     \
+  m->budget = remaining;                                \
+  PERF_COUNT_WRITE(m, r[d->dstreg] + op1, size);        \
+  TRACE_STORE(m, r[d->dstreg] + op1, op2, size);        \
+  mmu_write(m, r[d->dstreg] + op1, op2, size);          \
+  PC += 4;                                              \
+  CHECK_CTRL()
+
+#define BODY_lb  LOAD(SIZE_BYTE)
+#define BODY_lhw LOAD(SIZE_HWORD)
+#define BODY_lw  LOAD(SIZE_WORD)
+#define BODY_sb  STORE(SIZE_BYTE)
+#define BODY_shw STORE(SIZE_HWORD)
+#define BODY_sw  STORE(SIZE_WORD)
+
+#define BODY_br  BRANCH(true)
+#define BODY_beq BRANCH(ZF)
+#define BODY_blt BRANCH(NF)
+#define BODY_ble BRANCH(ZF || NF)
+#define BODY_bgt BRANCH(!ZF && !NF)
+#define BODY_bge BRANCH(!NF)
+#define BODY_cmp regfile_compare(&m->regfile, op1, op2); PC += 4
+
+/* CMP fused with a conditional branch, the condition comes straight from
+ * the comparison. The difference is still stored for code reading the
+ * flags later.
+ */
+#define FUSED_OPS(X)         \
+  X(OPCODE_BEQ, beq, ==)     \
+  X(OPCODE_BLT, blt, <)      \
+  X(OPCODE_BLE, ble, <=)     \
+  X(OPCODE_BGT, bgt, >)      \
+  X(OPCODE_BGE, bge, >=)
+
+#define BODY_brk m->regfile.ctrl_regs.ctrl_brk = true; PC += 4; goto check_ctrl
+#define BODY_hlt m->regfile.ctrl_regs.ctrl_hlt = true; PC += 4; goto check_ctrl
+
+#ifdef HAVE_COMPUTED_GOTO
+
+#define HANDLER(label, cases) label:
+#define NEXT()                               \
+  if (!remaining)                            \
+    goto check_ctrl;                         \
+  remaining--;                               \
+  d = icache_fetch(m, PC);                   \
+  goto *dispatch_table[d->handler]
+
+#define TABLE_ENTRIES(block, opcode, name)                           \
+  [HANDLER_INDEX(block, CODING_SCHEME_R, opcode)] = &&name##_r,      \
+  [HANDLER_INDEX(block, CODING_SCHEME_UI, opcode)] = &&name##_i,     \
+  [HANDLER_INDEX(block, CODING_SCHEME_SI, opcode)] = &&name##_i,     \
+  [HANDLER_INDEX(block, CODING_SCHEME_IB, opcode)] = &&name##_ib,
+
+#else
+
+#define HANDLER(label, cases) cases:
+#define NEXT() continue
+
+#endif
+
+#define CASES_R(block, opcode) case HANDLER_INDEX(block, CODING_SCHEME_R, opcode)
+#define CASES_I(block, opcode)                           \
+  case HANDLER_INDEX(block, CODING_SCHEME_UI, opcode):   \
+  case HANDLER_INDEX(block, CODING_SCHEME_SI, opcode)
+#define CASES_IB(block, opcode) case HANDLER_INDEX(block, CODING_SCHEME_IB, opcode)
+
+#define DEFINE_FUSED_HANDLERS(branch, name, cond)                     \
+  HANDLER(fused_##name##_r, case HANDLER_FUSED_CMP(false, branch))    \
+    op2 = r[d->src2reg];                                              \
+    goto fused_##name;                                                \
+  HANDLER(fused_##name##_i, case HANDLER_FUSED_CMP(true, branch))     \
+    op2 = d->imm;                                                     \
+  fused_##name:                                                       \
+    PERF_COUNT_INSTRUCTION(m, d);                                     \
+    TRACE_INSTRUCTION(m, d);                                          \
+    comparator = r[d->srcreg] - op2;                                  \
+    regfile_compare(&m->regfile, r[d->srcreg], op2);                  \
+    if (!remaining || m->perf || m->trace) {                          \
+      /* the branch is counted and traced on its own */               \
+      PC += 4;                                                        \
+      NEXT();                                                         \
+    }                                                                 \
+    remaining--;                                                      \
+    PC = comparator cond 0 ? d->branch_target : PC + 8;               \
+    NEXT();
+
+#define TABLE_FUSED_ENTRIES(branch, name, cond)                      \
+  [HANDLER_FUSED_CMP(false, branch)] = &&fused_##name##_r,           \
+  [HANDLER_FUSED_CMP(true, branch)] = &&fused_##name##_i,
+
+#define DEFINE_HANDLERS(block, opcode, name)                \
+  HANDLER(name##_r, CASES_R(block, opcode))                 \
+    PERF_COUNT_INSTRUCTION(m, d);                           \
+    TRACE_INSTRUCTION(m, d);                                \
+    op1 = r[d->srcreg];                                     \
+    op2 = r[d->src2reg];                                    \
+    BODY_##name;                                            \
+    NEXT();                                                 \
+  HANDLER(name##_i, CASES_I(block, opcode))                 \
+    PERF_COUNT_INSTRUCTION(m, d);                           \
+    TRACE_INSTRUCTION(m, d);                                \
+    op1 = r[d->srcreg];                                     \
+    op2 = d->imm;                                           \
+    BODY_##name;                                            \
+    NEXT();                                                 \
+  HANDLER(name##_ib, CASES_IB(block, opcode))               \
+    PERF_COUNT_INSTRUCTION(m, d);                           \
+    TRACE_INSTRUCTION(m, d);                                \
+    op1 = 0;                                                \
+    op2 = d->imm;                                           \
+    BODY_##name;                                            \
+    NEXT();
+
+uint8_t interp_run(struct Machine *m, uint64_t limit)
+{
+  uint32_t *r = m->regfile.gp_registers;
+  const struct DecodedInstruction *d = NULL;
+  uint64_t remaining = limit;
+  uint32_t op1;
+  uint32_t op2;
+  int32_t comparator;
+  uint8_t state;
+
+#ifdef HAVE_COMPUTED_GOTO
+  static const void *dispatch_table[INTERP_HANDLERS] = {
+    [0 ... INTERP_HANDLERS - 1] = &&fallback,
+    INTERP_OPS(TABLE_ENTRIES)
+    FUSED_OPS(TABLE_FUSED_ENTRIES)
+    [HANDLER_BREAKPOINT] = &&breakpoint,
+  };
+#endif
+
+  m->run_limit = limit;
+  if (CTRL_PENDING())
+    goto check_ctrl;
+
+#ifdef HAVE_COMPUTED_GOTO
+  NEXT();
+  {
+#else
+  while (remaining) {
+    remaining--;
+    d = icache_fetch(m, PC);
+    switch (d->handler) {
+#endif
+
+    INTERP_OPS(DEFINE_HANDLERS)
+    FUSED_OPS(DEFINE_FUSED_HANDLERS)
+
+    HANDLER(breakpoint, case HANDLER_BREAKPOINT)
+      /* stop before it, it wasn't executed */
+      remaining++;
+      m->regfile.ctrl_regs.ctrl_brk = true;
+      goto check_ctrl;
+
+#ifdef HAVE_COMPUTED_GOTO
+fallback:
+#else
+    default:
+#endif
+      m->budget = remaining;
+      execute_decoded(m, d);
+      CHECK_CTRL();
+      NEXT();
+
+#ifndef HAVE_COMPUTED_GOTO
+    }
+#endif
+  }
+
+check_ctrl:
+  m->instret += limit - remaining;
+  m->run_limit = 0;
+  state = check_ctrl_regs(m);
+  if (state == STATE_ERROR)
+    core_dump_error(m, d ? d->instruction : 0);
+
+  return state;
+}
@@ -0,0 +1,1083 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "rscs.h"
+#include "core.h"
+#include "icache.h"
+#include "interp.h"
+#include "jit.h"
+#include "machine.h"
+
+#if defined(__x86_64__)
+
+/* Host registers. Translated code runs with
+ *   rbx - guest register file, struct Machine fields are addressed from it
+ *   rbp - host base of system memory
+ *   r12-r15 - guest registers cached for the duration of a block
+ * eax, ecx, edx, esi and edi are scratch.
+ */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define HOST_CACHED_REGISTERS 4
+static const uint8_t host_cached_registers[HOST_CACHED_REGISTERS] = { R12, R13, R14, R15 };
+
+/* x86 condition codes */
+#define CC_A  0x7
+#define CC_AE 0x3
+#define CC_Z  0x4
+#define CC_NZ 0x5
+#define CC_S  0x8
+#define CC_NS 0x9
+#define CC_LE 0xe
+#define CC_G  0xf
+
+/* Lazy flags and bit positions of the ctrl bitfield in struct Regfile */
+#define REGFILE_ZERO  offsetof(struct Regfile, status_zero)
+#define REGFILE_SIGN  offsetof(struct Regfile, status_sign)
+#define REGFILE_CTRL  offsetof(struct Regfile, ctrl_regs)
+#define CTRL_HLT 0x1
+#define CTRL_BRK 0x2
+#define CTRL_ANY 0xf
+
+#define PC_OFFSET (REGISTER_PC * 4)
+#define BUDGET_OFFSET (offsetof(struct Machine, budget) - offsetof(struct Machine, regfile))
+
+/* Bytes at the start of every block which may be overwritten on invalidation */
+#define BLOCK_ENTRY_SIZE 14
+/* Upper bound of host code emitted for one guest instruction */
+#define MAX_INSTRUCTION_CODE 256
+
+#define CTRL_PENDING() \
+  (m->regfile.ctrl_regs.ctrl_hlt | m->regfile.ctrl_regs.ctrl_brk | m->regfile.ctrl_regs.ctrl_err | \
+   m->regfile.ctrl_regs.ctrl_evt)
+
+struct JitBlock {
+  uint32_t pc;
+  uint32_t count; // guest instructions
+  uint32_t end; // first guest address after the block
+  uint8_t *code;
+  bool valid;
+};
+
+/* Guest block being translated */
+struct Translation {
+  struct DecodedInstruction insns[JIT_MAX_BLOCK_INSTRUCTIONS];
+  uint32_t count;
+  uint32_t current; // index of the instruction being emitted
+  int8_t host_reg[GENERAL_PURPOSE_REGISTER_COUNT]; // -1 if the register stays in the regfile
+  bool written[GENERAL_PURPOSE_REGISTER_COUNT];
+};
+
+typedef uint8_t *(*JitEnter)(const uint8_t *code, uint32_t *regs, uint8_t *memory);
+
+/* Translator state, one per machine. Translated code has the machine's
+ * system memory layout baked in.
+ */
+struct Jit {
+  struct Machine *machine;
+  uint8_t *code_buffer;
+  uint8_t *code_start; // first byte after the trampolines
+  uint8_t *emit_ptr;
+  JitEnter jit_enter;
+  uint8_t *jit_exit;
+
+  struct JitBlock blocks[JIT_MAX_BLOCKS];
+  uint32_t block_count;
+  struct JitBlock *block_table[JIT_TABLE_SIZE];
+  uint32_t generation;
+  bool invalidated;
+
+  struct Translation tr;
+  struct JitStats stats;
+};
+
+/* Emitter */
+static inline void emit8(struct Jit *j, uint8_t byte)
+{
+  *j->emit_ptr++ = byte;
+}
+
+static inline void emit32(struct Jit *j, uint32_t data)
+{
+  memcpy(j->emit_ptr, &data, sizeof(data));
+  j->emit_ptr += sizeof(data);
+}
+
+static inline void emit64(struct Jit *j, uint64_t data)
+{
+  memcpy(j->emit_ptr, &data, sizeof(data));
+  j->emit_ptr += sizeof(data);
+}
+
+static void emit_rex(struct Jit *j, uint8_t reg, uint8_t rm)
+{
+  uint8_t rex = 0x40 | (reg >> 3) << 2 | (rm >> 3);
+
+  if (rex != 0x40)
+    emit8(j, rex);
+}
+
+/* opcode reg, [rbx + disp] */
+static void emit_regfile_op(struct Jit *j, uint8_t opcode, uint8_t reg, int32_t disp)
+{
+  emit_rex(j, reg, RBX);
+  emit8(j, opcode);
+  if (disp >= -128 && disp <= 127) {
+    emit8(j, 0x40 | (reg & 7) << 3 | RBX);
+    emit8(j, disp);
+  } else {
+    emit8(j, 0x80 | (reg & 7) << 3 | RBX);
+    emit32(j, disp);
+  }
+}
+
+/* opcode rm, reg */
+static void emit_reg_op(struct Jit *j, uint8_t opcode, uint8_t reg, uint8_t rm)
+{
+  emit_rex(j, reg, rm);
+  emit8(j, opcode);
+  emit8(j, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void emit_mov_imm(struct Jit *j, uint8_t reg, uint32_t imm)
+{
+  emit_rex(j, 0, reg);
+  emit8(j, 0xb8 | (reg & 7));
+  emit32(j, imm);
+}
+
+/* mov rdi, machine, first argument of every helper */
+static void emit_machine_arg(struct Jit *j)
+{
+  emit8(j, 0x48);
+  emit8(j, 0xbf);
+  emit64(j, (uint64_t)j->machine);
+}
+
+static void emit_call(struct Jit *j, const void *function)
+{
+  emit8(j, 0x48); // mov rax, imm64
+  emit8(j, 0xb8);
+  emit64(j, (uint64_t)function);
+  emit8(j, 0xff); // call rax
+  emit8(j, 0xd0);
+}
+
+static uint8_t *emit_jcc(struct Jit *j, uint8_t cc)
+{
+  uint8_t *site;
+
+  emit8(j, 0x0f);
+  emit8(j, 0x80 | cc);
+  site = j->emit_ptr;
+  emit32(j, 0);
+  return site;
+}
+
+static uint8_t *emit_jmp(struct Jit *j)
+{
+  uint8_t *site;
+
+  emit8(j, 0xe9);
+  site = j->emit_ptr;
+  emit32(j, 0);
+  return site;
+}
+
+static void patch_rel32(uint8_t *site, const uint8_t *target)
+{
+  int32_t rel = target - (site + 4);
+
+  memcpy(site, &rel, sizeof(rel));
+}
+
+/* Guest register access */
+static void emit_load_guest(struct Jit *j, uint8_t host, uint8_t reg, uint32_t pc)
+{
+  if (reg == REGISTER_PC)
+    /* inside a block the PC is always the address of the current instruction */
+    emit_mov_imm(j, host, pc);
+  else if (j->tr.host_reg[reg] >= 0)
+    emit_reg_op(j, 0x89, j->tr.host_reg[reg], host);
+  else
+    emit_regfile_op(j, 0x8b, host, reg * 4);
+}
+
+static void emit_store_guest(struct Jit *j, uint8_t reg, uint8_t host)
+{
+  if (j->tr.host_reg[reg] >= 0)
+    emit_reg_op(j, 0x89, host, j->tr.host_reg[reg]);
+  else
+    emit_regfile_op(j, 0x89, host, reg * 4);
+}
+
+static void emit_store_pc(struct Jit *j, uint32_t pc)
+{
+  emit_regfile_op(j, 0xc7, 0, PC_OFFSET);
+  emit32(j, pc);
+}
+
+static void emit_writeback(struct Jit *j)
+{
+  for (int reg = 0; reg < GENERAL_PURPOSE_REGISTER_COUNT; reg++) {
+    if (j->tr.host_reg[reg] >= 0 && j->tr.written[reg])
+      emit_regfile_op(j, 0x89, j->tr.host_reg[reg], reg * 4);
+  }
+}
+
+/* Leave the block, PC must already be stored */
+static void emit_exit(struct Jit *j)
+{
+  emit_writeback(j);
+  emit8(j, 0x31); // xor eax, eax
+  emit8(j, 0xc0);
+  patch_rel32(emit_jmp(j), j->jit_exit);
+}
+
+/* Leave the block towards a constant PC. The jump initially falls through
+ * to a stub returning its own address to the dispatcher, which patches it
+ * to jump straight to the translated successor.
+ */
+static void emit_exit_chained(struct Jit *j, uint32_t pc)
+{
+  emit_writeback(j);
+  emit_store_pc(j, pc);
+  emit_jmp(j);
+  emit8(j, 0x48); // lea rax, [rip - 11]
+  emit8(j, 0x8d);
+  emit8(j, 0x05);
+  emit32(j, -11);
+  patch_rel32(emit_jmp(j), j->jit_exit);
+}
+
+/* op qword [rbx + budget], imm32 */
+static void emit_budget_op(struct Jit *j, uint8_t ext, uint32_t imm)
+{
+  emit8(j, 0x48);
+  emit8(j, 0x81);
+  emit8(j, 0x80 | ext << 3 | RBX);
+  emit32(j, BUDGET_OFFSET);
+  emit32(j, imm);
+}
+
+/* Leave after the current instruction, giving back the budget of the rest */
+static void emit_exit_early(struct Jit *j, uint32_t next_pc)
+{
+  uint32_t skipped = j->tr.count - j->tr.current - 1;
+
+  if (skipped)
+    emit_budget_op(j, 0, skipped); // add
+  emit_store_pc(j, next_pc);
+  emit_exit(j);
+}
+
+/* Exit in the middle of a block if a helper raised a ctrl flag */
+static void emit_check_ctrl(struct Jit *j, uint32_t next_pc)
+{
+  uint8_t *skip;
+
+  emit_regfile_op(j, 0xf6, 0, REGFILE_CTRL); // test byte [rbx + ctrl], CTRL_ANY
+  emit8(j, CTRL_ANY);
+  skip = emit_jcc(j, CC_Z);
+  emit_exit_early(j, next_pc);
+  patch_rel32(skip, j->emit_ptr);
+}
+
+/* op1 in eax, op2 in ecx */
+static void emit_operands(struct Jit *j, const struct DecodedInstruction *d)
+{
+  if (d->scheme == CODING_SCHEME_IB)
+    emit_mov_imm(j, RAX, 0);
+  else
+    emit_load_guest(j, RAX, d->srcreg, d->pc);
+
+  if (d->scheme == CODING_SCHEME_R)
+    emit_load_guest(j, RCX, d->src2reg, d->pc);
+  else
+    emit_mov_imm(j, RCX, d->imm);
+}
+
+/* Store eax to the destination register. Returns true if that ended the block */
+static bool emit_result(struct Jit *j, const struct DecodedInstruction *d)
+{
+  if (d->dstreg == REGISTER_PC) {
+    emit_reg_op(j, 0x83, 0, RAX); // add eax, 4
+    emit8(j, 4);
+    emit_regfile_op(j, 0x89, RAX, PC_OFFSET);
+    emit_exit(j);
+    return true;
+  }
+
+  emit_store_guest(j, d->dstreg, RAX);
+  return false;
+}
+
+/* Stores to devices and to system memory holding code */
+static uint32_t jit_store(struct Machine *m, uint32_t address, uint32_t data, uint32_t size)
+{
+  mmu_write(m, address, data, size);
+
+  if (m->jit->invalidated || CTRL_PENDING()) {
+    m->jit->invalidated = false;
+    return 1;
+  }
+
+  return 0;
+}
+
+static bool translate_arith(struct Jit *j, const struct DecodedInstruction *d)
+{
+  static const uint8_t alu_opcodes[] = {
+    [OPCODE_ADD] = 0x01, [OPCODE_SUB] = 0x29, [OPCODE_AND] = 0x21,
+    [OPCODE_OR] = 0x09, [OPCODE_XOR] = 0x31,
+  };
+
+  switch (d->opcode) {
+    case OPCODE_NOT:
+      emit_load_guest(j, RAX, d->dstreg, d->pc);
+      emit_reg_op(j, 0xf7, 2, RAX);
+      break;
+
+    case OPCODE_SHL:
+    case OPCODE_SHR:
+      emit_operands(j, d);
+      emit_reg_op(j, 0xd3, d->opcode == OPCODE_SHL ? 4 : 5, RAX);
+      break;
+
+    default:
+      emit_operands(j, d);
+      emit_reg_op(j, alu_opcodes[d->opcode], RCX, RAX);
+      break;
+  }
+
+  return emit_result(j, d);
+}
+
+static bool translate_load(struct Jit *j, const struct DecodedInstruction *d, uint8_t size)
+{
+  uint32_t skipped = j->tr.count - j->tr.current - 1;
+  uint8_t *slow;
+  uint8_t *done;
+
+  emit_operands(j, d);
+  emit_reg_op(j, 0x01, RCX, RAX); // eax = op1 + op2
+
+  /* edx = offset into system memory */
+  emit8(j, 0x8d); // lea edx, [rax + disp32]
+  emit8(j, 0x90);
+  emit32(j, -(uint32_t)MMIO_SYSTEM_MEMORY_START);
+  emit_reg_op(j, 0x81, 7, RDX); // cmp edx, imm32
+  emit32(j, j->machine->memory.size - size);
+  slow = emit_jcc(j, CC_A);
+
+  switch (size) {
+    case SIZE_BYTE:
+      emit8(j, 0x0f); // movzx eax, byte [rbp + rdx]
+      emit8(j, 0xb6);
+      break;
+
+    case SIZE_HWORD:
+      emit8(j, 0x0f); // movzx eax, word [rbp + rdx]
+      emit8(j, 0xb7);
+      break;
+
+    case SIZE_WORD:
+      emit8(j, 0x8b); // mov eax, [rbp + rdx]
+      break;
+  }
+  emit8(j, 0x44);
+  emit8(j, 0x15);
+  emit8(j, 0x00);
+  done = emit_jmp(j);
+
+  /* devices read the retired instruction count off the budget, which
+   * holds the whole block while it runs */
+  patch_rel32(slow, j->emit_ptr);
+  if (skipped)
+    emit_budget_op(j, 0, skipped); // add
+  emit_reg_op(j, 0x89, RAX, RSI);
+  emit_mov_imm(j, RDX, size);
+  emit_machine_arg(j);
+  emit_call(j, mmu_read);
+  if (skipped)
+    emit_budget_op(j, 5, skipped); // sub
+
+  patch_rel32(done, j->emit_ptr);
+  if (emit_result(j, d))
+    return true;
+
+  emit_check_ctrl(j, d->pc + 4);
+  return false;
+}
+
+static void translate_store(struct Jit *j, const struct DecodedInstruction *d, uint8_t size)
+{
+  uint32_t skipped = j->tr.count - j->tr.current - 1;
+  uint8_t *slow;
+  uint8_t *slow_code;
+  uint8_t *slow_clean;
+  uint8_t *slow_split;
+  uint8_t *done;
+  uint8_t *next;
+
+  emit_operands(j, d);
+  emit_load_guest(j, RDX, d->dstreg, d->pc);
+  emit_reg_op(j, 0x01, RDX, RAX); // eax = ptr + op1
+
+  /* edx = offset into system memory */
+  emit8(j, 0x8d); // lea edx, [rax + disp32]
+  emit8(j, 0x90);
+  emit32(j, -(uint32_t)MMIO_SYSTEM_MEMORY_START);
+  emit_reg_op(j, 0x81, 7, RDX); // cmp edx, imm32
+  emit32(j, j->machine->memory.size - size);
+  slow = emit_jcc(j, CC_A);
+
+  /* stores straddling two regions are left to the helper, the checks
+   * below only look at the region of the first byte */
+  slow_split = NULL;
+  if (size > SIZE_BYTE) {
+    emit_reg_op(j, 0x89, RDX, RSI);     // mov esi, edx
+    emit_reg_op(j, 0x83, 4, RSI);       // and esi, region size - 1
+    emit8(j, (1 << SYSTEM_MEMORY_CODE_SHIFT) - 1);
+    emit_reg_op(j, 0x83, 7, RSI);       // cmp esi, region size - size
+    emit8(j, (1 << SYSTEM_MEMORY_CODE_SHIFT) - size);
+    slow_split = emit_jcc(j, CC_A);
+  }
+
+  /* regions holding code need invalidation, leave them to the helper */
+  emit_reg_op(j, 0x89, RDX, RSI);       // mov esi, edx
+  emit_reg_op(j, 0xc1, 5, RSI);         // shr esi, SYSTEM_MEMORY_CODE_SHIFT
+  emit8(j, SYSTEM_MEMORY_CODE_SHIFT);
+  emit8(j, 0x48);                       // mov rdi, imm64
+  emit8(j, 0xbf);
+  emit64(j, (uint64_t)j->machine->memory.code_map);
+  emit8(j, 0x80); emit8(j, 0x3c); emit8(j, 0x37); emit8(j, 0x00); // cmp byte [rdi + rsi], 0
+  slow_code = emit_jcc(j, CC_NZ);
+
+  /* so do the first writes to a page since the last snapshot */
+  emit_reg_op(j, 0x89, RDX, RSI);       // mov esi, edx
+  emit_reg_op(j, 0xc1, 5, RSI);         // shr esi, SYSTEM_MEMORY_DIRTY_SHIFT
+  emit8(j, SYSTEM_MEMORY_DIRTY_SHIFT);
+  emit8(j, 0x48);                       // mov rdi, imm64
+  emit8(j, 0xbf);
+  emit64(j, (uint64_t)j->machine->memory.dirty_map);
+  emit8(j, 0x80); emit8(j, 0x3c); emit8(j, 0x37); emit8(j, 0x00); // cmp byte [rdi + rsi], 0
+  slow_clean = emit_jcc(j, CC_Z);
+
+  switch (size) {
+    case SIZE_BYTE:
+      emit8(j, 0x88); // mov [rbp + rdx], cl
+      break;
+
+    case SIZE_HWORD:
+      emit8(j, 0x66); // mov [rbp + rdx], cx
+      emit8(j, 0x89);
+      break;
+
+    case SIZE_WORD:
+      emit8(j, 0x89); // mov [rbp + rdx], ecx
+      break;
+  }
+  emit8(j, 0x4c);
+  emit8(j, 0x15);
+  emit8(j, 0x00);
+  done = emit_jmp(j);
+
+  patch_rel32(slow, j->emit_ptr);
+  patch_rel32(slow_code, j->emit_ptr);
+  patch_rel32(slow_clean, j->emit_ptr);
+  if (slow_split)
+    patch_rel32(slow_split, j->emit_ptr);
+  /* the timer reads the clock, see translate_load() */
+  if (skipped)
+    emit_budget_op(j, 0, skipped); // add
+  emit_reg_op(j, 0x89, RAX, RSI);
+  emit_reg_op(j, 0x89, RCX, RDX);
+  emit_mov_imm(j, RCX, size);
+  emit_machine_arg(j);
+  emit_call(j, jit_store);
+  if (skipped)
+    emit_budget_op(j, 5, skipped); // sub
+
+  emit8(j, 0x85); // test eax, eax
+  emit8(j, 0xc0);
+  next = emit_jcc(j, CC_Z);
+  emit_exit_early(j, d->pc + 4);
+  patch_rel32(next, j->emit_ptr);
+  patch_rel32(done, j->emit_ptr);
+}
+
+static bool translate_memory(struct Jit *j, const struct DecodedInstruction *d)
+{
+  switch (d->opcode) {
+    case OPCODE_LB:
+      return translate_load(j, d, SIZE_BYTE);
+
+    case OPCODE_LHW:
+      return translate_load(j, d, SIZE_HWORD);
+
+    case OPCODE_LW:
+      return translate_load(j, d, SIZE_WORD);
+
+    case OPCODE_SB:
+      translate_store(j, d, SIZE_BYTE);
+      break;
+
+    case OPCODE_SHW:
+      translate_store(j, d, SIZE_HWORD);
+      break;
+
+    case OPCODE_SW:
+      translate_store(j, d, SIZE_WORD);
+      break;
+  }
+
+  return false;
+}
+
+/* cmp dword [rbx + flag], 0 */
+static void emit_flag_test(struct Jit *j, int32_t flag)
+{
+  emit_regfile_op(j, 0x83, 7, flag);
+  emit8(j, 0);
+}
+
+static bool translate_branch(struct Jit *j, const struct DecodedInstruction *d)
+{
+  const struct DecodedInstruction *previous = j->tr.current ? &j->tr.insns[j->tr.current - 1] : NULL;
+  bool fused = previous && previous->block == BLOCK_BRANCH && previous->opcode == OPCODE_CMP;
+  uint8_t *taken = NULL;
+
+  if (d->opcode == OPCODE_CMP) {
+    emit_operands(j, d);
+    emit_reg_op(j, 0x29, RCX, RAX);                 // sub eax, ecx
+    emit_regfile_op(j, 0x89, RAX, REGFILE_ZERO);    // mov [rbx + zero], eax
+    emit_regfile_op(j, 0x89, RAX, REGFILE_SIGN);    // mov [rbx + sign], eax
+    return false;
+  }
+
+  if (d->opcode != OPCODE_BR && fused) {
+    /* right after a CMP, eax still holds the difference */
+    uint8_t cc = CC_Z;
+
+    switch (d->opcode) {
+      case OPCODE_BEQ: cc = CC_Z; break;
+      case OPCODE_BLT: cc = CC_S; break;
+      case OPCODE_BLE: cc = CC_LE; break;
+      case OPCODE_BGT: cc = CC_G; break;
+      case OPCODE_BGE: cc = CC_NS; break;
+    }
+
+    emit_reg_op(j, 0x85, RAX, RAX);             // test eax, eax
+    taken = emit_jcc(j, cc);
+    emit_exit_chained(j, d->pc + 4);
+    patch_rel32(taken, j->emit_ptr);
+  } else if (d->opcode != OPCODE_BR) {
+    uint8_t *also_taken = NULL;
+    uint8_t *not_taken = NULL;
+
+    switch (d->opcode) {
+      case OPCODE_BEQ:
+        emit_flag_test(j, REGFILE_ZERO);
+        taken = emit_jcc(j, CC_Z);
+        break;
+
+      case OPCODE_BLT:
+        emit_flag_test(j, REGFILE_SIGN);
+        taken = emit_jcc(j, CC_S);
+        break;
+
+      case OPCODE_BLE:
+        emit_flag_test(j, REGFILE_ZERO);
+        also_taken = emit_jcc(j, CC_Z);
+        emit_flag_test(j, REGFILE_SIGN);
+        taken = emit_jcc(j, CC_S);
+        break;
+
+      case OPCODE_BGT:
+        emit_flag_test(j, REGFILE_ZERO);
+        not_taken = emit_jcc(j, CC_Z);
+        emit_flag_test(j, REGFILE_SIGN);
+        taken = emit_jcc(j, CC_NS);
+        break;
+
+      case OPCODE_BGE:
+        emit_flag_test(j, REGFILE_SIGN);
+        taken = emit_jcc(j, CC_NS);
+        break;
+    }
+
+    if (not_taken)
+      patch_rel32(not_taken, j->emit_ptr);
+    emit_exit_chained(j, d->pc + 4);
+    patch_rel32(taken, j->emit_ptr);
+    if (also_taken)
+      patch_rel32(also_taken, j->emit_ptr);
+  }
+
+  if (d->dstreg == REGISTER_PC && d->scheme == CODING_SCHEME_IB) {
+    emit_exit_chained(j, d->imm);
+    return true;
+  }
+
+  emit_operands(j, d);
+  emit_reg_op(j, 0x01, RCX, RAX);
+  if (d->dstreg == REGISTER_PC) {
+    emit_regfile_op(j, 0x89, RAX, PC_OFFSET);
+  } else {
+    /* the destination is written but the PC doesn't move */
+    emit_store_guest(j, d->dstreg, RAX);
+    emit_store_pc(j, d->pc);
+  }
+  emit_exit(j);
+  return true;
+}
+
+static void translate_ctrl(struct Jit *j, const struct DecodedInstruction *d)
+{
+  emit_regfile_op(j, 0x80, 1, REGFILE_CTRL); // or byte [rbx + ctrl], flag
+  emit8(j, d->opcode == OPCODE_HALT ? CTRL_HLT : CTRL_BRK);
+  emit_store_pc(j, d->pc + 4);
+  emit_exit(j);
+}
+
+/* Emit host code for one instruction, returns true if it ends the block */
+static bool translate_instruction(struct Jit *j, const struct DecodedInstruction *d)
+{
+  switch (d->block) {
+    case BLOCK_ARITHMETIC:
+      return translate_arith(j, d);
+
+    case BLOCK_MEMORY:
+      return translate_memory(j, d);
+
+    case BLOCK_BRANCH:
+      return translate_branch(j, d);
+
+    case BLOCK_CONTROL:
+      translate_ctrl(j, d);
+      return true;
+  }
+
+  return true;
+}
+
+static bool jit_supported(const struct DecodedInstruction *d)
+{
+  /* blocks end before breakpoints, the dispatcher stops there */
+  if (d->handler == HANDLER_BREAKPOINT)
+    return false;
+
+  switch (d->block) {
+    case BLOCK_ARITHMETIC:
+      return true;
+
+    case BLOCK_MEMORY:
+      return d->opcode <= OPCODE_SW;
+
+    case BLOCK_BRANCH:
+      return d->opcode <= OPCODE_CMP;
+
+    case BLOCK_CONTROL:
+      return d->opcode == OPCODE_HALT || d->opcode == OPCODE_BRK;
+  }
+
+  return false;
+}
+
+static bool ends_block(const struct DecodedInstruction *d)
+{
+  switch (d->block) {
+    case BLOCK_ARITHMETIC:
+      return d->dstreg == REGISTER_PC;
+
+    case BLOCK_MEMORY:
+      return d->opcode <= OPCODE_LW && d->dstreg == REGISTER_PC;
+
+    case BLOCK_BRANCH:
+      return d->opcode != OPCODE_CMP;
+  }
+
+  return true;
+}
+
+static void count_register(uint8_t *uses, uint8_t reg)
+{
+  if (reg != REGISTER_PC)
+    uses[reg]++;
+}
+
+/* Keep the most used guest registers of the block in host registers */
+static void allocate_registers(struct Jit *j)
+{
+  uint8_t uses[GENERAL_PURPOSE_REGISTER_COUNT] = { 0 };
+
+  for (int reg = 0; reg < GENERAL_PURPOSE_REGISTER_COUNT; reg++) {
+    j->tr.host_reg[reg] = -1;
+    j->tr.written[reg] = false;
+  }
+
+  for (uint32_t i = 0; i < j->tr.count; i++) {
+    const struct DecodedInstruction *d = &j->tr.insns[i];
+    bool writes = false;
+
+    if (d->scheme != CODING_SCHEME_IB)
+      count_register(uses, d->srcreg);
+    if (d->scheme == CODING_SCHEME_R)
+      count_register(uses, d->src2reg);
+
+    switch (d->block) {
+      case BLOCK_ARITHMETIC:
+        writes = true;
+        break;
+
+      case BLOCK_MEMORY:
+        writes = d->opcode <= OPCODE_LW;
+        if (!writes)
+          count_register(uses, d->dstreg);
+        break;
+
+      case BLOCK_BRANCH:
+        writes = d->opcode != OPCODE_CMP;
+        break;
+    }
+
+    if (writes && d->dstreg != REGISTER_PC) {
+      count_register(uses, d->dstreg);
+      j->tr.written[d->dstreg] = true;
+    }
+  }
+
+  for (int i = 0; i < HOST_CACHED_REGISTERS; i++) {
+    int best = -1;
+
+    for (int reg = 0; reg < GENERAL_PURPOSE_REGISTER_COUNT; reg++) {
+      if (j->tr.host_reg[reg] < 0 && uses[reg] >= 2 && (best < 0 || uses[reg] > uses[best]))
+        best = reg;
+    }
+
+    if (best < 0)
+      break;
+    j->tr.host_reg[best] = host_cached_registers[i];
+  }
+}
+
+static void emit_trampolines(struct Jit *j)
+{
+  static const uint8_t enter[] = {
+    0x53,                   // push rbx
+    0x55,                   // push rbp
+    0x41, 0x54,             // push r12
+    0x41, 0x55,             // push r13
+    0x41, 0x56,             // push r14
+    0x41, 0x57,             // push r15
+    0x48, 0x83, 0xec, 0x08, // sub rsp, 8
+    0x48, 0x89, 0xf3,       // mov rbx, rsi
+    0x48, 0x89, 0xd5,       // mov rbp, rdx
+    0xff, 0xe7,             // jmp rdi
+  };
+  static const uint8_t leave[] = {
+    0x48, 0x83, 0xc4, 0x08, // add rsp, 8
+    0x41, 0x5f,             // pop r15
+    0x41, 0x5e,             // pop r14
+    0x41, 0x5d,             // pop r13
+    0x41, 0x5c,             // pop r12
+    0x5d,                   // pop rbp
+    0x5b,                   // pop rbx
+    0xc3,                   // ret
+  };
+
+  j->emit_ptr = j->code_buffer;
+  j->jit_enter = (JitEnter)j->emit_ptr;
+  memcpy(j->emit_ptr, enter, sizeof(enter));
+  j->emit_ptr += sizeof(enter);
+
+  j->jit_exit = j->emit_ptr;
+  memcpy(j->emit_ptr, leave, sizeof(leave));
+  j->emit_ptr += sizeof(leave);
+
+  j->code_start = j->emit_ptr;
+}
+
+/* Translators are only created for machines which run translated code */
+static struct Jit *jit_create(struct Machine *m)
+{
+  struct Jit *j = calloc(1, sizeof(*j));
+  void *buffer;
+
+  if (!j)
+    return NULL;
+
+  buffer = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) {
+    fprintf(stderr, "%s: Unable to allocate code buffer, using interpreter\n", __FUNCTION__);
+    free(j);
+    return NULL;
+  }
+
+  j->machine = m;
+  j->code_buffer = buffer;
+  emit_trampolines(j);
+  m->jit = j;
+  return j;
+}
+
+void jit_destroy(struct Machine *m)
+{
+  if (!m->jit)
+    return;
+
+  munmap(m->jit->code_buffer, JIT_CODE_SIZE);
+  free(m->jit);
+  m->jit = NULL;
+}
+
+void jit_init(struct Machine *m)
+{
+  if (!m->jit)
+    return;
+
+  /* system memory was mapped again, translations refer to the old one */
+  jit_flush(m);
+  memset(&m->jit->stats, 0, sizeof(m->jit->stats));
+}
+
+void jit_flush(struct Machine *m)
+{
+  struct Jit *j = m->jit;
+
+  if (!j)
+    return;
+
+  j->emit_ptr = j->code_start;
+  j->block_count = 0;
+  j->generation++;
+  memset(j->block_table, 0, sizeof(j->block_table));
+  j->stats.flushes++;
+}
+
+static struct JitBlock *translate(struct Jit *j, uint32_t pc)
+{
+  struct Machine *m = j->machine;
+  struct JitBlock *block;
+  uint32_t address = pc;
+  bool ended = false;
+
+  j->tr.count = 0;
+  while (j->tr.count < JIT_MAX_BLOCK_INSTRUCTIONS) {
+    const struct DecodedInstruction *d;
+
+    if (mmu_translate_address(m, address, SIZE_WORD) != VIRT_DRAM)
+      break;
+
+    d = icache_fetch(m, address);
+    if (!jit_supported(d))
+      break;
+
+    j->tr.insns[j->tr.count++] = *d;
+    if (ends_block(d))
+      break;
+    address += SIZE_WORD;
+  }
+
+  if (j->tr.count == 0)
+    return NULL;
+
+  if (j->block_count == JIT_MAX_BLOCKS ||
+      j->emit_ptr + (j->tr.count + 3) * MAX_INSTRUCTION_CODE > j->code_buffer + JIT_CODE_SIZE)
+    jit_flush(m);
+
+  allocate_registers(j);
+
+  block = &j->blocks[j->block_count++];
+  block->pc = pc;
+  block->count = j->tr.count;
+  block->end = pc + j->tr.count * SIZE_WORD;
+  block->code = j->emit_ptr;
+  block->valid = true;
+
+  for (int reg = 0; reg < GENERAL_PURPOSE_REGISTER_COUNT; reg++) {
+    if (j->tr.host_reg[reg] >= 0)
+      emit_regfile_op(j, 0x8b, j->tr.host_reg[reg], reg * 4);
+  }
+  while (j->emit_ptr < block->code + BLOCK_ENTRY_SIZE)
+    emit8(j, 0x90);
+
+  /* the whole block is charged up front, the dispatcher runs the
+   * instructions of a block that doesn't fit one at a time */
+  {
+    uint8_t *enough;
+
+    emit_budget_op(j, 7, block->count); // cmp
+    enough = emit_jcc(j, CC_AE);
+    emit8(j, 0x31); // xor eax, eax
+    emit8(j, 0xc0);
+    emit_store_pc(j, pc);
+    patch_rel32(emit_jmp(j), j->jit_exit);
+    patch_rel32(enough, j->emit_ptr);
+    emit_budget_op(j, 5, block->count); // sub
+  }
+
+  for (j->tr.current = 0; j->tr.current < j->tr.count && !ended; j->tr.current++)
+    ended = translate_instruction(j, &j->tr.insns[j->tr.current]);
+
+  if (!ended)
+    emit_exit_chained(j, block->end);
+
+  j->block_table[(pc / SIZE_WORD) & (JIT_TABLE_SIZE - 1)] = block;
+  j->stats.translations++;
+  return block;
+}
+
+static struct JitBlock *lookup(struct Jit *j, uint32_t pc)
+{
+  struct JitBlock *block = j->block_table[(pc / SIZE_WORD) & (JIT_TABLE_SIZE - 1)];
+
+  if (block && block->valid && block->pc == pc)
+    return block;
+
+  return translate(j, pc);
+}
+
+/* Make the block unreachable: its entry now stores its PC and leaves */
+static void invalidate_block(struct Jit *j, struct JitBlock *block)
+{
+  uint32_t index = (block->pc / SIZE_WORD) & (JIT_TABLE_SIZE - 1);
+  uint8_t *saved = j->emit_ptr;
+
+  j->emit_ptr = block->code;
+  emit8(j, 0x31); // xor eax, eax
+  emit8(j, 0xc0);
+  emit_store_pc(j, block->pc);
+  patch_rel32(emit_jmp(j), j->jit_exit);
+  j->emit_ptr = saved;
+
+  block->valid = false;
+  if (j->block_table[index] == block)
+    j->block_table[index] = NULL;
+
+  j->stats.invalidations++;
+}
+
+/* Called by system memory for writes to regions holding code */
+void jit_invalidate(struct Machine *m, uint32_t address, uint8_t size)
+{
+  struct Jit *j = m->jit;
+
+  if (!j)
+    return;
+
+  for (uint32_t i = 0; i < j->block_count; i++) {
+    struct JitBlock *block = &j->blocks[i];
+
+    if (block->valid && address < block->end && address + size > block->pc) {
+      invalidate_block(j, block);
+      j->invalidated = true;
+    }
+  }
+}
+
+uint8_t jit_run(struct Machine *m, uint64_t limit)
+{
+  struct Jit *j = m->jit ? m->jit : jit_create(m);
+  uint8_t *site = NULL;
+  uint32_t site_generation = 0;
+  uint32_t instruction = 0;
+  bool translated = false;
+  uint8_t state;
+
+  if (!j)
+    return interp_run(m, limit);
+
+  m->budget = limit;
+  m->run_limit = limit;
+  while (!CTRL_PENDING() && m->budget) {
+    uint32_t pc = m->regfile.gp_registers[REGISTER_PC];
+    struct JitBlock *block = lookup(j, pc);
+
+    if (!block || block->count > m->budget) {
+      /* not translatable, run it through the reference implementation */
+      const struct DecodedInstruction *d = icache_fetch(m, pc);
+
+      if (d->handler == HANDLER_BREAKPOINT) {
+        m->regfile.ctrl_regs.ctrl_brk = true;
+        break;
+      }
+
+      instruction = d->instruction;
+      translated = false;
+      m->budget--;
+      execute_decoded(m, d);
+      site = NULL;
+      continue;
+    }
+
+    if (site && site_generation == j->generation) {
+      patch_rel32(site, block->code);
+      j->stats.chained++;
+    }
+
+    j->invalidated = false;
+    site = j->jit_enter(block->code, m->regfile.gp_registers, m->memory.base);
+    site_generation = j->generation;
+    translated = true;
+  }
+  m->instret += limit - m->budget;
+  m->run_limit = 0;
+
+  state = check_ctrl_regs(m);
+  if (state == STATE_ERROR) {
+    if (translated)
+      /* translated code only raises errors from memory instructions */
+      instruction = icache_fetch(m, m->regfile.gp_registers[REGISTER_PC] - SIZE_WORD)->instruction;
+    core_dump_error(m, instruction);
+  }
+
+  return state;
+}
+
+void jit_dump_stats(struct Machine *m)
+{
+  struct JitStats stats = { 0 };
+
+  if (m->jit)
+    stats = m->jit->stats;
+
+  fprintf(stderr, "jit: %lu translations, %lu chained, %lu invalidations, %lu flushes\n",
+          (unsigned long)stats.translations, (unsigned long)stats.chained,
+          (unsigned long)stats.invalidations, (unsigned long)stats.flushes);
+}
+
+#else
+
+void jit_init(struct Machine *m)
+{
+}
+
+void jit_destroy(struct Machine *m)
+{
+}
+
+uint8_t jit_run(struct Machine *m, uint64_t limit)
+{
+  return interp_run(m, limit);
+}
+
+void jit_invalidate(struct Machine *m, uint32_t address, uint8_t size)
+{
+}
+
+void jit_flush(struct Machine *m)
+{
+}
+
+void jit_dump_stats(struct Machine *m)
+{
+}
+
+#endif
@@ -0,0 +1,166 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "loader.h"
+#include "machine.h"
+
+static bool loader_copy(int fd, uint8_t *dst, uint64_t offset, uint64_t size)
+{
+  while (size) {
+    ssize_t ret = pread(fd, dst, size, offset);
+
+    if (ret <= 0) {
+      fprintf(stderr, "Error in loader. Short read from image\n");
+      return false;
+    }
+
+    dst += ret;
+    offset += ret;
+    size -= ret;
+  }
+
+  return true;
+}
+
+/* Place `size` bytes found at `offset` in the image at guest `address` */
+static bool loader_map(struct Machine *m, int fd, uint32_t address, uint64_t offset, uint64_t size)
+{
+  struct SystemMemory *memory = &m->memory;
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t dram;
+  uint64_t head;
+  uint64_t body;
+
+  if (!size)
+    return true;
+
+  if (address < MMIO_SYSTEM_MEMORY_START
+      || (uint64_t)address - MMIO_SYSTEM_MEMORY_START + size > memory->size) {
+    fprintf(stderr, "Error in loader. Segment at 0x%x (%lu bytes) is outside system memory\n",
+            address, (unsigned long)size);
+    return false;
+  }
+
+  dram = address - MMIO_SYSTEM_MEMORY_START;
+  system_memory_mark_dirty(m, dram, size);
+
+  /* file and memory offsets must agree modulo the host page size for mmap */
+  if ((dram - offset) % page_size)
+    return loader_copy(fd, memory->base + dram, offset, size);
+
+  head = (page_size - dram % page_size) % page_size;
+  if (head >= size)
+    return loader_copy(fd, memory->base + dram, offset, size);
+
+  body = (size - head) & ~(page_size - 1);
+  if (body && mmap(memory->base + dram + head, body, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_FIXED, fd, offset + head) == MAP_FAILED) {
+    perror("loader_map");
+    return false;
+  }
+
+  return loader_copy(fd, memory->base + dram, offset, head)
+      && loader_copy(fd, memory->base + dram + head + body, offset + head + body,
+                     size - head - body);
+}
+
+/* The image replaces the built-in demo program, no part of it may show
+ * through gaps or a short image */
+static void loader_clear_demo(struct Machine *m)
+{
+  system_memory_fill(m, 0, 0, SYSTEM_MEMORY_DEMO_SIZE);
+}
+
+bool loader_load_raw(struct Machine *m, int fd, uint32_t address)
+{
+  struct stat st;
+
+  if (fstat(fd, &st) < 0) {
+    perror("loader_load_raw");
+    return false;
+  }
+
+  loader_clear_demo(m);
+
+  if (!loader_map(m, fd, address, 0, st.st_size))
+    return false;
+
+  regfile_write(m, REGISTER_PC, address);
+  return true;
+}
+
+bool loader_load_elf(struct Machine *m, int fd)
+{
+  Elf32_Ehdr ehdr;
+
+  if (!loader_copy(fd, (uint8_t *)&ehdr, 0, sizeof(ehdr)))
+    return false;
+
+  if (ehdr.e_ident[EI_CLASS] != ELFCLASS32 || ehdr.e_ident[EI_DATA] != ELFDATA2LSB
+      || ehdr.e_phentsize != sizeof(Elf32_Phdr)) {
+    fprintf(stderr, "Error in loader. Only 32 bit little endian ELF images are supported\n");
+    return false;
+  }
+
+  loader_clear_demo(m);
+
+  for (int i = 0; i < ehdr.e_phnum; i++) {
+    Elf32_Phdr phdr;
+
+    if (!loader_copy(fd, (uint8_t *)&phdr, ehdr.e_phoff + (uint64_t)i * sizeof(phdr), sizeof(phdr)))
+      return false;
+
+    if (phdr.p_type != PT_LOAD)
+      continue;
+
+    if (phdr.p_filesz > phdr.p_memsz) {
+      fprintf(stderr, "Error in loader. Malformed program header %d\n", i);
+      return false;
+    }
+
+    if (phdr.p_vaddr < MMIO_SYSTEM_MEMORY_START
+        || (uint64_t)phdr.p_vaddr - MMIO_SYSTEM_MEMORY_START + phdr.p_memsz > m->memory.size) {
+      fprintf(stderr, "Error in loader. Segment at 0x%x (%u bytes) is outside system memory\n",
+              phdr.p_vaddr, phdr.p_memsz);
+      return false;
+    }
+
+    if (!loader_map(m, fd, phdr.p_vaddr, phdr.p_offset, phdr.p_filesz))
+      return false;
+
+    /* bss */
+    system_memory_fill(m, phdr.p_vaddr - MMIO_SYSTEM_MEMORY_START + phdr.p_filesz, 0,
+                       phdr.p_memsz - phdr.p_filesz);
+  }
+
+  regfile_write(m, REGISTER_PC, ehdr.e_entry);
+  return true;
+}
+
+bool loader_load(struct Machine *m, const char *path, uint32_t address)
+{
+  unsigned char magic[SELFMAG];
+  bool ret;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+
+  /* the mappings keep their own reference to the file */
+  if (pread(fd, magic, SELFMAG, 0) == SELFMAG && !memcmp(magic, ELFMAG, SELFMAG))
+    ret = loader_load_elf(m, fd);
+  else
+    ret = loader_load_raw(m, fd, address);
+
+  close(fd);
+  return ret;
+}
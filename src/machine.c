@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "core.h"
+#include "cachesim.h"
+#include "icache.h"
+#include "interp.h"
+#include "jit.h"
+#include "loader.h"
+#include "perf.h"
+#include "profile.h"
+#include "replay.h"
+#include "smp.h"
+#include "timing.h"
+#include "trace.h"
+#include "machine.h"
+
+struct Machine *machine_create(uint64_t memory_size)
+{
+  struct Machine *m = calloc(1, sizeof(*m));
+
+  if (!m) {
+    perror("machine_create");
+    return NULL;
+  }
+
+  if (!system_memory_configure(m, memory_size)) {
+    free(m);
+    return NULL;
+  }
+
+  m->engine = MACHINE_ENGINE_FAST;
+  uart_init(m);
+  spi_init(m);
+  machine_reset(m);
+  return m;
+}
+
+void machine_destroy(struct Machine *m)
+{
+  if (!m)
+    return;
+
+  smp_stop(m);
+  uart_destroy(m);
+  spi_detach(m);
+  perf_disable(m);
+  trace_stop(m);
+  profile_stop(m);
+  cachesim_stop(m);
+  timing_stop(m);
+  replay_stop(m);
+  jit_destroy(m);
+  system_memory_destroy(m);
+  free(m);
+}
+
+void machine_reset(struct Machine *m)
+{
+  /* the other harts run on the memory about to be replaced */
+  smp_stop(m);
+  core_init(m);
+  intc_init(m);
+  timer_init(m);
+  dma_init(m);
+  event_init(m);
+  m->instret = 0;
+  m->run_limit = 0;
+  if (m->replay)
+    replay_hook_devices(m);
+}
+
+bool machine_load(struct Machine *m, const char *path, uint32_t address)
+{
+  return loader_load(m, path, address);
+}
+
+struct MachineSnapshot *machine_snapshot(struct Machine *m)
+{
+  static uint64_t snapshot_id;
+  struct MachineSnapshot *s;
+
+  if (m->smp) {
+    fprintf(stderr, "%s: Snapshots need a single hart\n", __FUNCTION__);
+    return NULL;
+  }
+
+  s = calloc(1, sizeof(*s));
+  if (!s) {
+    perror("machine_snapshot");
+    return NULL;
+  }
+
+  s->fd = memfd_create("emulator-snapshot", MFD_CLOEXEC);
+  if (s->fd < 0) {
+    perror("machine_snapshot");
+    free(s);
+    return NULL;
+  }
+
+  s->id = __atomic_add_fetch(&snapshot_id, 1, __ATOMIC_RELAXED);
+  s->memory_size = m->memory.size;
+  s->regfile = m->regfile;
+  s->fsm_state = m->core.fsm_current_state;
+  s->instret = m->instret;
+  s->engine = m->engine;
+  s->intc = m->intc;
+  s->timer = m->timer;
+  s->dma = m->dma;
+  s->spi = m->spi.regs;
+  s->events = m->events;
+
+  if (!system_memory_save(m, s->fd) || !system_memory_rebase(m, s->fd, s->id)) {
+    machine_snapshot_free(s);
+    return NULL;
+  }
+
+  return s;
+}
+
+void machine_snapshot_free(struct MachineSnapshot *s)
+{
+  if (!s)
+    return;
+
+  close(s->fd);
+  free(s);
+}
+
+static void machine_load_state(struct Machine *m, const struct MachineSnapshot *s)
+{
+  uint32_t attached = m->spi.regs.status & (SPI_STATUS_READY | SPI_STATUS_READ_ONLY);
+
+  m->regfile = s->regfile;
+  m->core.fsm_current_state = s->fsm_state;
+  m->core.fsm_next_state = s->fsm_state;
+  m->core.decoded = NULL;
+  m->instret = s->instret;
+  m->intc = s->intc;
+  m->timer = s->timer;
+  m->dma = s->dma;
+  m->spi.regs = s->spi;
+  m->spi.regs.status = (s->spi.status & SPI_STATUS_ERROR) | attached;
+  m->events = s->events;
+}
+
+struct Machine *machine_fork(const struct MachineSnapshot *s)
+{
+  struct Machine *m = machine_create(s->memory_size);
+
+  if (!m)
+    return NULL;
+
+  if (!system_memory_rebase(m, s->fd, s->id)) {
+    machine_destroy(m);
+    return NULL;
+  }
+
+  machine_load_state(m, s);
+  m->engine = s->engine;
+  return m;
+}
+
+bool machine_restore(struct Machine *m, const struct MachineSnapshot *s)
+{
+  bool code;
+
+  if (m->smp) {
+    fprintf(stderr, "%s: Snapshots need a single hart\n", __FUNCTION__);
+    return false;
+  }
+
+  if (m->memory.size != s->memory_size) {
+    fprintf(stderr, "%s: Snapshot memory size differs from the machine's\n", __FUNCTION__);
+    return false;
+  }
+
+  if (m->memory.backing_id == s->id && sysconf(_SC_PAGESIZE) == MMU_PAGE_SIZE) {
+    code = system_memory_revert(m);
+  } else {
+    if (!system_memory_rebase(m, s->fd, s->id))
+      return false;
+    code = true;
+  }
+
+  if (code) {
+    icache_flush(m);
+    jit_flush(m);
+  }
+
+  machine_load_state(m, s);
+  return true;
+}
+
+static uint8_t fsm_run(struct Machine *m, uint64_t limit)
+{
+  uint64_t end = m->instret + limit;
+
+  if (end < m->instret)
+    end = UINT64_MAX;
+
+  while (fsm_cycle_state(m)) {
+    if (m->core.fsm_current_state == STATE_BREAK)
+      return STATE_BREAK;
+
+    if (m->core.fsm_current_state == STATE_FETCH &&
+        (m->instret >= end || m->regfile.ctrl_regs.ctrl_evt))
+      return STATE_FETCH;
+  }
+
+  return check_ctrl_regs(m);
+}
+
+uint64_t machine_instret(const struct Machine *m)
+{
+  /* the fast and translated engines count down the budget instead, the
+   * instruction running was already taken from it */
+  if (m->run_limit)
+    return m->instret + m->run_limit - m->budget - 1;
+
+  return m->instret;
+}
+
+/* Run the events due, wait for an interrupt and take one, between two
+ * engine runs. Returns how far the next run may go, 0 on error. */
+static uint64_t machine_run_events(struct Machine *m, uint64_t limit)
+{
+  uint64_t now = event_clock(m);
+  uint64_t next;
+
+  event_run_due(m, now);
+  while (m->intc.waiting && !intc_active(&m->intc)) {
+    next = event_next(&m->events);
+    if (next == EVENT_NEVER) {
+      fprintf(stderr, "WFI with no event to wait for\n");
+      regfile_write(m, REGISTER_ERROR, true);
+      return 0;
+    }
+
+    /* fast forward, nothing happens until then */
+    m->events.idle += next - now;
+    now = next;
+    event_run_due(m, now);
+  }
+  m->intc.waiting = false;
+  intc_deliver(m);
+
+  next = event_next(&m->events);
+  return next - now < limit ? next - now : limit;
+}
+
+uint8_t machine_run(struct Machine *m, uint64_t max_instructions)
+{
+  uint64_t limit = max_instructions == MACHINE_RUN_UNLIMITED ? UINT64_MAX : max_instructions;
+  uint8_t state;
+
+  if (m->smp)
+    smp_sync_code(m);
+
+  /* continue after a break */
+  m->regfile.ctrl_regs.ctrl_brk = false;
+  if (m->core.fsm_current_state == STATE_BREAK)
+    m->core.fsm_current_state = STATE_FETCH;
+
+  state = check_ctrl_regs(m);
+  while (state == STATE_FETCH && limit) {
+    uint64_t start = m->instret;
+    uint64_t run = machine_run_events(m, limit);
+
+    m->regfile.ctrl_regs.ctrl_evt = false;
+    if (!run) {
+      state = check_ctrl_regs(m);
+      break;
+    }
+
+    if (m->profile)
+      run = profile_limit(m, run);
+
+    /* only the reference interpreter feeds the cache simulator and the
+     * timing model */
+    switch (m->cachesim || m->timing ? MACHINE_ENGINE_FSM : m->engine) {
+      case MACHINE_ENGINE_FSM:
+        state = fsm_run(m, run);
+        break;
+
+      case MACHINE_ENGINE_JIT:
+        /* translated code isn't instrumented */
+        state = m->perf || m->trace ? interp_run(m, run) : jit_run(m, run);
+        break;
+
+      default:
+        state = interp_run(m, run);
+        break;
+    }
+
+    if (m->profile)
+      profile_tick(m);
+
+    if (limit != UINT64_MAX)
+      limit -= m->instret - start;
+  }
+
+  switch (state) {
+    case STATE_HALT:
+      return MACHINE_EXIT_HALT;
+
+    case STATE_BREAK:
+      return MACHINE_EXIT_BREAK;
+
+    case STATE_ERROR:
+      return MACHINE_EXIT_ERROR;
+  }
+
+  return MACHINE_EXIT_LIMIT;
+}
@@ -1,8 +1,357 @@
-#include "core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "cachesim.h"
+#include "dma.h"
+#include "gdb.h"
+#include "icache.h"
+#include "intc.h"
+#include "jit.h"
+#include "loader.h"
+#include "perf.h"
+#include "profile.h"
+#include "replay.h"
+#include "smp.h"
+#include "spi.h"
+#include "timing.h"
+#include "trace.h"
+#include "uart.h"
+#include "machine.h"
+
+/* Size with an optional k, M or G suffix */
+static bool parse_size(const char *arg, uint64_t *size)
+{
+  char *end;
+  uint64_t value = strtoull(arg, &end, 0);
+
+  switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+    case 'g': case 'G': value <<= 30; end++; break;
+  }
+
+  if (end == arg || *end)
+    return false;
+
+  *size = value;
+  return true;
+}
+
+/* Instructions, or microseconds of host time with a us, ms or s suffix */
+static bool parse_interval(const char *arg, uint64_t *interval, uint8_t *mode)
+{
+  char *end;
+  uint64_t value = strtoull(arg, &end, 0);
+
+  *mode = PROFILE_HOST_TIME;
+  if (!strcmp(end, "ms")) {
+    value *= 1000;
+  } else if (!strcmp(end, "s")) {
+    value *= 1000000;
+  } else if (!*end) {
+    *mode = PROFILE_INSTRUCTIONS;
+  } else if (strcmp(end, "us")) {
+    return false;
+  }
+
+  if (end == arg || !value)
+    return false;
+
+  *interval = value;
+  return true;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-m fsm|fast|jit] [-M size] [-l address] [-e entry] [-d disk [-w]] [-s] [-p text|json] [-C caches] [-T timing] [-t trace] [-f profile [-F interval]] [-r|-R log] [-g address] [-c harts] [image]\n", prog);
+  fprintf(stderr, "  -m  execution mode: fast interpreter (default), reference fsm\n");
+  fprintf(stderr, "      or jit (x86-64 basic block translation)\n");
+  fprintf(stderr, "  -M  system memory size, e.g. 64M or 1G (default 16M)\n");
+  fprintf(stderr, "  -l  load address of raw images (default 0x%x)\n", LOADER_DEFAULT_ADDRESS);
+  fprintf(stderr, "  -e  entry point, overrides the one in the image\n");
+  fprintf(stderr, "  -d  disk image for the SPI block device\n");
+  fprintf(stderr, "  -w  write disk sectors through to the image immediately\n");
+  fprintf(stderr, "  -b  let the guest wait for the console instead of dropping output\n");
+  fprintf(stderr, "      the host doesn't take in time\n");
+  fprintf(stderr, "  -s  print execution statistics on exit\n");
+  fprintf(stderr, "  -p  print a guest performance report on exit, needs a build\n");
+  fprintf(stderr, "      configured with --enable-perf-counters\n");
+  fprintf(stderr, "  -C  simulate the guest's caches and print hit and miss rates per\n");
+  fprintf(stderr, "      level and PC on exit, \"default\" or e.g. l1d=16k:4,l2=256k:8:128:plru\n");
+  fprintf(stderr, "      (level=size[:ways[:line size[:lru|plru]]])\n");
+  fprintf(stderr, "  -T  estimate cycles with a pipeline timing model and print them\n");
+  fprintf(stderr, "      on exit, \"default\" or e.g. predictor=bimodal,lw=3,uart0=50\n");
+  fprintf(stderr, "  -t  record an execution trace, see emulator-trace\n");
+  fprintf(stderr, "  -f  write a sampling profile of the guest call stacks in folded\n");
+  fprintf(stderr, "      format, e.g. for flamegraph.pl\n");
+  fprintf(stderr, "  -F  profile every N instructions (default %u), or every N us, ms\n", PROFILE_DEFAULT_INTERVAL);
+  fprintf(stderr, "      or s of host time\n");
+  fprintf(stderr, "  -r  record device input to a log\n");
+  fprintf(stderr, "  -R  replay device input from a log written with -r, console\n");
+  fprintf(stderr, "      input is ignored\n");
+  fprintf(stderr, "  -g  wait for GDB on host:port, :port or a unix socket path\n");
+  fprintf(stderr, "  -c  number of harts, each one runs on its own host thread\n");
+  fprintf(stderr, "Raw binaries and 32 bit ELF images are accepted, without an image\n");
+  fprintf(stderr, "the built-in demo program is run.\n");
+}
 
 int main(int argc, char *argv[])
 {
-  core_init();
+  bool print_stats = false;
+  uint8_t console_flags = 0;
+  int perf_format = -1;
+  uint8_t engine = MACHINE_ENGINE_FAST;
+  uint32_t load_address = LOADER_DEFAULT_ADDRESS;
+  uint64_t memory_size = MMIO_SYSTEM_MEMORY_SIZE;
+  uint64_t value;
+  struct Machine *m;
+  uint8_t reason;
+  uint8_t disk_sync = SPI_SYNC_WRITE_BACK;
+  const char *disk = NULL;
+  const char *trace = NULL;
+  const char *profile = NULL;
+  struct CacheSimConfig caches;
+  bool simulate_caches = false;
+  struct TimingConfig timing;
+  bool estimate_timing = false;
+  uint64_t profile_interval = PROFILE_DEFAULT_INTERVAL;
+  uint8_t profile_mode = PROFILE_INSTRUCTIONS;
+  const char *replay = NULL;
+  const char *gdb = NULL;
+  bool replaying = false;
+  bool entry_set = false;
+  uint32_t entry = 0;
+  uint32_t harts = 1;
+  int opt;
+
+  cachesim_default_config(&caches);
+  timing_default_config(&timing);
+  while ((opt = getopt(argc, argv, "m:M:l:e:d:wbsp:C:T:t:f:F:r:R:g:c:h")) != -1) {
+    switch (opt) {
+      case 'm':
+        if (!strcmp(optarg, "fsm")) {
+          engine = MACHINE_ENGINE_FSM;
+        } else if (!strcmp(optarg, "fast")) {
+          engine = MACHINE_ENGINE_FAST;
+        } else if (!strcmp(optarg, "jit")) {
+          engine = MACHINE_ENGINE_JIT;
+        } else {
+          fprintf(stderr, "Unknown mode: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'M':
+        if (!parse_size(optarg, &memory_size)) {
+          fprintf(stderr, "Invalid memory size: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'l':
+      case 'e':
+        if (!parse_size(optarg, &value) || value > UINT32_MAX) {
+          fprintf(stderr, "Invalid address: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+
+        if (opt == 'l') {
+          load_address = value;
+        } else {
+          entry = value;
+          entry_set = true;
+        }
+        break;
+
+      case 'd':
+        disk = optarg;
+        break;
+
+      case 'w':
+        disk_sync = SPI_SYNC_WRITE_THROUGH;
+        break;
+
+      case 'b':
+        console_flags = UART_ATTACH_BLOCKING;
+        break;
+
+      case 's':
+        print_stats = true;
+        break;
+
+      case 'p':
+        if (!strcmp(optarg, "text")) {
+          perf_format = PERF_REPORT_TEXT;
+        } else if (!strcmp(optarg, "json")) {
+          perf_format = PERF_REPORT_JSON;
+        } else {
+          fprintf(stderr, "Unknown report format: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'C':
+        if (!cachesim_parse_config(optarg, &caches))
+          return EXIT_FAILURE;
+        simulate_caches = true;
+        break;
+
+      case 'T':
+        if (!timing_parse_config(optarg, &timing))
+          return EXIT_FAILURE;
+        estimate_timing = true;
+        break;
+
+      case 't':
+        trace = optarg;
+        break;
+
+      case 'f':
+        profile = optarg;
+        break;
+
+      case 'F':
+        if (!parse_interval(optarg, &profile_interval, &profile_mode)) {
+          fprintf(stderr, "Invalid sampling interval: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'r':
+      case 'R':
+        replay = optarg;
+        replaying = opt == 'R';
+        break;
+
+      case 'g':
+        gdb = optarg;
+        break;
+
+      case 'c':
+        if (!parse_size(optarg, &value) || value < 1 || value > SMP_MAX_HARTS) {
+          fprintf(stderr, "Invalid number of harts: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        harts = value;
+        break;
+
+      case 'h':
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind > 1) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (harts > 1 && gdb) {
+    fprintf(stderr, "The GDB stub needs a single hart\n");
+    return EXIT_FAILURE;
+  }
+
+  m = machine_create(memory_size);
+  if (!m)
+    return EXIT_FAILURE;
+  m->engine = engine;
+
+  if (optind < argc && !machine_load(m, argv[optind], load_address)) {
+    machine_destroy(m);
+    return EXIT_FAILURE;
+  }
+
+  if (disk && !spi_attach(m, disk, disk_sync)) {
+    machine_destroy(m);
+    return EXIT_FAILURE;
+  }
+
+  if (perf_format >= 0 && !perf_enable(m)) {
+    machine_destroy(m);
+    return EXIT_FAILURE;
+  }
+
+  if (simulate_caches && !cachesim_start(m, &caches)) {
+    machine_destroy(m);
+    return EXIT_FAILURE;
+  }
+
+  if (estimate_timing && !timing_start(m, &timing)) {
+    machine_destroy(m);
+    return EXIT_FAILURE;
+  }
+
+  if (trace && !trace_start(m, trace)) {
+    machine_destroy(m);
+    return EXIT_FAILURE;
+  }
+
+  if (profile && (!profile_start(m, profile, profile_mode, profile_interval)
+                  || (optind < argc && !profile_load_symbols(m, argv[optind])))) {
+    machine_destroy(m);
+    return EXIT_FAILURE;
+  }
+
+  if (replay && !(replaying ? replay_play(m, replay) : replay_record(m, replay))) {
+    machine_destroy(m);
+    return EXIT_FAILURE;
+  }
+
+  if (entry_set)
+    regfile_write(m, REGISTER_PC, entry);
+
+  uart_attach(m, 0, replaying ? -1 : STDIN_FILENO, STDOUT_FILENO, console_flags);
+
+  if (!smp_start(m, harts)) {
+    machine_destroy(m);
+    return EXIT_FAILURE;
+  }
+
+  switch (gdb ? gdb_serve(m, gdb) : GDB_DETACHED) {
+    case GDB_DETACHED:
+      reason = smp_run(m, MACHINE_RUN_UNLIMITED);
+      break;
+
+    case GDB_EXITED:
+      reason = MACHINE_EXIT_HALT;
+      break;
+
+    default:
+      machine_destroy(m);
+      return EXIT_FAILURE;
+  }
+  if (reason == MACHINE_EXIT_BREAK)
+    fprintf(stderr, "Break\n");
+
+  if (print_stats) {
+    uart_flush(m);
+    icache_dump_stats(m);
+    jit_dump_stats(m);
+    uart_dump_stats(m);
+    spi_dump_stats(m);
+    intc_dump_stats(m);
+    dma_dump_stats(m);
+  }
+
+  if (perf_format >= 0) {
+    uart_flush(m);
+    perf_report(m, stderr, perf_format);
+  }
+
+  if (simulate_caches) {
+    uart_flush(m);
+    cachesim_report(m, stderr);
+  }
+
+  if (estimate_timing) {
+    uart_flush(m);
+    timing_report(m, stderr);
+  }
 
-  while (fsm_cycle_state());
+  machine_destroy(m);
+  return reason == MACHINE_EXIT_ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,227 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "rscs.h"
+#include "core.h"
+#include "perf.h"
+#include "machine.h"
+
+const char *perf_block_names[PERF_BLOCKS] = {
+  "arithmetic", "memory", "branch", "register", "atomic", "plh_5", "plh_6", "control",
+};
+
+const char *perf_opcode_names[PERF_BLOCKS][PERF_OPCODES] = {
+  [BLOCK_ARITHMETIC] = { "add", "sub", "shl", "shr", "and", "or", "not", "xor" },
+  [BLOCK_MEMORY] = { "lb", "lhw", "lw", "sb", "shw", "sw" },
+  [BLOCK_BRANCH] = { "br", "beq", "blt", "ble", "bgt", "bge", "cmp" },
+  [BLOCK_ATOMIC] = { "swap", "cas", "fadd", "fence", "hartid" },
+  [BLOCK_CONTROL] = { [OPCODE_BRK] = "brk", [OPCODE_WFI] = "wfi", [OPCODE_EI] = "ei",
+                     [OPCODE_DI] = "di", [OPCODE_IRET] = "iret", [OPCODE_HALT] = "hlt" },
+};
+
+const char *perf_device_names[VIRT_UNKNOWN + 1] = {
+  [VIRT_RESERVED] = "reserved",
+  [VIRT_SPI0] = "spi0",
+  [VIRT_UART0] = "uart0",
+  [VIRT_UART1] = "uart1",
+  [VIRT_UART2] = "uart2",
+  [VIRT_UART3] = "uart3",
+  [VIRT_INTC] = "intc",
+  [VIRT_TIMER] = "timer",
+  [VIRT_DMA] = "dma",
+  [VIRT_DRAM] = "dram",
+  [VIRT_UNKNOWN] = "unmapped",
+};
+
+bool perf_enable(struct Machine *m)
+{
+#ifdef ENABLE_PERF_COUNTERS
+  struct Perf *perf;
+  void *histogram;
+
+  if (m->perf)
+    return true;
+
+  perf = calloc(1, sizeof(*perf));
+  if (!perf) {
+    perror("perf_enable");
+    return false;
+  }
+
+  /* like system memory, only the pages of executed code get committed */
+  histogram = mmap(NULL, (uint64_t)m->memory.size / SIZE_WORD * sizeof(uint64_t),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (histogram == MAP_FAILED) {
+    perror("perf_enable");
+    free(perf);
+    return false;
+  }
+
+  perf->pc_histogram = histogram;
+  perf->pc_histogram_size = m->memory.size;
+  m->perf = perf;
+  return true;
+#else
+  fprintf(stderr, "%s: Built without --enable-perf-counters\n", __FUNCTION__);
+  return false;
+#endif
+}
+
+void perf_disable(struct Machine *m)
+{
+  struct Perf *perf = m->perf;
+
+  if (!perf)
+    return;
+
+  munmap(perf->pc_histogram, (uint64_t)perf->pc_histogram_size / SIZE_WORD * sizeof(uint64_t));
+  free(perf);
+  m->perf = NULL;
+}
+
+static const char *perf_opcode_name(uint8_t block, uint8_t opcode, char *buffer)
+{
+  if (perf_opcode_names[block][opcode])
+    return perf_opcode_names[block][opcode];
+
+  sprintf(buffer, "op%u", opcode);
+  return buffer;
+}
+
+/* Indices of the hottest PCs, count of them returned */
+static uint32_t perf_top_pcs(const struct Perf *perf, uint32_t *top, uint32_t max)
+{
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < perf->pc_histogram_size / SIZE_WORD; i++) {
+    uint64_t hits = perf->pc_histogram[i];
+    uint32_t j;
+
+    if (!hits || (count == max && hits <= perf->pc_histogram[top[count - 1]]))
+      continue;
+
+    if (count < max)
+      count++;
+
+    for (j = count - 1; j > 0 && perf->pc_histogram[top[j - 1]] < hits; j--)
+      top[j] = top[j - 1];
+    top[j] = i;
+  }
+
+  return count;
+}
+
+static void perf_report_text(struct Machine *m, const struct Perf *perf, FILE *out)
+{
+  uint32_t top[PERF_REPORT_TOP_PCS];
+  uint64_t total = 0;
+  uint64_t branches = perf->branches_taken + perf->branches_not_taken;
+  uint32_t count;
+  char name[8];
+
+  for (int block = 0; block < PERF_BLOCKS; block++)
+    for (int opcode = 0; opcode < PERF_OPCODES; opcode++)
+      total += perf->instructions[block][opcode];
+
+  fprintf(out, "instructions: %lu\n", (unsigned long)total);
+  for (int block = 0; block < PERF_BLOCKS; block++) {
+    uint64_t block_total = 0;
+
+    for (int opcode = 0; opcode < PERF_OPCODES; opcode++)
+      block_total += perf->instructions[block][opcode];
+
+    if (!block_total)
+      continue;
+
+    fprintf(out, "  %-10s %14lu %6.2f%%\n", perf_block_names[block], (unsigned long)block_total,
+            100.0 * block_total / total);
+    for (int opcode = 0; opcode < PERF_OPCODES; opcode++) {
+      uint64_t hits = perf->instructions[block][opcode];
+
+      if (hits)
+        fprintf(out, "    %-8s %14lu %6.2f%%\n", perf_opcode_name(block, opcode, name),
+                (unsigned long)hits, 100.0 * hits / total);
+    }
+  }
+
+  fprintf(out, "branches: %lu taken, %lu not taken (%.2f%% taken)\n",
+          (unsigned long)perf->branches_taken, (unsigned long)perf->branches_not_taken,
+          branches ? 100.0 * perf->branches_taken / branches : 0.0);
+
+  fprintf(out, "memory accesses:\n");
+  for (int device = 0; device <= VIRT_UNKNOWN; device++) {
+    if (perf->reads[device] || perf->writes[device])
+      fprintf(out, "  %-10s %14lu reads %14lu writes\n", perf_device_names[device],
+              (unsigned long)perf->reads[device], (unsigned long)perf->writes[device]);
+  }
+
+  count = perf_top_pcs(perf, top, PERF_REPORT_TOP_PCS);
+  fprintf(out, "hottest instructions:\n");
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t hits = perf->pc_histogram[top[i]];
+
+    fprintf(out, "  0x%08x %14lu %6.2f%%\n", top[i] * SIZE_WORD + MMIO_SYSTEM_MEMORY_START,
+            (unsigned long)hits, 100.0 * hits / total);
+  }
+}
+
+static void perf_report_json(struct Machine *m, const struct Perf *perf, FILE *out)
+{
+  const char *separator = "";
+  char name[8];
+
+  fprintf(out, "{\n  \"instructions\": {");
+  for (int block = 0; block < PERF_BLOCKS; block++) {
+    for (int opcode = 0; opcode < PERF_OPCODES; opcode++) {
+      if (!perf->instructions[block][opcode])
+        continue;
+
+      fprintf(out, "%s\n    \"%s.%s\": %lu", separator, perf_block_names[block],
+              perf_opcode_name(block, opcode, name),
+              (unsigned long)perf->instructions[block][opcode]);
+      separator = ",";
+    }
+  }
+
+  fprintf(out, "\n  },\n  \"branches\": { \"taken\": %lu, \"not_taken\": %lu },\n",
+          (unsigned long)perf->branches_taken, (unsigned long)perf->branches_not_taken);
+
+  fprintf(out, "  \"devices\": {");
+  separator = "";
+  for (int device = 0; device <= VIRT_UNKNOWN; device++) {
+    if (!perf->reads[device] && !perf->writes[device])
+      continue;
+
+    fprintf(out, "%s\n    \"%s\": { \"reads\": %lu, \"writes\": %lu }", separator,
+            perf_device_names[device], (unsigned long)perf->reads[device],
+            (unsigned long)perf->writes[device]);
+    separator = ",";
+  }
+
+  /* the whole histogram, sorting is up to the consumer */
+  fprintf(out, "\n  },\n  \"pc_histogram\": {");
+  separator = "";
+  for (uint32_t i = 0; i < perf->pc_histogram_size / SIZE_WORD; i++) {
+    if (!perf->pc_histogram[i])
+      continue;
+
+    fprintf(out, "%s\n    \"0x%08x\": %lu", separator, i * SIZE_WORD + MMIO_SYSTEM_MEMORY_START,
+            (unsigned long)perf->pc_histogram[i]);
+    separator = ",";
+  }
+  fprintf(out, "\n  }\n}\n");
+}
+
+void perf_report(struct Machine *m, FILE *out, uint8_t format)
+{
+  if (!m->perf)
+    return;
+
+  if (format == PERF_REPORT_JSON)
+    perf_report_json(m, m->perf, out);
+  else
+    perf_report_text(m, m->perf, out);
+}
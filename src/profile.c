@@ -0,0 +1,449 @@
+#include <elf.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "profile.h"
+#include "machine.h"
+
+bool profile_start(struct Machine *m, const char *path, uint8_t mode, uint64_t interval)
+{
+  struct Profile *profile;
+
+  if (m->profile)
+    profile_stop(m);
+
+  if (!interval) {
+    fprintf(stderr, "%s: Sampling interval must not be 0\n", __FUNCTION__);
+    return false;
+  }
+
+  profile = calloc(1, sizeof(*profile));
+  if (!profile) {
+    perror("profile_start");
+    return false;
+  }
+
+  profile->out = fopen(path, "w");
+  if (!profile->out) {
+    perror(path);
+    free(profile);
+    return false;
+  }
+
+  profile->path = strdup(path);
+  profile->mode = mode;
+  profile->interval = interval;
+  profile->next = m->instret + (mode == PROFILE_INSTRUCTIONS ? interval : PROFILE_POLL_INSTRUCTIONS);
+  clock_gettime(CLOCK_MONOTONIC, &profile->last);
+  m->profile = profile;
+  return true;
+}
+
+/* Symbols */
+
+static int profile_compare_symbols(const void *a, const void *b)
+{
+  const struct ProfileSymbol *x = a;
+  const struct ProfileSymbol *y = b;
+
+  return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static bool profile_read(int fd, void *dst, uint64_t offset, uint64_t size)
+{
+  return pread(fd, dst, size, offset) == (ssize_t)size;
+}
+
+static bool profile_read_symbols(struct Profile *profile, int fd)
+{
+  Elf32_Ehdr ehdr;
+  Elf32_Shdr *sections = NULL;
+  Elf32_Sym *symbols = NULL;
+  char *names = NULL;
+  bool ret = false;
+
+  if (!profile_read(fd, &ehdr, 0, sizeof(ehdr)) || memcmp(ehdr.e_ident, ELFMAG, SELFMAG))
+    return true; // raw image
+  if (ehdr.e_ident[EI_CLASS] != ELFCLASS32 || ehdr.e_shentsize != sizeof(Elf32_Shdr)
+      || !ehdr.e_shnum)
+    return true;
+
+  sections = calloc(ehdr.e_shnum, sizeof(*sections));
+  if (!sections || !profile_read(fd, sections, ehdr.e_shoff, ehdr.e_shnum * sizeof(*sections)))
+    goto out;
+
+  for (int i = 0; i < ehdr.e_shnum; i++) {
+    Elf32_Shdr *symtab = &sections[i];
+    Elf32_Shdr *strtab;
+    uint32_t count;
+
+    if (symtab->sh_type != SHT_SYMTAB || symtab->sh_link >= ehdr.e_shnum)
+      continue;
+
+    strtab = &sections[symtab->sh_link];
+    count = symtab->sh_size / sizeof(Elf32_Sym);
+    symbols = malloc(symtab->sh_size);
+    names = malloc(strtab->sh_size + 1);
+    profile->symbols = calloc(count, sizeof(*profile->symbols));
+    if (!symbols || !names || !profile->symbols
+        || !profile_read(fd, symbols, symtab->sh_offset, symtab->sh_size)
+        || !profile_read(fd, names, strtab->sh_offset, strtab->sh_size))
+      goto out;
+    names[strtab->sh_size] = 0;
+
+    for (uint32_t j = 0; j < count; j++) {
+      Elf32_Sym *sym = &symbols[j];
+      uint8_t type = ELF32_ST_TYPE(sym->st_info);
+      struct ProfileSymbol *symbol;
+
+      if (!sym->st_name || sym->st_name >= strtab->sh_size
+          || sym->st_shndx == SHN_UNDEF || sym->st_shndx >= ehdr.e_shnum)
+        continue;
+
+      /* assemblers leave labels untyped, take the global ones in code */
+      if (type != STT_FUNC
+          && !(type == STT_NOTYPE && ELF32_ST_BIND(sym->st_info) == STB_GLOBAL
+               && sections[sym->st_shndx].sh_flags & SHF_EXECINSTR))
+        continue;
+
+      symbol = &profile->symbols[profile->symbol_count];
+      symbol->address = sym->st_value;
+      symbol->size = sym->st_size;
+      symbol->name = strdup(names + sym->st_name);
+      if (!symbol->name)
+        goto out;
+      profile->symbol_count++;
+    }
+    break;
+  }
+
+  qsort(profile->symbols, profile->symbol_count, sizeof(*profile->symbols),
+        profile_compare_symbols);
+  ret = true;
+
+out:
+  if (!ret)
+    fprintf(stderr, "%s: Failed to read the symbol table\n", __FUNCTION__);
+  free(sections);
+  free(symbols);
+  free(names);
+  return ret;
+}
+
+bool profile_load_symbols(struct Machine *m, const char *path)
+{
+  bool ret;
+  int fd;
+
+  if (!m->profile)
+    return true;
+
+  for (uint32_t i = 0; i < m->profile->symbol_count; i++)
+    free(m->profile->symbols[i].name);
+  free(m->profile->symbols);
+  m->profile->symbols = NULL;
+  m->profile->symbol_count = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+
+  ret = profile_read_symbols(m->profile, fd);
+  close(fd);
+  return ret;
+}
+
+static struct ProfileSymbol *profile_find_symbol(struct Profile *profile, uint32_t address)
+{
+  uint32_t low = 0;
+  uint32_t high = profile->symbol_count;
+  struct ProfileSymbol *symbol;
+
+  /* last symbol starting at or below the address */
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+
+    if (profile->symbols[middle].address <= address)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  if (!low)
+    return NULL;
+
+  symbol = &profile->symbols[low - 1];
+  if (symbol->size && address - symbol->address >= symbol->size)
+    return NULL;
+  return symbol;
+}
+
+/* Frames are kept as the start of the function holding them */
+static uint32_t profile_frame(struct Profile *profile, uint32_t address)
+{
+  struct ProfileSymbol *symbol = profile_find_symbol(profile, address);
+
+  return symbol ? symbol->address : address;
+}
+
+/* Sampling */
+
+static bool profile_read_word(struct Machine *m, uint32_t address, uint32_t *value)
+{
+  uint32_t offset = address - MMIO_SYSTEM_MEMORY_START;
+  uint32_t word;
+
+  if (address < MMIO_SYSTEM_MEMORY_START || address % SIZE_WORD
+      || offset > m->memory.size - SIZE_WORD)
+    return false;
+
+  memcpy(&word, m->memory.base + offset, sizeof(word));
+  *value = le32toh(word);
+  return true;
+}
+
+static bool profile_is_code(struct Machine *m, uint32_t address)
+{
+  return address >= MMIO_SYSTEM_MEMORY_START
+      && address - MMIO_SYSTEM_MEMORY_START < m->memory.size;
+}
+
+static uint32_t profile_walk(struct Machine *m, uint32_t *frames)
+{
+  struct Profile *profile = m->profile;
+  uint32_t fp = regfile_read(m, REGISTER_FP);
+  uint32_t lr = regfile_read(m, REGISTER_LR);
+  uint32_t saved_lr = 0;
+  uint32_t depth = 0;
+
+  frames[depth++] = profile_frame(profile, regfile_read(m, REGISTER_PC));
+
+  /* return addresses are attributed to the call before them */
+  profile_read_word(m, fp + SIZE_WORD, &saved_lr);
+  if (lr != saved_lr && profile_is_code(m, lr)
+      && profile_frame(profile, lr - SIZE_WORD) != frames[0])
+    frames[depth++] = profile_frame(profile, lr - SIZE_WORD);
+
+  while (fp && depth < PROFILE_MAX_DEPTH) {
+    uint32_t caller_fp;
+    uint32_t ret;
+
+    if (!profile_read_word(m, fp, &caller_fp) || !profile_read_word(m, fp + SIZE_WORD, &ret)
+        || !profile_is_code(m, ret))
+      break;
+
+    frames[depth++] = profile_frame(profile, ret - SIZE_WORD);
+    if (caller_fp == fp)
+      break;
+    fp = caller_fp;
+  }
+
+  return depth;
+}
+
+static uint64_t profile_hash(const uint32_t *frames, uint32_t depth)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (uint32_t i = 0; i < depth; i++) {
+    hash ^= frames[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash ^ depth;
+}
+
+static bool profile_grow(struct Profile *profile)
+{
+  uint32_t slots = profile->stack_slots ? profile->stack_slots * 2 : 1024;
+  struct ProfileStack *stacks = calloc(slots, sizeof(*stacks));
+
+  if (!stacks)
+    return false;
+
+  for (uint32_t i = 0; i < profile->stack_slots; i++) {
+    struct ProfileStack *stack = &profile->stacks[i];
+    uint32_t slot = stack->hash & (slots - 1);
+
+    if (!stack->depth)
+      continue;
+
+    while (stacks[slot].depth)
+      slot = (slot + 1) & (slots - 1);
+    stacks[slot] = *stack;
+  }
+
+  free(profile->stacks);
+  profile->stacks = stacks;
+  profile->stack_slots = slots;
+  return true;
+}
+
+static bool profile_add(struct Profile *profile, const uint32_t *frames, uint32_t depth)
+{
+  uint64_t hash = profile_hash(frames, depth);
+  struct ProfileStack *stack;
+  uint32_t slot;
+
+  /* at most half full */
+  if (profile->stack_count * 2 >= profile->stack_slots && !profile_grow(profile))
+    return false;
+
+  slot = hash & (profile->stack_slots - 1);
+  for (;;) {
+    stack = &profile->stacks[slot];
+    if (!stack->depth)
+      break;
+
+    if (stack->hash == hash && stack->depth == depth
+        && !memcmp(&profile->frames[stack->frame], frames, depth * sizeof(*frames))) {
+      stack->count++;
+      return true;
+    }
+    slot = (slot + 1) & (profile->stack_slots - 1);
+  }
+
+  if (profile->frame_count + depth > profile->frame_capacity) {
+    uint32_t capacity = profile->frame_capacity ? profile->frame_capacity * 2 : 16384;
+    uint32_t *grown = realloc(profile->frames, capacity * sizeof(*grown));
+
+    if (!grown)
+      return false;
+    profile->frames = grown;
+    profile->frame_capacity = capacity;
+  }
+
+  memcpy(&profile->frames[profile->frame_count], frames, depth * sizeof(*frames));
+  stack->hash = hash;
+  stack->count = 1;
+  stack->frame = profile->frame_count;
+  stack->depth = depth;
+  profile->frame_count += depth;
+  profile->stack_count++;
+  return true;
+}
+
+uint64_t profile_limit(struct Machine *m, uint64_t run)
+{
+  struct Profile *profile = m->profile;
+  uint64_t period = profile->mode == PROFILE_INSTRUCTIONS ? profile->interval
+                                                           : PROFILE_POLL_INSTRUCTIONS;
+
+  /* the machine was reset since */
+  if (profile->next <= m->instret || profile->next - m->instret > period)
+    profile->next = m->instret + period;
+
+  return profile->next - m->instret < run ? profile->next - m->instret : run;
+}
+
+void profile_tick(struct Machine *m)
+{
+  struct Profile *profile = m->profile;
+  uint32_t frames[PROFILE_MAX_DEPTH];
+  uint32_t depth;
+
+  if (m->instret < profile->next)
+    return;
+
+  if (profile->mode == PROFILE_HOST_TIME) {
+    struct timespec now;
+    uint64_t elapsed;
+
+    profile->next = m->instret + PROFILE_POLL_INSTRUCTIONS;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - profile->last.tv_sec) * 1000000
+            + (now.tv_nsec - profile->last.tv_nsec) / 1000;
+    if (elapsed < profile->interval)
+      return;
+    profile->last = now;
+  } else {
+    profile->next = m->instret + profile->interval;
+  }
+
+  depth = profile_walk(m, frames);
+  if (profile_add(profile, frames, depth))
+    profile->samples++;
+  else
+    profile->dropped++;
+}
+
+/* Report */
+
+static int profile_compare_stacks(const void *a, const void *b)
+{
+  const struct ProfileStack *x = *(const struct ProfileStack **)a;
+  const struct ProfileStack *y = *(const struct ProfileStack **)b;
+
+  return x->count > y->count ? -1 : x->count < y->count;
+}
+
+static void profile_write_frame(struct Profile *profile, uint32_t frame)
+{
+  struct ProfileSymbol *symbol = profile_find_symbol(profile, frame);
+
+  if (symbol && symbol->address == frame)
+    fputs(symbol->name, profile->out);
+  else
+    fprintf(profile->out, "0x%08x", frame);
+}
+
+static void profile_write(struct Profile *profile)
+{
+  struct ProfileStack **order = calloc(profile->stack_count + 1, sizeof(*order));
+  uint32_t count = 0;
+
+  if (!order) {
+    perror("profile_write");
+    return;
+  }
+
+  for (uint32_t i = 0; i < profile->stack_slots; i++)
+    if (profile->stacks[i].depth)
+      order[count++] = &profile->stacks[i];
+  qsort(order, count, sizeof(*order), profile_compare_stacks);
+
+  /* outermost frame first */
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t *frames = &profile->frames[order[i]->frame];
+
+    for (uint32_t j = order[i]->depth; j--;) {
+      profile_write_frame(profile, frames[j]);
+      fputc(j ? ';' : ' ', profile->out);
+    }
+    fprintf(profile->out, "%lu\n", (unsigned long)order[i]->count);
+  }
+
+  free(order);
+}
+
+/* Write the report and release the profile */
+void profile_stop(struct Machine *m)
+{
+  struct Profile *profile = m->profile;
+
+  if (!profile)
+    return;
+
+  profile_write(profile);
+  if (fclose(profile->out))
+    perror(profile->path);
+  if (profile->dropped)
+    fprintf(stderr, "%s: %lu samples dropped, out of memory\n", __FUNCTION__,
+            (unsigned long)profile->dropped);
+
+  for (uint32_t i = 0; i < profile->symbol_count; i++)
+    free(profile->symbols[i].name);
+  free(profile->symbols);
+  free(profile->stacks);
+  free(profile->frames);
+  free(profile->path);
+  free(profile);
+  m->profile = NULL;
+}
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rscs.h"
+#include "replay.h"
+#include "machine.h"
+
+/* Devices whose reads are logged */
+static const uint8_t replay_sources[] = { VIRT_SPI0, VIRT_UART0, VIRT_UART1, VIRT_UART2, VIRT_UART3 };
+
+static void replay_put_varint(FILE *file, uint64_t value)
+{
+  while (value >= 0x80) {
+    putc_unlocked(value | 0x80, file);
+    value >>= 7;
+  }
+  putc_unlocked(value, file);
+}
+
+static bool replay_get_varint(FILE *file, uint64_t *value)
+{
+  int shift = 0;
+  int byte;
+
+  *value = 0;
+  do {
+    byte = getc_unlocked(file);
+    if (byte == EOF || shift > 63)
+      return false;
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+
+  return true;
+}
+
+/* Read the event the guest asks for next, next_valid is false at the end of the log */
+static void replay_fetch(struct Replay *replay)
+{
+  uint64_t zigzag;
+  uint64_t value;
+  int source;
+
+  replay->next_valid = false;
+  if (!replay_get_varint(replay->file, &zigzag))
+    return;
+
+  source = getc_unlocked(replay->file);
+  if (source == EOF || !replay_get_varint(replay->file, &value))
+    return;
+
+  replay->last_instret += (zigzag >> 1) ^ -(zigzag & 1);
+  replay->next.instret = replay->last_instret;
+  replay->next.source = source;
+  replay->next.value = value;
+  replay->next_valid = true;
+}
+
+/* Polling an idle UART is common, those reads aren't logged. A replayed
+ * UART read without an event at its instruction finds the UART empty. */
+static bool replay_logged(uint8_t source, uint32_t value)
+{
+  return source == VIRT_SPI0 || value != UART_RX_EMPTY;
+}
+
+static uint32_t replay_read(struct Machine *m, uint8_t source, uint32_t address, uint8_t size)
+{
+  struct Replay *replay = m->replay;
+  uint64_t instret = machine_instret(m);
+  uint64_t delta = instret - replay->last_instret;
+  uint32_t value;
+
+  if (replay->mode == REPLAY_RECORD) {
+    value = replay->read[source](m, address, size);
+    if (!replay_logged(source, value))
+      return value;
+
+    replay_put_varint(replay->file, delta << 1 ^ -(delta >> 63));
+    putc_unlocked(source, replay->file);
+    replay_put_varint(replay->file, value);
+    replay->last_instret = instret;
+    replay->events++;
+    return value;
+  }
+
+  if ((!replay->next_valid || replay->next.instret > instret) && source != VIRT_SPI0)
+    return UART_RX_EMPTY;
+
+  if (!replay->next_valid) {
+    fprintf(stderr, "Replay ended at instruction %llu\n", (unsigned long long)instret);
+    regfile_write(m, REGISTER_ERROR, true);
+    return 0;
+  }
+
+  if (replay->next.instret != instret || replay->next.source != source) {
+    fprintf(stderr, "Replay diverged at instruction %llu: device %u read, "
+            "recorded device %u at instruction %llu\n", (unsigned long long)instret, source,
+            replay->next.source, (unsigned long long)replay->next.instret);
+    regfile_write(m, REGISTER_ERROR, true);
+    return 0;
+  }
+
+  value = replay->next.value;
+  replay->events++;
+  replay_fetch(replay);
+  return value;
+}
+
+/* The map entries have no index, one handler per device */
+#define REPLAY_HANDLER(source)                                                             \
+  static uint32_t replay_read_##source(struct Machine *m, uint32_t address, uint8_t size) \
+  {                                                                                       \
+    return replay_read(m, source, address, size);                                        \
+  }
+
+REPLAY_HANDLER(VIRT_SPI0)
+REPLAY_HANDLER(VIRT_UART0)
+REPLAY_HANDLER(VIRT_UART1)
+REPLAY_HANDLER(VIRT_UART2)
+REPLAY_HANDLER(VIRT_UART3)
+
+static const MMIO_DEVICE_READ replay_handlers[VIRT_UNKNOWN + 1] = {
+  [VIRT_SPI0] = replay_read_VIRT_SPI0,
+  [VIRT_UART0] = replay_read_VIRT_UART0,
+  [VIRT_UART1] = replay_read_VIRT_UART1,
+  [VIRT_UART2] = replay_read_VIRT_UART2,
+  [VIRT_UART3] = replay_read_VIRT_UART3,
+};
+
+void replay_hook_devices(struct Machine *m)
+{
+  struct Replay *replay = m->replay;
+  uint8_t i;
+
+  for (i = 0; i < sizeof(replay_sources); i++) {
+    uint8_t source = replay_sources[i];
+
+    if (m->mmio_map[source].read != replay_handlers[source]) {
+      replay->read[source] = m->mmio_map[source].read;
+      m->mmio_map[source].read = replay_handlers[source];
+    }
+  }
+}
+
+static bool replay_start(struct Machine *m, const char *path, uint8_t mode)
+{
+  struct ReplayFileHeader header = { REPLAY_MAGIC, REPLAY_VERSION };
+  struct Replay *replay;
+
+  replay_stop(m);
+
+  replay = calloc(1, sizeof(*replay));
+  if (!replay) {
+    perror("replay_start");
+    return false;
+  }
+
+  replay->mode = mode;
+  replay->file = fopen(path, mode == REPLAY_RECORD ? "wb" : "rb");
+  if (!replay->file) {
+    perror(path);
+    free(replay);
+    return false;
+  }
+  setvbuf(replay->file, NULL, _IOFBF, REPLAY_BUFFER_SIZE);
+
+  if (mode == REPLAY_RECORD) {
+    if (fwrite(&header, sizeof(header), 1, replay->file) != 1) {
+      perror(path);
+      fclose(replay->file);
+      free(replay);
+      return false;
+    }
+  } else {
+    if (fread(&header, sizeof(header), 1, replay->file) != 1 ||
+        memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) ||
+        header.version != REPLAY_VERSION) {
+      fprintf(stderr, "%s: Not an input log\n", path);
+      fclose(replay->file);
+      free(replay);
+      return false;
+    }
+    replay_fetch(replay);
+  }
+
+  m->replay = replay;
+  replay_hook_devices(m);
+  return true;
+}
+
+/* Log the input of every following run */
+bool replay_record(struct Machine *m, const char *path)
+{
+  return replay_start(m, path, REPLAY_RECORD);
+}
+
+/* Feed the input logged by replay_record() to the following runs, the
+ * machine has to be in the state recording started from */
+bool replay_play(struct Machine *m, const char *path)
+{
+  return replay_start(m, path, REPLAY_PLAYBACK);
+}
+
+void replay_stop(struct Machine *m)
+{
+  struct Replay *replay = m->replay;
+  uint8_t i;
+
+  if (!replay)
+    return;
+
+  for (i = 0; i < sizeof(replay_sources); i++) {
+    uint8_t source = replay_sources[i];
+
+    if (m->mmio_map[source].read == replay_handlers[source])
+      m->mmio_map[source].read = replay->read[source];
+  }
+
+  if (fclose(replay->file) && replay->mode == REPLAY_RECORD)
+    fprintf(stderr, "%s: Input log is incomplete\n", __FUNCTION__);
+
+  free(replay);
+  m->replay = NULL;
+}
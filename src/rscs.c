@@ -1,24 +1,84 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "rscs.h"
+#include "dma.h"
+#include "icache.h"
+#include "intc.h"
+#include "jit.h"
+#include "smp.h"
+#include "spi.h"
+#include "timer.h"
+#include "uart.h"
+#include "machine.h"
+
+/* Guest memory is little endian, aligned accesses are single host loads and stores */
+static inline uint32_t host_load(const uint8_t *ptr, uint8_t size)
+{
+  uint32_t word;
+  uint16_t hword;
+
+  switch (size) {
+    case SIZE_WORD:
+      memcpy(&word, ptr, sizeof(word));
+      return le32toh(word);
 
-struct Regfile regfile;
-struct SystemMemory memory;
+    case SIZE_HWORD:
+      memcpy(&hword, ptr, sizeof(hword));
+      return le16toh(hword);
+
+    case SIZE_BYTE:
+      return *ptr;
+  }
+
+  return 0;
+}
+
+static inline void host_store(uint8_t *ptr, uint32_t data, uint8_t size)
+{
+  uint32_t word;
+  uint16_t hword;
+
+  switch (size) {
+    case SIZE_WORD:
+      word = htole32(data);
+      memcpy(ptr, &word, sizeof(word));
+      break;
+
+    case SIZE_HWORD:
+      hword = htole16(data);
+      memcpy(ptr, &hword, sizeof(hword));
+      break;
+
+    case SIZE_BYTE:
+      *ptr = data;
+      break;
+  }
+}
     
-void regfile_init()
+void regfile_init(struct Machine *m)
 {
+  struct Regfile *regfile = &m->regfile;
+
   for (int i = 0; i < END_GP_REGISTERS; i++)
-    regfile.gp_registers[i] = 0;
+    regfile->gp_registers[i] = 0;
 
-  regfile.gp_registers[REGISTER_PC] = MMIO_SYSTEM_MEMORY_START;
+  regfile->gp_registers[REGISTER_PC] = MMIO_SYSTEM_MEMORY_START;
   
-  regfile.ctrl_regs.ctrl_brk = 0;
-  regfile.ctrl_regs.ctrl_err = 0;
-  regfile.ctrl_regs.ctrl_hlt = 0;
+  regfile->ctrl_regs.ctrl_brk = 0;
+  regfile->ctrl_regs.ctrl_err = 0;
+  regfile->ctrl_regs.ctrl_hlt = 0;
+  regfile->ctrl_regs.ctrl_evt = 0;
 
-  regfile.status_regs.status_if = 0;
-  regfile.status_regs.status_nf = 0;
-  regfile.status_regs.status_zf = 0;
+  regfile->status_regs.status_if = 0;
+  regfile_compare(regfile, 1, 0);
 }
 
 const char *regnames[] = {
@@ -27,36 +87,38 @@ const char *regnames[] = {
     "r18", "r19", "r20", "r21", "r22", "r23", "r24", "r25", "r26", "r27",
 };
 
-void regfile_dump_registers()
+void regfile_dump_registers(struct Machine *m)
 {
   for (int i = 0; i < END_GP_REGISTERS; i++) {
-    printf("%s: %u %d\n", regnames[i], regfile.gp_registers[i], regfile.gp_registers[i]);
+    printf("%s: %u %d\n", regnames[i], m->regfile.gp_registers[i], m->regfile.gp_registers[i]);
   }
 }
 
-uint32_t regfile_read(uint8_t reg)
+uint32_t regfile_read(struct Machine *m, uint8_t reg)
 {
+  struct Regfile *regfile = &m->regfile;
+
   if (reg < END_GP_REGISTERS)
-    return regfile.gp_registers[reg];
+    return regfile->gp_registers[reg];
 
   switch (reg) {
     case REGISTER_ZF:
-      return regfile.status_regs.status_zf;
+      return regfile_zf(regfile);
       
     case REGISTER_NF:
-      return regfile.status_regs.status_nf;
+      return regfile_nf(regfile);
       
     case REGISTER_IF:
-      return regfile.status_regs.status_if;
+      return regfile->status_regs.status_if;
       
     case REGISTER_HALT:
-      return regfile.ctrl_regs.ctrl_hlt;
+      return regfile->ctrl_regs.ctrl_hlt;
       
     case REGISTER_BREAK:
-      return regfile.ctrl_regs.ctrl_brk;
+      return regfile->ctrl_regs.ctrl_brk;
       
     case REGISTER_ERROR:
-      return regfile.ctrl_regs.ctrl_err;
+      return regfile->ctrl_regs.ctrl_err;
 
     default:
       fprintf(stderr, "%s: Error: Invalid register %u\n", __FUNCTION__, reg);
@@ -65,36 +127,38 @@ uint32_t regfile_read(uint8_t reg)
   return -1;
 }
 
-void regfile_write(uint8_t reg, uint32_t data)
+void regfile_write(struct Machine *m, uint8_t reg, uint32_t data)
 {
+  struct Regfile *regfile = &m->regfile;
+
   if (reg > 0 && reg < END_GP_REGISTERS) {
-    regfile.gp_registers[reg] = data;
+    regfile->gp_registers[reg] = data;
     return;
   }
    
   switch (reg) {
     case REGISTER_ZF:
-      regfile.status_regs.status_zf = data;
+      regfile->status_zero = !data;
       break;
       
     case REGISTER_NF:
-      regfile.status_regs.status_nf = data;
+      regfile->status_sign = data ? -1 : 0;
       break;
       
     case REGISTER_IF:
-      regfile.status_regs.status_if = data;
+      regfile->status_regs.status_if = data;
       break;
       
     case REGISTER_HALT:
-      regfile.ctrl_regs.ctrl_hlt = data;
+      regfile->ctrl_regs.ctrl_hlt = data;
       break;
       
     case REGISTER_BREAK:
-      regfile.ctrl_regs.ctrl_brk = data;
+      regfile->ctrl_regs.ctrl_brk = data;
       break;
       
     case REGISTER_ERROR:
-      regfile.ctrl_regs.ctrl_err = data;
+      regfile->ctrl_regs.ctrl_err = data;
       break;
 
     default:
@@ -103,15 +167,25 @@ void regfile_write(uint8_t reg, uint32_t data)
 }
 
 /* Memory management unit */
-static const struct MmioMapEntry mmio_map[] = {
-  [VIRT_RESERVED] = {0x000, SIZE_BYTE},
-  [VIRT_SPI0] = {0x001, MMIO_SPI_BLOCK_SIZE-1},
-  [VIRT_UART0] = {513, SIZE_BYTE},
-  [VIRT_UART1] = {514, SIZE_BYTE},
-  [VIRT_UART2] = {515, SIZE_BYTE},
-  [VIRT_DRAM] = {516, MMIO_SYSTEM_MEMORY_SIZE}
+static const struct MmioMapEntry mmio_map_template[] = {
+  [VIRT_RESERVED] = {MMIO_RESERVED_NULL, SIZE_BYTE, null_pointer_read_handler, null_pointer_write_handler},
+  [VIRT_SPI0] = {MMIO_SPI_START, MMIO_SPI_BLOCK_SIZE-1, spi_read, spi_write},
+  [VIRT_UART0] = {MMIO_UART_0, SIZE_BYTE, uart0_read, uart0_write},
+  [VIRT_UART1] = {MMIO_UART_1, SIZE_BYTE, uart1_read, uart1_write},
+  [VIRT_UART2] = {MMIO_UART_2, SIZE_BYTE, uart2_read, uart2_write},
+  [VIRT_UART3] = {MMIO_UART_3, SIZE_BYTE, uart3_read, uart3_write},
+  [VIRT_INTC] = {MMIO_INTC_START, MMIO_INTC_SIZE, intc_read, intc_write},
+  [VIRT_TIMER] = {MMIO_TIMER_START, MMIO_TIMER_SIZE, timer_read, timer_write},
+  [VIRT_DMA] = {MMIO_DMA_START, MMIO_DMA_SIZE, dma_read, dma_write},
+  [VIRT_DRAM] = {MMIO_SYSTEM_MEMORY_START, MMIO_SYSTEM_MEMORY_MAX_SIZE, system_memory_read, system_memory_write},
+  [VIRT_UNKNOWN] = {0, 0, invalid_address_read_handler, invalid_address_write_handler},
 };
 
+static uint8_t mmu_page_table[MMU_PAGE_COUNT];
+static uint8_t mmu_shared_pages[MMU_MAX_SHARED_PAGES][MMU_PAGE_SIZE];
+static uint8_t mmu_shared_page_count;
+static pthread_once_t mmu_layout_once = PTHREAD_ONCE_INIT;
+
 bool check_alignment(uint32_t address, uint8_t size)
 {
   uint8_t first_memory_cell = address % MMIO_SYSTEM_MEMORY_ALIGN;
@@ -126,178 +200,507 @@ bool check_alignment(uint32_t address, uint8_t size)
   return retval;
 }
 
-uint8_t mmu_translate_address(uint32_t address, uint8_t size)
+static inline uint8_t mmu_lookup(uint32_t address)
 {
-  /* Check alignememnt */
-  for (int i = 0; i < VIRT_UNKNOWN; i++) {
-    uint32_t base = mmio_map[i].base;
-    uint32_t end = base + mmio_map[i].size;
-    if (address >= base  && address < end)
-      return i;
+  uint8_t device = mmu_page_table[address >> MMU_PAGE_SHIFT];
+
+  if (device & MMU_SHARED_PAGE)
+    device = mmu_shared_pages[device & ~MMU_SHARED_PAGE][address & (MMU_PAGE_SIZE - 1)];
+
+  return device;
+}
+
+uint8_t mmu_translate_address(struct Machine *m, uint32_t address, uint8_t size)
+{
+  uint8_t device = mmu_lookup(address);
+
+  if (device == VIRT_DRAM && address - MMIO_SYSTEM_MEMORY_START > m->memory.size - size)
+    return VIRT_UNKNOWN;
+
+  return device;
+}
+
+void mmu_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size)
+{
+  const struct MmioMapEntry *device = &m->mmio_map[mmu_lookup(address)];
+
+  device->write(m, address - device->base, data, size);
+}
+
+uint32_t mmu_read(struct Machine *m, uint32_t address, uint8_t size)
+{
+  const struct MmioMapEntry *device = &m->mmio_map[mmu_lookup(address)];
+  uint32_t converted_address = address - device->base;
+
+  if (device->host_base && converted_address <= device->size - size)
+    return host_load(device->host_base + converted_address, size);
+
+  return device->read(m, converted_address, size);
+}
+
+/* Map [base, base + size) to device in the page table */
+static void mmu_map_device(uint8_t device, uint32_t base, uint32_t size)
+{
+  uint64_t address = base;
+  uint64_t end = (uint64_t)base + size;
+
+  while (address < end) {
+    uint32_t page = address >> MMU_PAGE_SHIFT;
+    uint32_t offset = address & (MMU_PAGE_SIZE - 1);
+    uint32_t count = MMU_PAGE_SIZE - offset;
+    uint8_t *entry = &mmu_page_table[page];
+
+    if (count > end - address)
+      count = end - address;
+
+    if (count == MMU_PAGE_SIZE && !(*entry & MMU_SHARED_PAGE)) {
+      *entry = device;
+    } else {
+      if (!(*entry & MMU_SHARED_PAGE)) {
+        if (mmu_shared_page_count == MMU_MAX_SHARED_PAGES) {
+          fprintf(stderr, "%s: Too many shared pages, device %u not mapped\n", __FUNCTION__, device);
+          return;
+        }
+        memset(mmu_shared_pages[mmu_shared_page_count], *entry, MMU_PAGE_SIZE);
+        *entry = MMU_SHARED_PAGE | mmu_shared_page_count++;
+      }
+      memset(&mmu_shared_pages[*entry & ~MMU_SHARED_PAGE][offset], device, count);
+    }
+
+    address += count;
   }
+}
+
+static void mmu_init_layout()
+{
+  memset(mmu_page_table, VIRT_UNKNOWN, sizeof(mmu_page_table));
+  mmu_shared_page_count = 0;
 
-  return VIRT_UNKNOWN;
+  for (int i = 0; i < VIRT_UNKNOWN; i++)
+    mmu_map_device(i, mmio_map_template[i].base, mmio_map_template[i].size);
 }
 
-void mmu_write(uint32_t address, uint32_t data, uint8_t size)
+void mmu_init(struct Machine *m)
 {
-  uint8_t device = mmu_translate_address(address, size);
-  uint32_t converted_address = address - mmio_map[device].base;
-  switch (device) {
-    case VIRT_RESERVED:
-      /* raise null pointer exception */
-      fprintf(stderr, "Error in %s. Null pointer exception\n", __FUNCTION__);
-      regfile_write(REGISTER_ERROR, true);
-      break;
-      
-    case VIRT_SPI0:
-      spi_write(converted_address, data, size);
-      break;
-      
-    case VIRT_UART0:
-    case VIRT_UART1:
-    case VIRT_UART2:
-    case VIRT_UART3:
-      uart_write(converted_address, data, size);
-      break;
-      
-    case VIRT_DRAM:
-      address = address - mmio_map[VIRT_DRAM].base;
-      system_memory_write(converted_address, data, size);
-      break;
-      
-    case VIRT_UNKNOWN:
-      /* throw sigbus exception */
-      fprintf(stderr, "Bus exception!");
-    default:
-      break;
+  pthread_once(&mmu_layout_once, mmu_init_layout);
+
+  system_memory_init(m);
+  memcpy(m->mmio_map, mmio_map_template, sizeof(m->mmio_map));
+  m->mmio_map[VIRT_DRAM].size = m->memory.size;
+  m->mmio_map[VIRT_DRAM].host_base = m->memory.base;
+}
+
+void null_pointer_write_handler(struct Machine *m, uint32_t address, uint32_t data, uint8_t size)
+{
+  /* raise null pointer exception */
+  fprintf(stderr, "Error in mmu_write. Null pointer exception\n");
+  regfile_write(m, REGISTER_ERROR, true);
+}
+
+uint32_t null_pointer_read_handler(struct Machine *m, uint32_t address, uint8_t size)
+{
+  /* raise null pointer exception */
+  fprintf(stderr, "Error in mmu_read. Null pointer exception\n");
+  regfile_write(m, REGISTER_ERROR, true);
+  return 0;
+}
+
+void invalid_address_write_handler(struct Machine *m, uint32_t address, uint32_t data, uint8_t size)
+{
+  /* throw sigbus exception */
+  fprintf(stderr, "Error in mmu_write. Bus exception\n");
+  regfile_write(m, REGISTER_ERROR, true);
+}
+
+uint32_t invalid_address_read_handler(struct Machine *m, uint32_t address, uint8_t size)
+{
+  /* throw sigbus exception */
+  fprintf(stderr, "Error in mmu_read. Bus exception\n");
+  regfile_write(m, REGISTER_ERROR, true);
+  return 0;
+}
+
+bool system_memory_configure(struct Machine *m, uint64_t size)
+{
+  size = (size + MMU_PAGE_SIZE - 1) & ~(uint64_t)(MMU_PAGE_SIZE - 1);
+  if (size == 0 || size > MMIO_SYSTEM_MEMORY_MAX_SIZE) {
+    fprintf(stderr, "%s: Invalid system memory size %llu\n", __FUNCTION__, (unsigned long long)size);
+    return false;
   }
+
+  m->memory.configured_size = size;
+  return true;
 }
 
-uint32_t mmu_read(uint32_t address, uint8_t size)
+uint32_t system_memory_read(struct Machine *m, uint32_t address, uint8_t size)
 {
-  uint8_t device = mmu_translate_address(address, size);
-  uint32_t converted_address = address - mmio_map[device].base;
-  uint32_t data = 0;
-  
-  switch (device) {
-    case VIRT_RESERVED:
-      /* raise null pointer exception */
-      fprintf(stderr, "Error in %s. Null pointer exception\n", __FUNCTION__);
-      regfile_write(REGISTER_ERROR, true);
-      break;
-      
-    case VIRT_SPI0:
-      data = spi_read(converted_address, size);
-      break;
-      
-    case VIRT_UART0:
-    case VIRT_UART1:
-    case VIRT_UART2:
-    case VIRT_UART3:
-      data = uart_read(address, size);
-      break;
-      
-    case VIRT_DRAM:
-      address = address - mmio_map[VIRT_DRAM].base;
-      data = system_memory_read(converted_address, size);
-      break;
-      
-    case VIRT_UNKNOWN:
-      /* throw sigbus exception */
-      fprintf(stderr, "Error in %s. Bus exception\n", __FUNCTION__);
-      regfile_write(REGISTER_ERROR, true);
-    default:
-      break;
+  if (address > m->memory.size - size)
+    return invalid_address_read_handler(m, address + MMIO_SYSTEM_MEMORY_START, size);
+
+  return host_load(m->memory.base + address, size);
+}
+
+/* Returns true if the write goes to code */
+static inline bool system_memory_prepare_write(struct Machine *m, uint32_t address, uint8_t size)
+{
+  bool code = system_memory_is_code(&m->memory, address, size);
+
+  if (code) {
+    /* drop decoded and translated copies of the code we are about to overwrite */
+    icache_invalidate(m, address + MMIO_SYSTEM_MEMORY_START, size);
+    jit_invalidate(m, address + MMIO_SYSTEM_MEMORY_START, size);
   }
-  return data;
+
+  if (!system_memory_is_dirty(&m->memory, address, size))
+    system_memory_mark_dirty(m, address, size);
+
+  return code;
 }
 
-void mmu_init()
+void system_memory_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size)
 {
-  system_memory_init();
+  bool code;
+
+  if (address > m->memory.size - size) {
+    invalid_address_write_handler(m, address + MMIO_SYSTEM_MEMORY_START, data, size);
+    return;
+  }
+
+  code = system_memory_prepare_write(m, address, size);
+  host_store(m->memory.base + address, data, size);
+  if (code && m->smp)
+    smp_code_written(m);
 }
 
-uint32_t system_memory_read(uint32_t address, uint8_t size)
+/* Host address of an aligned word of system memory for an atomic access,
+ * which counts as a write (the other harts are told about writes to code
+ * after it, see smp_code_written()). NULL for any other address.
+ */
+uint32_t *system_memory_atomic(struct Machine *m, uint32_t address)
 {
-  uint8_t column = address % 4;
-  uint16_t row = address / 4;
+  if (address % SIZE_WORD || mmu_translate_address(m, address, SIZE_WORD) != VIRT_DRAM)
+    return NULL;
 
-  uint32_t retval = 0;
-  
-  switch (size) {
-    case SIZE_WORD:
-      retval |= memory.memory_block[row][column+3] << 24;
-      retval |= memory.memory_block[row][column+2] << 16;
-    case SIZE_HWORD:
-      retval |= memory.memory_block[row][column+1] << 8;
-    case SIZE_BYTE:
-      retval |= memory.memory_block[row][column];
+  address -= MMIO_SYSTEM_MEMORY_START;
+  system_memory_prepare_write(m, address, SIZE_WORD);
+  return (uint32_t *)(m->memory.base + address);
+}
+
+/* Drop the cached copies of code in [address, address + size) and mark it
+ * dirty before a block write. Returns true if it holds code. Without
+ * invalidate the caches are left alone, for devices which may run on the
+ * thread of another hart (see smp_code_written()).
+ */
+static bool system_memory_prepare_block(struct Machine *m, uint32_t address, uint32_t size,
+                                        bool invalidate)
+{
+  bool code = false;
+
+  for (uint32_t region = address >> SYSTEM_MEMORY_CODE_SHIFT;
+       region <= (address + size - 1) >> SYSTEM_MEMORY_CODE_SHIFT; region++) {
+    if (m->memory.code_map[region]) {
+      uint32_t start = (region << SYSTEM_MEMORY_CODE_SHIFT) + MMIO_SYSTEM_MEMORY_START;
+
+      code = true;
+      if (!invalidate)
+        break;
+
+      icache_invalidate(m, start, 1 << SYSTEM_MEMORY_CODE_SHIFT);
+      jit_invalidate(m, start, 1 << SYSTEM_MEMORY_CODE_SHIFT);
+    }
   }
-  return retval;
+
+  system_memory_mark_dirty(m, address, size);
+  return code;
 }
 
-void system_memory_write(uint32_t address, uint32_t data, uint8_t size)
+/* Copy a block into guest memory, as if the guest wrote it. Returns false if
+ * [address, address + size) isn't in system memory.
+ */
+bool system_memory_store(struct Machine *m, uint32_t address, const void *data, uint32_t size)
 {
-  uint8_t column = address % 4;
-  uint16_t row = address / 4;
+  bool code;
 
-  switch (size) {
-    case SIZE_WORD:
-      memory.memory_block[row][column+3] = data & (0xff << 24);
-      memory.memory_block[row][column+2] = data & (0xff << 16);
-    case SIZE_HWORD:
-      memory.memory_block[row][column+1] = data & (0xff << 8);
-    case SIZE_BYTE:
-      memory.memory_block[row][column] = data & 0xff;
+  if (!size)
+    return true;
+
+  if (size > m->memory.size || address > m->memory.size - size)
+    return false;
+
+  /* devices run on the thread of whichever hart accessed them, the harts
+   * drop their caches themselves */
+  code = system_memory_prepare_block(m, address, size, !m->smp);
+  memcpy(m->memory.base + address, data, size);
+  if (code && m->smp)
+    smp_code_written(m);
+  return true;
+}
+
+/* Block copy and fill within system memory on behalf of the hart m, which
+ * sees code they overwrite at once. The ranges have to be valid.
+ */
+void system_memory_copy(struct Machine *m, uint32_t destination, uint32_t source, uint32_t size)
+{
+  bool code;
+
+  if (!size)
+    return;
+
+  code = system_memory_prepare_block(m, destination, size, true);
+  memmove(m->memory.base + destination, m->memory.base + source, size);
+  if (code && m->smp)
+    smp_code_written(m);
+}
+
+void system_memory_fill(struct Machine *m, uint32_t address, uint8_t value, uint32_t size)
+{
+  bool code;
+
+  if (!size)
+    return;
+
+  code = system_memory_prepare_block(m, address, size, true);
+  memset(m->memory.base + address, value, size);
+  if (code && m->smp)
+    smp_code_written(m);
+}
+
+bool system_memory_load(struct Machine *m, uint32_t address, void *data, uint32_t size)
+{
+  if (size > m->memory.size || address > m->memory.size - size)
+    return false;
+
+  memcpy(data, m->memory.base + address, size);
+  return true;
+}
+
+void system_memory_mark_code(struct Machine *m, uint32_t address, uint32_t size)
+{
+  for (uint32_t region = address >> SYSTEM_MEMORY_CODE_SHIFT;
+       region <= (address + size - 1) >> SYSTEM_MEMORY_CODE_SHIFT; region++)
+    m->memory.code_map[region] = 1;
+}
+
+void system_memory_mark_dirty(struct Machine *m, uint32_t address, uint32_t size)
+{
+  struct SystemMemory *memory = &m->memory;
+
+  for (uint32_t page = address >> SYSTEM_MEMORY_DIRTY_SHIFT;
+       page <= (address + size - 1) >> SYSTEM_MEMORY_DIRTY_SHIFT; page++) {
+    if (!memory->dirty_map[page]) {
+      memory->dirty_map[page] = 1;
+      memory->dirty_pages[memory->dirty_count++] = page;
+    }
   }
 }
 
-void system_memory_init()
+static void system_memory_clear_dirty(struct Machine *m)
 {
-  for (int i = 0; i < MMIO_SYSTEM_MEMORY_SIZE / MMIO_SYSTEM_MEMORY_ALIGN; i++) {
-    for (int j = 0; j < MMIO_SYSTEM_MEMORY_ALIGN; j++) {
-      memory.memory_block[i][j] = 0;
+  struct SystemMemory *memory = &m->memory;
+
+  for (uint32_t i = 0; i < memory->dirty_count; i++)
+    memory->dirty_map[memory->dirty_pages[i]] = 0;
+  memory->dirty_count = 0;
+}
+
+static bool system_memory_write_all(int fd, const uint8_t *data, uint64_t size, uint64_t offset)
+{
+  while (size) {
+    ssize_t ret = pwrite(fd, data, size, offset);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("system_memory_save");
+      return false;
     }
+
+    data += ret;
+    size -= ret;
+    offset += ret;
   }
 
-  /* add r1, rz, 513 */
-  memory.memory_block[0][3] = 0x08;
-  memory.memory_block[0][2] = 0x04;
-  memory.memory_block[0][1] = 0x06;
-  memory.memory_block[0][0] = 0x08;
+  return true;
+}
 
-  /* sb r1, rz, 'h' */
-  memory.memory_block[1][3] = 0x01;
-  memory.memory_block[1][2] = 0xa0;
-  memory.memory_block[1][1] = 0x06;
-  memory.memory_block[1][0] = 0x69;
+/* Write the contents of memory to fd. Only pages that can differ from zero
+ * are written: the ones populated in the snapshot memory is a copy of, and
+ * the dirty ones.
+ */
+bool system_memory_save(struct Machine *m, int fd)
+{
+  struct SystemMemory *memory = &m->memory;
 
-  /* sb r1, rz, '\n' */
-  memory.memory_block[2][3] = 0x00;
-  memory.memory_block[2][2] = 0x28;
-  memory.memory_block[2][1] = 0x06;
-  memory.memory_block[2][0] = 0x69;
-    
-  /* hlt */
-  memory.memory_block[3][3] = 0x00;
-  memory.memory_block[3][2] = 0x00;
-  memory.memory_block[3][1] = 0x00;
-  memory.memory_block[3][0] = 0xe7;
+  if (ftruncate(fd, memory->size) < 0) {
+    perror("system_memory_save");
+    return false;
+  }
+
+  if (memory->backing_id) {
+    off_t data = 0;
+    off_t hole;
+
+    while ((data = lseek(memory->backing_fd, data, SEEK_DATA)) >= 0) {
+      hole = lseek(memory->backing_fd, data, SEEK_HOLE);
+      if (hole < 0 || hole > memory->size)
+        hole = memory->size;
+
+      if (!system_memory_write_all(fd, memory->base + data, hole - data, data))
+        return false;
+      data = hole;
+    }
+  }
+
+  for (uint32_t i = 0; i < memory->dirty_count; i++) {
+    uint64_t offset = (uint64_t)memory->dirty_pages[i] << SYSTEM_MEMORY_DIRTY_SHIFT;
+    uint64_t size = MMU_PAGE_SIZE;
+
+    if (offset + size > memory->size)
+      size = memory->size - offset;
+
+    if (!system_memory_write_all(fd, memory->base + offset, size, offset))
+      return false;
+  }
+
+  return true;
 }
 
-void uart_write(uint32_t address, uint32_t data, uint8_t size)
+/* Make memory a private copy of the snapshot in fd. The host address of
+ * memory doesn't change, neither do the cached decodings and translations.
+ */
+bool system_memory_rebase(struct Machine *m, int fd, uint64_t id)
 {
-  if (size == SIZE_BYTE)
-    putchar(data);
-  else
-    fprintf(stderr, "UART invalid size: %d\n", size);
+  struct SystemMemory *memory = &m->memory;
+  int backing_fd = dup(fd);
+
+  if (backing_fd < 0) {
+    perror("system_memory_rebase");
+    return false;
+  }
+
+  if (mmap(memory->base, memory->size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, 0) == MAP_FAILED) {
+    perror("system_memory_rebase");
+    close(backing_fd);
+    return false;
+  }
+
+  if (memory->backing_id)
+    close(memory->backing_fd);
+  memory->backing_fd = backing_fd;
+  memory->backing_id = id;
+  system_memory_clear_dirty(m);
+  return true;
 }
 
-uint32_t uart_read(uint32_t address, uint8_t size)
+/* Map the dirty pages from the snapshot again, dropping their private
+ * copies. Returns true if any of them held code.
+ */
+bool system_memory_revert(struct Machine *m)
 {
-  return 0;
+  struct SystemMemory *memory = &m->memory;
+  const uint32_t regions = 1 << (SYSTEM_MEMORY_DIRTY_SHIFT - SYSTEM_MEMORY_CODE_SHIFT);
+  bool code = false;
+
+  for (uint32_t i = 0; i < memory->dirty_count; i++) {
+    uint32_t page = memory->dirty_pages[i];
+    uint32_t count = 1;
+    uint64_t offset = (uint64_t)page << SYSTEM_MEMORY_DIRTY_SHIFT;
+    uint64_t size;
+
+    /* pages are usually dirtied in ascending runs, map a run at once */
+    while (i + count < memory->dirty_count && memory->dirty_pages[i + count] == page + count)
+      count++;
+
+    size = (uint64_t)count << SYSTEM_MEMORY_DIRTY_SHIFT;
+    if (offset + size > memory->size)
+      size = memory->size - offset;
+
+    if (mmap(memory->base + offset, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, memory->backing_fd, offset) == MAP_FAILED) {
+      perror("system_memory_revert");
+      exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t region = page * regions; region < (page + count) * regions && !code; region++)
+      code = memory->code_map[region];
+
+    i += count - 1;
+  }
+
+  system_memory_clear_dirty(m);
+  return code;
+}
+
+void system_memory_destroy(struct Machine *m)
+{
+  struct SystemMemory *memory = &m->memory;
+
+  if (memory->base)
+    munmap(memory->base, memory->size);
+  if (memory->backing_id)
+    close(memory->backing_fd);
+  free(memory->code_map);
+  free(memory->dirty_map);
+  free(memory->dirty_pages);
+
+  memory->base = NULL;
+  memory->code_map = NULL;
+  memory->dirty_map = NULL;
+  memory->dirty_pages = NULL;
+  memory->dirty_count = 0;
+  memory->backing_id = 0;
+}
+
+void system_memory_init(struct Machine *m)
+{
+  struct SystemMemory *memory = &m->memory;
+  uint64_t memory_size = memory->configured_size;
+  void *base;
+
+  /* a fresh mapping is cheaper than zeroing the old one */
+  system_memory_destroy(m);
+
+  base = mmap(NULL, memory_size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    perror("system_memory_init");
+    exit(EXIT_FAILURE);
+  }
+
+  memory->base = base;
+  memory->size = memory_size;
+  memory->code_map = calloc((memory_size >> SYSTEM_MEMORY_CODE_SHIFT) + 1, 1);
+  memory->dirty_map = calloc((memory_size >> SYSTEM_MEMORY_DIRTY_SHIFT) + 1, 1);
+  memory->dirty_pages = calloc((memory_size >> SYSTEM_MEMORY_DIRTY_SHIFT) + 1, sizeof(uint32_t));
+  if (!memory->code_map || !memory->dirty_map || !memory->dirty_pages) {
+    perror("system_memory_init");
+    exit(EXIT_FAILURE);
+  }
+
+  /* add r1, rz, 513 */
+  memory->base[3] = 0x08;
+  memory->base[2] = 0x04;
+  memory->base[1] = 0x06;
+  memory->base[0] = 0x08;
+
+  /* sb r1, rz, 'h' */
+  memory->base[7] = 0x01;
+  memory->base[6] = 0xa0;
+  memory->base[5] = 0x06;
+  memory->base[4] = 0x69;
+
+  /* sb r1, rz, '\n' */
+  memory->base[11] = 0x00;
+  memory->base[10] = 0x28;
+  memory->base[9] = 0x06;
+  memory->base[8] = 0x69;
+    
+  /* hlt */
+  memory->base[15] = 0x00;
+  memory->base[14] = 0x00;
+  memory->base[13] = 0x00;
+  memory->base[12] = 0xe7;
+  system_memory_mark_dirty(m, 0, SYSTEM_MEMORY_DEMO_SIZE);
 }
 
-void spi_write(uint32_t address, uint32_t data, uint8_t size) { return; }
-uint32_t spi_read(uint32_t address, uint8_t size) { return 0; }
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rscs.h"
+#include "core.h"
+#include "icache.h"
+#include "jit.h"
+#include "smp.h"
+#include "machine.h"
+
+/* Devices all harts share, the others act on the hart accessing them */
+static const uint8_t smp_shared_devices[] = { VIRT_SPI0, VIRT_UART0, VIRT_UART1, VIRT_UART2, VIRT_UART3 };
+
+static uint32_t smp_read(struct Machine *m, uint8_t device, uint32_t address, uint8_t size)
+{
+  struct Smp *smp = m->smp;
+  uint32_t value;
+
+  pthread_mutex_lock(&smp->io_lock);
+  value = smp->read[device](smp->harts[0], address, size);
+  pthread_mutex_unlock(&smp->io_lock);
+  return value;
+}
+
+static void smp_write(struct Machine *m, uint8_t device, uint32_t address, uint32_t data, uint8_t size)
+{
+  struct Smp *smp = m->smp;
+
+  pthread_mutex_lock(&smp->io_lock);
+  smp->write[device](smp->harts[0], address, data, size);
+  pthread_mutex_unlock(&smp->io_lock);
+}
+
+/* The map entries have no index, one pair of handlers per device */
+#define SMP_HANDLERS(device)                                                                 \
+  static uint32_t smp_read_##device(struct Machine *m, uint32_t address, uint8_t size)      \
+  {                                                                                         \
+    return smp_read(m, device, address, size);                                             \
+  }                                                                                         \
+  static void smp_write_##device(struct Machine *m, uint32_t address, uint32_t data,        \
+                                 uint8_t size)                                              \
+  {                                                                                         \
+    smp_write(m, device, address, data, size);                                             \
+  }
+
+SMP_HANDLERS(VIRT_SPI0)
+SMP_HANDLERS(VIRT_UART0)
+SMP_HANDLERS(VIRT_UART1)
+SMP_HANDLERS(VIRT_UART2)
+SMP_HANDLERS(VIRT_UART3)
+
+static const MMIO_DEVICE_READ smp_read_handlers[VIRT_UNKNOWN + 1] = {
+  [VIRT_SPI0] = smp_read_VIRT_SPI0,
+  [VIRT_UART0] = smp_read_VIRT_UART0,
+  [VIRT_UART1] = smp_read_VIRT_UART1,
+  [VIRT_UART2] = smp_read_VIRT_UART2,
+  [VIRT_UART3] = smp_read_VIRT_UART3,
+};
+
+static const MMIO_DEVICE_WRITE smp_write_handlers[VIRT_UNKNOWN + 1] = {
+  [VIRT_SPI0] = smp_write_VIRT_SPI0,
+  [VIRT_UART0] = smp_write_VIRT_UART0,
+  [VIRT_UART1] = smp_write_VIRT_UART1,
+  [VIRT_UART2] = smp_write_VIRT_UART2,
+  [VIRT_UART3] = smp_write_VIRT_UART3,
+};
+
+/* A hart runs on the system memory of hart 0, it has none of its own */
+static struct Machine *smp_create_hart(struct Machine *m, uint32_t id)
+{
+  struct Machine *hart = calloc(1, sizeof(*hart));
+
+  if (!hart) {
+    perror("smp_start");
+    return NULL;
+  }
+
+  hart->memory = m->memory;
+  memcpy(hart->mmio_map, m->mmio_map, sizeof(hart->mmio_map));
+  fsm_init(hart);
+  regfile_init(hart);
+  icache_init(hart);
+  jit_init(hart);
+  intc_init(hart);
+  timer_init(hart);
+  dma_init(hart);
+  event_init(hart);
+
+  hart->regfile.gp_registers[REGISTER_PC] = m->regfile.gp_registers[REGISTER_PC];
+  hart->engine = m->engine;
+  hart->hart_id = id;
+  hart->smp = m->smp;
+  hart->code_generation = m->code_generation;
+  return hart;
+}
+
+static void smp_destroy_hart(struct Machine *hart)
+{
+  jit_destroy(hart);
+  free(hart);
+}
+
+bool smp_start(struct Machine *m, uint32_t harts)
+{
+  struct Smp *smp;
+  uint32_t i;
+
+  if (harts < 1 || harts > SMP_MAX_HARTS) {
+    fprintf(stderr, "%s: Invalid number of harts %u\n", __FUNCTION__, harts);
+    return false;
+  }
+
+  if (harts > 1 && m->replay) {
+    fprintf(stderr, "%s: Record and replay need a single hart\n", __FUNCTION__);
+    return false;
+  }
+
+  smp_stop(m);
+  if (harts == 1)
+    return true;
+
+  smp = calloc(1, sizeof(*smp));
+  if (!smp) {
+    perror("smp_start");
+    return false;
+  }
+
+  pthread_mutex_init(&smp->io_lock, NULL);
+  smp->harts[0] = m;
+  smp->count = 1;
+  m->smp = smp;
+  m->hart_id = 0;
+
+  for (i = 0; i < sizeof(smp_shared_devices); i++) {
+    uint8_t device = smp_shared_devices[i];
+
+    smp->read[device] = m->mmio_map[device].read;
+    smp->write[device] = m->mmio_map[device].write;
+    m->mmio_map[device].read = smp_read_handlers[device];
+    m->mmio_map[device].write = smp_write_handlers[device];
+  }
+
+  /* dirty tracking is for snapshots of a single hart, with every page
+   * dirty the harts never update it */
+  system_memory_mark_dirty(m, 0, m->memory.size);
+
+  for (i = 1; i < harts; i++) {
+    smp->harts[i] = smp_create_hart(m, i);
+    if (!smp->harts[i]) {
+      smp_stop(m);
+      return false;
+    }
+    smp->count++;
+  }
+
+  return true;
+}
+
+void smp_stop(struct Machine *m)
+{
+  struct Smp *smp = m->smp;
+  uint32_t i;
+
+  if (!smp)
+    return;
+
+  for (i = 1; i < smp->count; i++)
+    smp_destroy_hart(smp->harts[i]);
+
+  for (i = 0; i < sizeof(smp_shared_devices); i++) {
+    uint8_t device = smp_shared_devices[i];
+
+    m->mmio_map[device].read = smp->read[device];
+    m->mmio_map[device].write = smp->write[device];
+  }
+
+  pthread_mutex_destroy(&smp->io_lock);
+  free(smp);
+  m->smp = NULL;
+}
+
+struct SmpThread {
+  pthread_t thread;
+  struct Machine *hart;
+  uint64_t max_instructions;
+  uint8_t reason;
+};
+
+static void *smp_thread(void *arg)
+{
+  struct SmpThread *t = arg;
+
+  t->reason = machine_run(t->hart, t->max_instructions);
+  return NULL;
+}
+
+uint8_t smp_run(struct Machine *m, uint64_t max_instructions)
+{
+  static const uint8_t priority[] = {
+    [MACHINE_EXIT_HALT] = 0, [MACHINE_EXIT_LIMIT] = 1, [MACHINE_EXIT_BREAK] = 2, [MACHINE_EXIT_ERROR] = 3,
+  };
+  struct Smp *smp = m->smp;
+  struct SmpThread threads[SMP_MAX_HARTS];
+  uint8_t reason;
+  uint32_t i;
+
+  if (!smp)
+    return machine_run(m, max_instructions);
+
+  for (i = 1; i < smp->count; i++) {
+    threads[i].hart = smp->harts[i];
+    threads[i].max_instructions = max_instructions;
+    if (pthread_create(&threads[i].thread, NULL, smp_thread, &threads[i])) {
+      fprintf(stderr, "%s: Can't start hart %u\n", __FUNCTION__, i);
+      threads[i].reason = MACHINE_EXIT_ERROR;
+      threads[i].hart = NULL;
+    }
+  }
+
+  reason = machine_run(m, max_instructions);
+
+  for (i = 1; i < smp->count; i++) {
+    if (threads[i].hart)
+      pthread_join(threads[i].thread, NULL);
+    if (priority[threads[i].reason] > priority[reason])
+      reason = threads[i].reason;
+  }
+
+  return reason;
+}
+
+/* Called for writes to system memory holding code */
+void smp_code_written(struct Machine *m)
+{
+  atomic_fetch_add_explicit(&m->smp->code_generation, 1, memory_order_release);
+}
+
+/* Drop the cached code if any hart or device wrote code since the last time */
+void smp_sync_code(struct Machine *m)
+{
+  uint32_t generation = atomic_load_explicit(&m->smp->code_generation, memory_order_acquire);
+
+  if (generation == m->code_generation)
+    return;
+
+  m->code_generation = generation;
+  icache_flush(m);
+  jit_flush(m);
+}
@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "spi.h"
+#include "machine.h"
+
+void spi_init(struct Machine *m)
+{
+  m->spi.fd = -1;
+  m->spi.image = NULL;
+  m->spi.sectors = 0;
+  m->spi.regs.status = 0;
+}
+
+/* Map a disk image, read only if it can't be opened for writing */
+bool spi_attach(struct Machine *m, const char *path, uint8_t sync)
+{
+  struct Spi *spi = &m->spi;
+  bool read_only = false;
+  struct stat st;
+  uint64_t size;
+  void *image;
+  int fd;
+
+  fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    read_only = true;
+  }
+
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    perror(path);
+    close(fd);
+    return false;
+  }
+
+  if (st.st_size < SPI_SECTOR_SIZE) {
+    fprintf(stderr, "%s: Disk image is smaller than a sector\n", path);
+    close(fd);
+    return false;
+  }
+
+  size = st.st_size / SPI_SECTOR_SIZE * SPI_SECTOR_SIZE;
+  image = mmap(NULL, size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (image == MAP_FAILED) {
+    perror(path);
+    close(fd);
+    return false;
+  }
+
+  spi_detach(m);
+  spi->fd = fd;
+  spi->image = image;
+  spi->sectors = size / SPI_SECTOR_SIZE;
+  spi->read_only = read_only;
+  spi->sync = sync;
+  spi->regs.status = SPI_STATUS_READY | (read_only ? SPI_STATUS_READ_ONLY : 0);
+  return true;
+}
+
+/* Write sectors [first, first + count) back to the image file */
+static bool spi_sync(struct Spi *spi, uint64_t first, uint64_t count)
+{
+  uint64_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+  uint64_t start = first * SPI_SECTOR_SIZE;
+  uint64_t end = (first + count) * SPI_SECTOR_SIZE;
+
+  start &= ~page_mask;
+  if (msync(spi->image + start, end - start, MS_SYNC) < 0) {
+    perror("spi_sync");
+    return false;
+  }
+
+  return true;
+}
+
+void spi_detach(struct Machine *m)
+{
+  struct Spi *spi = &m->spi;
+
+  if (spi->fd < 0)
+    return;
+
+  if (!spi->read_only)
+    spi_sync(spi, 0, spi->sectors);
+
+  munmap(spi->image, spi->sectors * SPI_SECTOR_SIZE);
+  close(spi->fd);
+  spi_init(m);
+}
+
+static bool spi_transfer(struct Machine *m, uint8_t command)
+{
+  struct Spi *spi = &m->spi;
+  uint32_t address = spi->regs.address - MMIO_SYSTEM_MEMORY_START;
+  uint64_t bytes = (uint64_t)spi->regs.count * SPI_SECTOR_SIZE;
+  uint8_t *sector = spi->image + (uint64_t)spi->regs.sector * SPI_SECTOR_SIZE;
+
+  if (spi->fd < 0 || (uint64_t)spi->regs.sector + spi->regs.count > spi->sectors
+      || bytes > UINT32_MAX)
+    return false;
+
+  switch (command) {
+    case SPI_COMMAND_READ:
+      if (!system_memory_store(m, address, sector, bytes))
+        return false;
+
+      spi->stats.reads++;
+      spi->stats.sectors_read += spi->regs.count;
+      return true;
+
+    case SPI_COMMAND_WRITE:
+      if (spi->read_only || !system_memory_load(m, address, sector, bytes))
+        return false;
+
+      spi->stats.writes++;
+      spi->stats.sectors_written += spi->regs.count;
+      if (spi->sync == SPI_SYNC_WRITE_THROUGH && spi->regs.count)
+        return spi_sync(spi, spi->regs.sector, spi->regs.count);
+      return true;
+
+    case SPI_COMMAND_FLUSH:
+      spi->stats.flushes++;
+      return spi->read_only || spi_sync(spi, 0, spi->sectors);
+
+    default:
+      return false;
+  }
+}
+
+void spi_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size)
+{
+  struct Spi *spi = &m->spi;
+
+  if (size != SIZE_WORD) {
+    fprintf(stderr, "SPI invalid size: %d\n", size);
+    return;
+  }
+
+  switch (address + MMIO_SPI_START) {
+    case SPI_REG_COMMAND:
+      spi->regs.status &= ~SPI_STATUS_ERROR;
+      if (!spi_transfer(m, data)) {
+        spi->regs.status |= SPI_STATUS_ERROR;
+        spi->stats.errors++;
+      }
+      break;
+
+    case SPI_REG_SECTOR:
+      spi->regs.sector = data;
+      break;
+
+    case SPI_REG_ADDRESS:
+      spi->regs.address = data;
+      break;
+
+    case SPI_REG_COUNT:
+      spi->regs.count = data;
+      break;
+
+    default:
+      break;
+  }
+}
+
+uint32_t spi_read(struct Machine *m, uint32_t address, uint8_t size)
+{
+  struct Spi *spi = &m->spi;
+
+  if (size != SIZE_WORD) {
+    fprintf(stderr, "SPI invalid size: %d\n", size);
+    return 0;
+  }
+
+  switch (address + MMIO_SPI_START) {
+    case SPI_REG_STATUS:
+      return spi->regs.status;
+
+    case SPI_REG_SECTOR:
+      return spi->regs.sector;
+
+    case SPI_REG_ADDRESS:
+      return spi->regs.address;
+
+    case SPI_REG_COUNT:
+      return spi->regs.count;
+
+    case SPI_REG_CAPACITY:
+      return spi->sectors > UINT32_MAX ? UINT32_MAX : spi->sectors;
+
+    default:
+      return 0;
+  }
+}
+
+void spi_dump_stats(struct Machine *m)
+{
+  const struct SpiStats *stats = &m->spi.stats;
+
+  if (m->spi.fd < 0)
+    return;
+
+  fprintf(stderr, "spi: %lu reads (%lu sectors), %lu writes (%lu sectors), %lu flushes, %lu errors\n",
+          (unsigned long)stats->reads, (unsigned long)stats->sectors_read,
+          (unsigned long)stats->writes, (unsigned long)stats->sectors_written,
+          (unsigned long)stats->flushes, (unsigned long)stats->errors);
+}
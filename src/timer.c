@@ -0,0 +1,85 @@
+#include <stdio.h>
+
+#include "rscs.h"
+#include "event.h"
+#include "intc.h"
+#include "timer.h"
+#include "machine.h"
+
+void timer_init(struct Machine *m)
+{
+  m->timer.interval = 0;
+  m->timer.control = 0;
+  m->timer.time_hi = 0;
+  m->timer.fired = 0;
+}
+
+static void timer_expired(struct Machine *m, uint64_t when)
+{
+  struct Timer *timer = &m->timer;
+
+  timer->fired++;
+  if (timer->control & TIMER_CONTROL_PERIODIC)
+    event_schedule(m, timer_expired, when + timer->interval);
+  else
+    timer->interval = 0;
+
+  intc_raise(m, INTC_LINE_TIMER);
+}
+
+void timer_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size)
+{
+  struct Timer *timer = &m->timer;
+
+  if (size != SIZE_WORD) {
+    fprintf(stderr, "Timer invalid size: %d\n", size);
+    return;
+  }
+
+  switch (address) {
+    case TIMER_REG_INTERVAL:
+      timer->interval = data;
+      if (data)
+        event_schedule(m, timer_expired, event_clock(m) + data);
+      else
+        event_cancel(m, timer_expired);
+      break;
+
+    case TIMER_REG_CONTROL:
+      timer->control = data;
+      break;
+
+    default:
+      break;
+  }
+}
+
+uint32_t timer_read(struct Machine *m, uint32_t address, uint8_t size)
+{
+  struct Timer *timer = &m->timer;
+  uint64_t now;
+
+  if (size != SIZE_WORD) {
+    fprintf(stderr, "Timer invalid size: %d\n", size);
+    return 0;
+  }
+
+  switch (address) {
+    case TIMER_REG_TIME_LO:
+      now = event_clock(m);
+      timer->time_hi = now >> 32;
+      return now;
+
+    case TIMER_REG_TIME_HI:
+      return timer->time_hi;
+
+    case TIMER_REG_INTERVAL:
+      return timer->interval;
+
+    case TIMER_REG_CONTROL:
+      return timer->control;
+
+    default:
+      return 0;
+  }
+}
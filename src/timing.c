@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rscs.h"
+#include "core.h"
+#include "perf.h"
+#include "timing.h"
+#include "machine.h"
+
+static const char *timing_predictor_names[] = {
+  [TIMING_PREDICTOR_NOT_TAKEN] = "not-taken",
+  [TIMING_PREDICTOR_BTFN] = "btfn",
+  [TIMING_PREDICTOR_BIMODAL] = "bimodal",
+  [TIMING_PREDICTOR_GSHARE] = "gshare",
+};
+
+void timing_default_config(struct TimingConfig *config)
+{
+  memset(config, 0, sizeof(*config));
+  memset(config->latency, 1, sizeof(config->latency));
+  config->latency[BLOCK_ATOMIC][OPCODE_SWAP] = 4;
+  config->latency[BLOCK_ATOMIC][OPCODE_CAS] = 4;
+  config->latency[BLOCK_ATOMIC][OPCODE_FADD] = 4;
+  config->latency[BLOCK_ATOMIC][OPCODE_FENCE] = 3;
+  config->latency[BLOCK_CONTROL][OPCODE_IRET] = 3;
+
+  config->device_latency[VIRT_SPI0] = 20;
+  config->device_latency[VIRT_UART0] = 20;
+  config->device_latency[VIRT_UART1] = 20;
+  config->device_latency[VIRT_UART2] = 20;
+  config->device_latency[VIRT_UART3] = 20;
+  config->device_latency[VIRT_INTC] = 2;
+  config->device_latency[VIRT_TIMER] = 2;
+  config->device_latency[VIRT_DMA] = 4;
+
+  config->load_use = 1;
+  config->taken = 1;
+  config->mispredict = 4;
+  config->predictor = TIMING_PREDICTOR_GSHARE;
+  config->table_bits = 12;
+  config->history_bits = 8;
+}
+
+/* Cycles of the block, opcode or device called `name` */
+static bool timing_set_latency(struct TimingConfig *config, const char *name, uint8_t cycles)
+{
+  for (int block = 0; block < TIMING_BLOCKS; block++) {
+    if (perf_block_names[block] && !strcmp(name, perf_block_names[block])) {
+      memset(config->latency[block], cycles, sizeof(config->latency[block]));
+      return true;
+    }
+
+    for (int opcode = 0; opcode < TIMING_OPCODES; opcode++) {
+      if (perf_opcode_names[block][opcode] && !strcmp(name, perf_opcode_names[block][opcode])) {
+        config->latency[block][opcode] = cycles;
+        return true;
+      }
+    }
+  }
+
+  for (int device = 0; device <= VIRT_UNKNOWN; device++) {
+    if (!strcmp(name, perf_device_names[device])) {
+      config->device_latency[device] = cycles;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool timing_parse_config(const char *spec, struct TimingConfig *config)
+{
+  char *copy = strdup(spec);
+  char *save = NULL;
+  bool ret = true;
+
+  if (!copy) {
+    perror("timing_parse_config");
+    return false;
+  }
+
+  for (char *item = strtok_r(copy, ",", &save); item && ret; item = strtok_r(NULL, ",", &save)) {
+    char *value = strchr(item, '=');
+    unsigned long number;
+    char *end;
+
+    if (!strcmp(item, "default"))
+      continue;
+
+    if (!value) {
+      fprintf(stderr, "Invalid timing setting: %s\n", item);
+      ret = false;
+      break;
+    }
+    *value++ = 0;
+
+    if (!strcmp(item, "predictor")) {
+      ret = false;
+      for (uint8_t i = 0; i < sizeof(timing_predictor_names) / sizeof(*timing_predictor_names); i++) {
+        if (!strcmp(value, timing_predictor_names[i])) {
+          config->predictor = i;
+          ret = true;
+        }
+      }
+    } else {
+      number = strtoul(value, &end, 0);
+      if (end == value || *end || number > UINT8_MAX)
+        ret = false;
+      else if (!strcmp(item, "table"))
+        config->table_bits = number;
+      else if (!strcmp(item, "history"))
+        config->history_bits = number;
+      else if (!strcmp(item, "load-use"))
+        config->load_use = number;
+      else if (!strcmp(item, "taken"))
+        config->taken = number;
+      else if (!strcmp(item, "mispredict"))
+        config->mispredict = number;
+      else
+        ret = timing_set_latency(config, item, number);
+    }
+
+    if (!ret)
+      fprintf(stderr, "Invalid timing setting: %s\n", item);
+  }
+
+  free(copy);
+  return ret;
+}
+
+bool timing_start(struct Machine *m, const struct TimingConfig *config)
+{
+  struct Timing *timing;
+
+  if (config->table_bits > TIMING_MAX_TABLE_BITS || config->history_bits > config->table_bits) {
+    fprintf(stderr, "%s: Predictor table of up to 2^%u entries with as many history bits\n",
+            __FUNCTION__, TIMING_MAX_TABLE_BITS);
+    return false;
+  }
+
+  timing_stop(m);
+  timing = calloc(1, sizeof(*timing));
+  if (!timing) {
+    perror("timing_start");
+    return false;
+  }
+
+  timing->config = *config;
+  timing->load_dst = TIMING_NO_LOAD;
+  timing->counters = malloc(1 << config->table_bits);
+  if (!timing->counters) {
+    perror("timing_start");
+    free(timing);
+    return false;
+  }
+  memset(timing->counters, 1, 1 << config->table_bits);
+
+  m->timing = timing;
+  return true;
+}
+
+void timing_stop(struct Machine *m)
+{
+  struct Timing *timing = m->timing;
+
+  if (!timing)
+    return;
+
+  free(timing->counters);
+  free(timing);
+  m->timing = NULL;
+}
+
+/* Model */
+
+static bool timing_reads(const struct DecodedInstruction *d, uint8_t reg)
+{
+  switch (d->scheme) {
+    case CODING_SCHEME_R:
+      if (d->srcreg == reg || d->src2reg == reg)
+        return true;
+      break;
+
+    case CODING_SCHEME_UI:
+    case CODING_SCHEME_SI:
+      if (d->srcreg == reg)
+        return true;
+      break;
+  }
+
+  /* stores address memory through dst, atomics and NOT read it as an operand */
+  return d->dstreg == reg
+      && ((d->block == BLOCK_MEMORY && d->opcode >= OPCODE_SB) || d->block == BLOCK_ATOMIC
+          || (d->block == BLOCK_ARITHMETIC && d->opcode == OPCODE_NOT));
+}
+
+void timing_instruction(struct Timing *timing, const struct DecodedInstruction *d)
+{
+  uint8_t loaded = timing->load_dst;
+
+  timing->load_dst = TIMING_NO_LOAD;
+  timing->instructions++;
+  timing->cycles += timing->config.latency[d->block][d->opcode];
+
+  if (loaded != TIMING_NO_LOAD && loaded != REGISTER_RZ && timing_reads(d, loaded)) {
+    timing->cycles += timing->config.load_use;
+    timing->load_use_stalls += timing->config.load_use;
+  }
+}
+
+static bool timing_predict(struct Timing *timing, uint32_t pc, uint32_t target, bool taken)
+{
+  uint32_t mask = (1 << timing->config.table_bits) - 1;
+  uint32_t index = pc / SIZE_WORD;
+  uint8_t *counter;
+  bool prediction;
+
+  switch (timing->config.predictor) {
+    case TIMING_PREDICTOR_NOT_TAKEN:
+      return false;
+
+    case TIMING_PREDICTOR_BTFN:
+      return target <= pc;
+
+    case TIMING_PREDICTOR_GSHARE:
+      index ^= timing->history & ((1 << timing->config.history_bits) - 1);
+      timing->history = timing->history << 1 | taken;
+      break;
+  }
+
+  /* two bit saturating counter */
+  counter = &timing->counters[index & mask];
+  prediction = *counter >= 2;
+  if (taken && *counter < 3)
+    (*counter)++;
+  else if (!taken && *counter > 0)
+    (*counter)--;
+
+  return prediction;
+}
+
+void timing_branch(struct Timing *timing, const struct DecodedInstruction *d, uint32_t target,
+                   bool taken)
+{
+  /* unconditional, the target is known after decode */
+  if (d->opcode == OPCODE_BR) {
+    timing->cycles += timing->config.taken;
+    timing->taken_bubbles += timing->config.taken;
+    return;
+  }
+
+  timing->branches++;
+  if (timing_predict(timing, d->pc, target, taken) != taken) {
+    timing->mispredicts++;
+    timing->cycles += timing->config.mispredict;
+  } else if (taken) {
+    timing->cycles += timing->config.taken;
+    timing->taken_bubbles += timing->config.taken;
+  }
+}
+
+/* Report */
+
+void timing_report(struct Machine *m, FILE *out)
+{
+  struct Timing *timing = m->timing;
+
+  if (!timing)
+    return;
+
+  fprintf(out, "timing:\n");
+  fprintf(out, "  instructions   %14lu\n", (unsigned long)timing->instructions);
+  fprintf(out, "  cycles         %14lu (CPI %.3f)\n", (unsigned long)timing->cycles,
+          timing->instructions ? (double)timing->cycles / timing->instructions : 0.0);
+  fprintf(out, "  load use       %14lu stall cycles\n", (unsigned long)timing->load_use_stalls);
+  fprintf(out, "  branches       %14lu conditional, %lu mispredicted (%.2f%%, %s predictor)\n",
+          (unsigned long)timing->branches, (unsigned long)timing->mispredicts,
+          timing->branches ? 100.0 * timing->mispredicts / timing->branches : 0.0,
+          timing_predictor_names[timing->config.predictor]);
+  fprintf(out, "  taken branches %14lu bubble cycles\n", (unsigned long)timing->taken_bubbles);
+  fprintf(out, "  devices        %14lu cycles\n", (unsigned long)timing->device_cycles);
+}
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "rscs.h"
+#include "trace.h"
+#include "machine.h"
+
+static void *trace_writer(void *arg)
+{
+  struct Trace *trace = arg;
+  uLong bound = compressBound(TRACE_CHUNK_SIZE);
+  uint8_t *compressed = malloc(bound);
+
+  if (!compressed) {
+    perror("trace_writer");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&trace->lock);
+  for (;;) {
+    struct TraceBuffer *buffer;
+    struct TraceChunkHeader header = { 0 };
+    uLongf size = bound;
+
+    while (trace->written == trace->submitted && !trace->stopping)
+      pthread_cond_wait(&trace->cond, &trace->lock);
+
+    if (trace->written == trace->submitted)
+      break;
+
+    buffer = &trace->buffers[trace->written % TRACE_BUFFERS];
+    pthread_mutex_unlock(&trace->lock);
+
+    if (!trace->failed) {
+      if (compress2(compressed, &size, buffer->data, buffer->size, TRACE_COMPRESSION_LEVEL) != Z_OK) {
+        fprintf(stderr, "%s: Compression failed\n", __FUNCTION__);
+        trace->failed = true;
+      } else {
+        header.first_instruction = buffer->first_instruction;
+        header.records = buffer->records;
+        header.raw_size = buffer->size;
+        header.compressed_size = size;
+        if (fwrite(&header, sizeof(header), 1, trace->file) != 1 ||
+            fwrite(compressed, size, 1, trace->file) != 1) {
+          perror("trace_writer");
+          trace->failed = true;
+        }
+        trace->bytes_written += sizeof(header) + size;
+      }
+    }
+
+    pthread_mutex_lock(&trace->lock);
+    trace->written++;
+    pthread_cond_broadcast(&trace->cond);
+  }
+  pthread_mutex_unlock(&trace->lock);
+
+  free(compressed);
+  return NULL;
+}
+
+static void trace_begin_chunk(struct Trace *trace, struct TraceBuffer *buffer)
+{
+  buffer->records = 0;
+  buffer->size = 0;
+  buffer->first_instruction = trace->instructions;
+  trace->current = buffer;
+  trace->cursor = buffer->data;
+  trace->flags = NULL;
+  memset(&trace->delta, 0, sizeof(trace->delta));
+}
+
+/* Hand the current chunk to the writer and start the next one */
+void trace_submit(struct Trace *trace)
+{
+  struct TraceBuffer *buffer = trace->current;
+
+  buffer->size = trace->cursor - buffer->data;
+  trace->instructions += buffer->records;
+
+  pthread_mutex_lock(&trace->lock);
+  trace->submitted++;
+  pthread_cond_broadcast(&trace->cond);
+  while (trace->submitted - trace->written == TRACE_BUFFERS)
+    pthread_cond_wait(&trace->cond, &trace->lock);
+  pthread_mutex_unlock(&trace->lock);
+
+  trace_begin_chunk(trace, &trace->buffers[trace->submitted % TRACE_BUFFERS]);
+}
+
+bool trace_start(struct Machine *m, const char *path)
+{
+  struct TraceFileHeader header = { TRACE_MAGIC, TRACE_VERSION, TRACE_CHUNK_SIZE, m->instret };
+  struct Trace *trace;
+
+  if (m->trace)
+    trace_stop(m);
+
+  trace = calloc(1, sizeof(*trace));
+  if (!trace) {
+    perror("trace_start");
+    return false;
+  }
+
+  trace->file = fopen(path, "wb");
+  if (!trace->file) {
+    perror(path);
+    free(trace);
+    return false;
+  }
+
+  if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+    perror(path);
+    fclose(trace->file);
+    free(trace);
+    return false;
+  }
+
+  pthread_mutex_init(&trace->lock, NULL);
+  pthread_cond_init(&trace->cond, NULL);
+  if (pthread_create(&trace->writer, NULL, trace_writer, trace)) {
+    perror("trace_start");
+    fclose(trace->file);
+    free(trace);
+    return false;
+  }
+
+  trace_begin_chunk(trace, &trace->buffers[0]);
+  m->trace = trace;
+  return true;
+}
+
+/* Write out what's left and close the trace */
+void trace_stop(struct Machine *m)
+{
+  struct Trace *trace = m->trace;
+
+  if (!trace)
+    return;
+
+  if (trace->current->records) {
+    trace->current->size = trace->cursor - trace->current->data;
+    trace->instructions += trace->current->records;
+    pthread_mutex_lock(&trace->lock);
+    trace->submitted++;
+    pthread_mutex_unlock(&trace->lock);
+  }
+
+  pthread_mutex_lock(&trace->lock);
+  trace->stopping = true;
+  pthread_cond_broadcast(&trace->cond);
+  pthread_mutex_unlock(&trace->lock);
+  pthread_join(trace->writer, NULL);
+
+  if (fclose(trace->file) || trace->failed)
+    fprintf(stderr, "%s: Trace is incomplete\n", __FUNCTION__);
+
+  pthread_mutex_destroy(&trace->lock);
+  pthread_cond_destroy(&trace->cond);
+  free(trace);
+  m->trace = NULL;
+}
+
+/* Reading */
+static bool trace_reader_load_chunk(struct TraceReader *reader)
+{
+  uint8_t *compressed;
+  uLongf size = reader->header.chunk_size;
+  bool ok;
+
+  reader->chunk_offset = ftell(reader->file);
+  if (fread(&reader->chunk, sizeof(reader->chunk), 1, reader->file) != 1)
+    return false;
+
+  if (reader->chunk.raw_size > reader->header.chunk_size) {
+    fprintf(stderr, "%s: Corrupted chunk at %ld\n", __FUNCTION__, reader->chunk_offset);
+    return false;
+  }
+
+  compressed = malloc(reader->chunk.compressed_size);
+  if (!compressed) {
+    perror("trace_reader_load_chunk");
+    return false;
+  }
+
+  ok = fread(compressed, reader->chunk.compressed_size, 1, reader->file) == 1 &&
+       uncompress(reader->data, &size, compressed, reader->chunk.compressed_size) == Z_OK &&
+       size == reader->chunk.raw_size;
+  free(compressed);
+
+  if (!ok) {
+    fprintf(stderr, "%s: Corrupted chunk at %ld\n", __FUNCTION__, reader->chunk_offset);
+    return false;
+  }
+
+  reader->position = 0;
+  reader->index = reader->chunk.first_instruction;
+  memset(&reader->delta, 0, sizeof(reader->delta));
+  return true;
+}
+
+struct TraceReader *trace_reader_open(const char *path)
+{
+  struct TraceReader *reader = calloc(1, sizeof(*reader));
+
+  if (!reader) {
+    perror("trace_reader_open");
+    return NULL;
+  }
+
+  reader->file = fopen(path, "rb");
+  if (!reader->file) {
+    perror(path);
+    free(reader);
+    return NULL;
+  }
+
+  if (fread(&reader->header, sizeof(reader->header), 1, reader->file) != 1 ||
+      memcmp(reader->header.magic, TRACE_MAGIC, sizeof(reader->header.magic)) ||
+      reader->header.version != TRACE_VERSION) {
+    fprintf(stderr, "%s: Not a trace file\n", path);
+    trace_reader_close(reader);
+    return NULL;
+  }
+
+  reader->data = malloc(reader->header.chunk_size);
+  if (!reader->data) {
+    perror("trace_reader_open");
+    trace_reader_close(reader);
+    return NULL;
+  }
+
+  return reader;
+}
+
+void trace_reader_close(struct TraceReader *reader)
+{
+  if (!reader)
+    return;
+
+  fclose(reader->file);
+  free(reader->data);
+  free(reader);
+}
+
+static uint32_t trace_get_varint(struct TraceReader *reader)
+{
+  uint32_t zigzag = 0;
+  uint8_t byte;
+  int shift = 0;
+
+  do {
+    byte = reader->data[reader->position++];
+    zigzag |= (uint32_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80 && shift < 35);
+
+  return (zigzag >> 1) ^ -(zigzag & 1);
+}
+
+bool trace_reader_next(struct TraceReader *reader, struct TraceRecord *record)
+{
+  const uint8_t *data;
+  uint32_t index;
+
+  if (reader->position >= reader->chunk.raw_size && !trace_reader_load_chunk(reader))
+    return false;
+
+  record->index = reader->index++;
+  record->flags = reader->data[reader->position++];
+  if (record->flags & TRACE_RECORD_JUMP)
+    reader->delta.next_pc += trace_get_varint(reader);
+  record->pc = reader->delta.next_pc;
+  reader->delta.next_pc += SIZE_WORD;
+
+  index = (record->pc / SIZE_WORD) & (TRACE_INSTRUCTION_CACHE - 1);
+  if (record->flags & TRACE_RECORD_REPEAT) {
+    record->instruction = reader->delta.instructions[index].instruction;
+  } else {
+    data = &reader->data[reader->position];
+    record->instruction = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+    reader->position += 4;
+    reader->delta.instructions[index].pc = record->pc;
+    reader->delta.instructions[index].instruction = record->instruction;
+  }
+
+  if (record->flags & TRACE_RECORD_REGISTER) {
+    record->reg = reader->data[reader->position++] % 32;
+    reader->delta.registers[record->reg] += trace_get_varint(reader);
+    record->reg_value = reader->delta.registers[record->reg];
+  }
+
+  if (record->flags & (TRACE_RECORD_LOAD | TRACE_RECORD_STORE)) {
+    record->size = reader->data[reader->position++];
+    reader->delta.address += trace_get_varint(reader);
+    reader->delta.value += trace_get_varint(reader);
+    record->address = reader->delta.address;
+    record->value = reader->delta.value;
+  }
+
+  return true;
+}
+
+/* Position the reader so that the next record returned is index */
+bool trace_reader_seek(struct TraceReader *reader, uint64_t index)
+{
+  struct TraceRecord record;
+
+  if (fseek(reader->file, sizeof(reader->header), SEEK_SET))
+    return false;
+
+  /* skip whole chunks by their headers */
+  for (;;) {
+    struct TraceChunkHeader chunk;
+
+    if (fread(&chunk, sizeof(chunk), 1, reader->file) != 1)
+      return false;
+
+    if (index < chunk.first_instruction + chunk.records)
+      break;
+
+    if (fseek(reader->file, chunk.compressed_size, SEEK_CUR))
+      return false;
+  }
+
+  if (fseek(reader->file, -(long)sizeof(struct TraceChunkHeader), SEEK_CUR) ||
+      !trace_reader_load_chunk(reader))
+    return false;
+
+  while (reader->index < index)
+    trace_reader_next(reader, &record);
+
+  return true;
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "trace.h"
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-s index] [-n count] trace\n", prog);
+  fprintf(stderr, "  -s  first instruction to print, counted from the start of the trace\n");
+  fprintf(stderr, "  -n  number of instructions to print (default all)\n");
+}
+
+int main(int argc, char *argv[])
+{
+  struct TraceReader *reader;
+  struct TraceRecord record;
+  uint64_t count = UINT64_MAX;
+  uint64_t start = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:n:h")) != -1) {
+    switch (opt) {
+      case 's':
+        start = strtoull(optarg, NULL, 0);
+        break;
+
+      case 'n':
+        count = strtoull(optarg, NULL, 0);
+        break;
+
+      case 'h':
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 1) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  reader = trace_reader_open(argv[optind]);
+  if (!reader)
+    return EXIT_FAILURE;
+
+  if (!trace_reader_seek(reader, start)) {
+    fprintf(stderr, "%s: No instruction %llu in the trace\n", argv[optind], (unsigned long long)start);
+    trace_reader_close(reader);
+    return EXIT_FAILURE;
+  }
+
+  while (count-- && trace_reader_next(reader, &record)) {
+    printf("%12llu %08x: %08x", (unsigned long long)record.index, record.pc, record.instruction);
+
+    if (record.flags & TRACE_RECORD_REGISTER)
+      printf("  %-3s = %08x", regnames[record.reg], record.reg_value);
+
+    if (record.flags & TRACE_RECORD_LOAD)
+      printf("  load%u  [%08x] -> %08x", record.size * 8, record.address, record.value);
+    else if (record.flags & TRACE_RECORD_STORE)
+      printf("  store%u [%08x] <- %08x", record.size * 8, record.address, record.value);
+
+    printf("\n");
+  }
+
+  trace_reader_close(reader);
+  return EXIT_SUCCESS;
+}
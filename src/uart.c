@@ -0,0 +1,441 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rscs.h"
+#include "uart.h"
+#include "machine.h"
+
+/* I/O thread state. The lock protects the channel list and is held by the
+ * I/O thread while it works, never by the guest side of the rings.
+ */
+static pthread_mutex_t uart_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t uart_thread_once = PTHREAD_ONCE_INIT;
+static struct UartChannel *uart_channels;
+static int uart_wake_fd = -1;
+static atomic_bool uart_io_sleeping;
+static atomic_uint uart_lock_waiters;
+
+static void uart_wake(bool force)
+{
+  uint64_t one = 1;
+
+  if (atomic_exchange(&uart_io_sleeping, false) || force) {
+    if (write(uart_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      perror("uart_wake");
+  }
+}
+
+/* Output ring, the guest produces and the I/O thread consumes */
+static bool uart_ring_push(struct UartRing *ring, uint8_t byte)
+{
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  if (head - tail == ring->size)
+    return false;
+
+  ring->data[head & (ring->size - 1)] = byte;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+static bool uart_ring_empty(struct UartRing *ring)
+{
+  return atomic_load_explicit(&ring->head, memory_order_acquire) ==
+         atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/* Write out everything in the output ring. Returns true if there was anything */
+static bool uart_drain(struct UartChannel *channel)
+{
+  struct UartRing *ring = &channel->tx;
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint32_t start = tail & (ring->size - 1);
+  uint32_t count = head - tail;
+  struct iovec iov[2];
+  int iovcnt = 1;
+  ssize_t written;
+
+  if (!count)
+    return false;
+
+  iov[0].iov_base = ring->data + start;
+  iov[0].iov_len = count;
+  if (start + count > ring->size) {
+    iov[0].iov_len = ring->size - start;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = count - iov[0].iov_len;
+    iovcnt = 2;
+  }
+
+  written = writev(channel->out_fd, iov, iovcnt);
+  if (written < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return true;
+    /* nobody is listening anymore, don't spin on it */
+    written = count;
+  }
+
+  atomic_store_explicit(&ring->tail, tail + written, memory_order_release);
+  return true;
+}
+
+/* Input ring, the I/O thread produces and the guest consumes */
+static uint32_t uart_rx_room(struct UartRing *ring)
+{
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  return ring->size - (head - tail);
+}
+
+static void uart_fill(struct UartChannel *channel)
+{
+  struct UartRing *ring = &channel->rx;
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t start = head & (ring->size - 1);
+  uint32_t room = uart_rx_room(ring);
+  ssize_t count;
+
+  if (room > ring->size - start)
+    room = ring->size - start;
+
+  count = read(channel->in_fd, ring->data + start, room);
+  if (count == 0 || (count < 0 && errno != EINTR && errno != EAGAIN)) {
+    channel->in_eof = true;
+    return;
+  }
+
+  if (count > 0)
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+}
+
+static void *uart_io_thread(void *arg)
+{
+  struct pollfd *fds = NULL;
+  struct UartChannel **polled = NULL;
+  uint32_t capacity = 0;
+  bool lingering = false;
+
+  pthread_mutex_lock(&uart_lock);
+  for (;;) {
+    struct UartChannel *channel;
+    bool drained = false;
+    uint32_t count = 1;
+    uint32_t channels = 0;
+    int timeout = -1;
+
+    for (channel = uart_channels; channel; channel = channel->next)
+      channels++;
+
+    if (channels + 1 > capacity) {
+      capacity = 2 * (channels + 1);
+      fds = realloc(fds, capacity * sizeof(*fds));
+      polled = realloc(polled, capacity * sizeof(*polled));
+      if (!fds || !polled) {
+        perror("uart_io_thread");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    fds[0].fd = uart_wake_fd;
+    fds[0].events = POLLIN;
+    for (channel = uart_channels; channel; channel = channel->next) {
+      if (channel->out_fd >= 0 && uart_drain(channel))
+        drained = true;
+
+      if (channel->in_fd >= 0 && !channel->in_eof && uart_rx_room(&channel->rx)) {
+        fds[count].fd = channel->in_fd;
+        fds[count].events = POLLIN;
+        polled[count++] = channel;
+      }
+    }
+
+    /* somebody wants to add or remove a channel */
+    if (atomic_load(&uart_lock_waiters)) {
+      pthread_mutex_unlock(&uart_lock);
+      sched_yield();
+      pthread_mutex_lock(&uart_lock);
+      continue;
+    }
+
+    if (drained || lingering) {
+      /* more output is likely to follow, pick it up without being woken */
+      timeout = UART_LINGER_MS;
+      lingering = drained;
+    } else {
+      bool pending = false;
+
+      atomic_store(&uart_io_sleeping, true);
+      for (channel = uart_channels; channel && !pending; channel = channel->next)
+        pending = !uart_ring_empty(&channel->tx);
+
+      if (pending) {
+        atomic_store(&uart_io_sleeping, false);
+        continue;
+      }
+    }
+
+    if (poll(fds, count, timeout) <= 0)
+      continue;
+
+    if (fds[0].revents & POLLIN) {
+      uint64_t value;
+
+      if (read(uart_wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        perror("uart_io_thread");
+    }
+
+    for (uint32_t i = 1; i < count; i++) {
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+        uart_fill(polled[i]);
+    }
+  }
+
+  return NULL;
+}
+
+static void uart_start_thread()
+{
+  pthread_t thread;
+  sigset_t all;
+  sigset_t saved;
+
+  uart_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (uart_wake_fd < 0) {
+    perror("uart_start_thread");
+    exit(EXIT_FAILURE);
+  }
+
+  /* guest and host signals are handled by the threads running machines */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &saved);
+  if (pthread_create(&thread, NULL, uart_io_thread, NULL)) {
+    perror("uart_start_thread");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(thread);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+static void uart_lock_channels()
+{
+  atomic_fetch_add(&uart_lock_waiters, 1);
+  uart_wake(true);
+  pthread_mutex_lock(&uart_lock);
+  atomic_fetch_sub(&uart_lock_waiters, 1);
+}
+
+static bool uart_ring_init(struct UartRing *ring, uint32_t size)
+{
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->size = size;
+  ring->data = malloc(size);
+  return ring->data != NULL;
+}
+
+static struct UartChannel *uart_register(struct Uart *uart)
+{
+  struct UartChannel *channel = calloc(1, sizeof(*channel));
+
+  if (!channel || !uart_ring_init(&channel->tx, UART_TX_RING_SIZE)
+      || !uart_ring_init(&channel->rx, UART_RX_RING_SIZE)) {
+    perror("uart_register");
+    exit(EXIT_FAILURE);
+  }
+
+  channel->out_fd = uart->out_fd;
+  channel->in_fd = uart->in_fd;
+
+  pthread_once(&uart_thread_once, uart_start_thread);
+  uart_lock_channels();
+  channel->next = uart_channels;
+  uart_channels = channel;
+  pthread_mutex_unlock(&uart_lock);
+
+  uart->channel = channel;
+  return channel;
+}
+
+static void uart_unregister(struct Uart *uart)
+{
+  struct UartChannel *channel = uart->channel;
+  struct UartChannel **link;
+
+  uart_lock_channels();
+  for (link = &uart_channels; *link; link = &(*link)->next) {
+    if (*link == channel) {
+      *link = channel->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&uart_lock);
+
+  free(channel->tx.data);
+  free(channel->rx.data);
+  free(channel);
+  uart->channel = NULL;
+}
+
+void uart_init(struct Machine *m)
+{
+  for (int i = 0; i < UART_COUNT; i++) {
+    m->uart[i].out_fd = STDOUT_FILENO;
+    m->uart[i].in_fd = -1;
+    m->uart[i].channel = NULL;
+    m->uart[i].blocking = false;
+  }
+}
+
+void uart_destroy(struct Machine *m)
+{
+  uart_flush(m);
+
+  for (int i = 0; i < UART_COUNT; i++) {
+    if (m->uart[i].channel)
+      uart_unregister(&m->uart[i]);
+  }
+}
+
+/* Connect a UART to host descriptors, -1 for none */
+void uart_attach(struct Machine *m, uint8_t index, int in_fd, int out_fd, uint8_t flags)
+{
+  struct Uart *uart = &m->uart[index];
+
+  uart->in_fd = in_fd;
+  uart->out_fd = out_fd;
+  uart->blocking = flags & UART_ATTACH_BLOCKING;
+
+  if (uart->channel) {
+    uart_lock_channels();
+    uart->channel->in_fd = in_fd;
+    uart->channel->in_eof = false;
+    uart->channel->out_fd = out_fd;
+    pthread_mutex_unlock(&uart_lock);
+  } else if (in_fd >= 0) {
+    /* input has to be read before the guest asks for it */
+    uart_register(uart);
+  }
+}
+
+/* Wait until the I/O thread wrote out everything the guest sent so far */
+void uart_flush(struct Machine *m)
+{
+  const struct timespec delay = { 0, 100 * 1000 };
+
+  for (int i = 0; i < UART_COUNT; i++) {
+    struct UartChannel *channel = m->uart[i].channel;
+
+    while (channel && channel->out_fd >= 0 && !uart_ring_empty(&channel->tx)) {
+      uart_wake(false);
+      nanosleep(&delay, NULL);
+    }
+  }
+}
+
+static void uart_write(struct Machine *m, uint8_t index, uint32_t data, uint8_t size)
+{
+  struct Uart *uart = &m->uart[index];
+  struct UartChannel *channel = uart->channel;
+
+  if (size != SIZE_BYTE) {
+    fprintf(stderr, "UART invalid size: %d\n", size);
+    return;
+  }
+
+  if (uart->out_fd < 0)
+    return;
+
+  if (!channel)
+    channel = uart_register(uart);
+
+  /* the I/O thread fell a whole ring behind */
+  if (!uart_ring_push(&channel->tx, data)) {
+    const struct timespec delay = { 0, 100 * 1000 };
+
+    if (!uart->blocking) {
+      uart->overruns++;
+      return;
+    }
+
+    uart->stalls++;
+    do {
+      uart_wake(false);
+      nanosleep(&delay, NULL);
+    } while (!uart_ring_push(&channel->tx, data));
+  }
+  uart->tx_bytes++;
+
+  /* pairs with the I/O thread checking the rings after going to sleep */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&uart_io_sleeping, memory_order_relaxed))
+    uart_wake(false);
+}
+
+static uint32_t uart_read(struct Machine *m, uint8_t index, uint8_t size)
+{
+  struct Uart *uart = &m->uart[index];
+  struct UartRing *ring;
+  uint32_t head;
+  uint32_t tail;
+  uint8_t byte;
+
+  if (!uart->channel)
+    return UART_RX_EMPTY;
+
+  ring = &uart->channel->rx;
+  tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (head == tail)
+    return UART_RX_EMPTY;
+
+  byte = ring->data[tail & (ring->size - 1)];
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  uart->rx_bytes++;
+
+  /* the I/O thread stops polling input while the ring is full */
+  if (head - tail == ring->size)
+    uart_wake(true);
+
+  return byte;
+}
+
+#define UART_DEFINE_HANDLERS(n)                                                         \
+  void uart##n##_write(struct Machine *m, uint32_t address, uint32_t data, uint8_t size) \
+  {                                                                                      \
+    uart_write(m, n, data, size);                                                        \
+  }                                                                                      \
+                                                                                         \
+  uint32_t uart##n##_read(struct Machine *m, uint32_t address, uint8_t size)            \
+  {                                                                                      \
+    return uart_read(m, n, size);                                                        \
+  }
+
+UART_DEFINE_HANDLERS(0)
+UART_DEFINE_HANDLERS(1)
+UART_DEFINE_HANDLERS(2)
+UART_DEFINE_HANDLERS(3)
+
+void uart_dump_stats(struct Machine *m)
+{
+  for (int i = 0; i < UART_COUNT; i++) {
+    const struct Uart *uart = &m->uart[i];
+
+    if (uart->channel)
+      fprintf(stderr, "uart%d: %lu bytes out, %lu bytes in, %lu overruns, %lu stalls\n", i,
+              (unsigned long)uart->tx_bytes, (unsigned long)uart->rx_bytes,
+              (unsigned long)uart->overruns, (unsigned long)uart->stalls);
+  }
+}